@@ -1,24 +1,332 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+/*Freed block ranges waiting to be punched out of the disk file*/
+#define DISCARD_QUEUE_LEN 64
+#define DISCARD_INTERVAL_SEC 1
+
+typedef struct discard_range {
+    int start;
+    int nblocks;
+} discard_range;
+
+/*Backend operations; every public disk_* call dispatches through these*/
+typedef struct disk_ops {
+    int (*read)(disk *d, int start_address, int nblocks, void *buffer);
+    int (*write)(disk *d, int start_address, int nblocks, void *buffer);
+    int (*enable_discard)(disk *d, int background);
+    int (*discard)(disk *d, int start_address, int nblocks);
+    int (*flush_discards)(disk *d);
+    int (*close)(disk *d);
+} disk_ops;
+
+typedef struct stripe_member stripe_member;
+
+/*Everything one emulated disk needs; each image file gets its own*/
+struct disk {
+    const disk_ops *ops;
+    FILE* fp;
+    int fd;                 /*raw descriptor of the O_DIRECT backend, else -1*/
+    double L, p;
+    double r;
+    int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+
+    discard_range discard_queue[DISCARD_QUEUE_LEN];
+    int discard_count;
+    int discard_enabled;
+    int discard_worker_running;
+    pthread_t discard_worker;
+    pthread_mutex_t discard_lock;
+    pthread_cond_t discard_wakeup;
+    pthread_mutex_t io_lock;    /*one transfer at a time: callers may be on several threads*/
+
+    /*O_DIRECT backend only*/
+    int direct;             /*O_DIRECT still in effect on fd*/
+    int align;              /*alignment the kernel currently accepts*/
+    char *bounce;
+    size_t bounce_size;
+
+    /*Striped backend only: member disks and the request handed to them*/
+    int nmembers;
+    int stripe_blocks;
+    stripe_member *members;
+    pthread_mutex_t job_lock;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_done;
+    int job_write;
+    int job_start;
+    int job_nblocks;
+    char *job_buffer;
+    int job_pending;
+    int job_failed;
+    int stopping;
+
+    /*RAM backend only*/
+    char *ram;                  /*the whole device*/
+    size_t ram_size;            /*mapped bytes, whole huge pages*/
+    unsigned char *ram_dirty;   /*blocks written since the last checkpoint*/
+    int checkpoint_sec;
+    int checkpoint_running;
+    pthread_t checkpoint_worker;
+    pthread_mutex_t checkpoint_lock;
+    pthread_cond_t checkpoint_wakeup;
+
+    /*I/O trace hook (disk_set_trace); read and set atomically*/
+    disk_trace_fn trace;
+    void *trace_ctx;
+};
+
+static const disk_ops file_ops;
+
+/*The disk behind the legacy init_disk()/read_blocks()/... functions*/
+static disk default_disk = {
+    .ops = &file_ops,
+    .fp = NULL,
+    .fd = -1,
+    .io_lock = PTHREAD_MUTEX_INITIALIZER,
+    .discard_lock = PTHREAD_MUTEX_INITIALIZER,
+    .discard_wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+/*-------------------------------------------------------------------*/
+/*Punches every queued range out of the disk file. Caller holds the  */
+/*discard lock so that no write to those blocks can race the punch.  */
+/*-------------------------------------------------------------------*/
+static int compare_ranges(const void *a, const void *b)
+{
+    return ((const discard_range *)a)->start - ((const discard_range *)b)->start;
+}
+
+static int flush_discards_locked(disk *d)
+{
+    int i, n = 0;
+    int fd = d->fp != NULL ? fileno(d->fp) : d->fd;
+
+    if (d->discard_count == 0 || fd < 0)
+    {
+        d->discard_count = 0;
+        return 0;
+    }
+
+    /*Sort and merge so that each contiguous run is a single punch*/
+    qsort(d->discard_queue, d->discard_count, sizeof(discard_range), compare_ranges);
+    for (i = 1; i < d->discard_count; i++)
+    {
+        discard_range *last = &d->discard_queue[n];
+        if (d->discard_queue[i].start <= last->start + last->nblocks)
+        {
+            int end = d->discard_queue[i].start + d->discard_queue[i].nblocks;
+            if (end > last->start + last->nblocks)
+            {
+                last->nblocks = end - last->start;
+            }
+        }
+        else
+        {
+            d->discard_queue[++n] = d->discard_queue[i];
+        }
+    }
+    n++;
+
+    for (i = 0; i < n; i++)
+    {
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)d->discard_queue[i].start * d->BLOCK_SIZE,
+                      (off_t)d->discard_queue[i].nblocks * d->BLOCK_SIZE) != 0)
+        {
+            /*The backing file system cannot punch holes; stop trying*/
+            if (errno == EOPNOTSUPP || errno == ENOSYS)
+            {
+                d->discard_enabled = 0;
+            }
+            break;
+        }
+    }
+    d->discard_count = 0;
+    return n;
+}
+
+/*-------------------------------------------------------------------*/
+/*Drops the part of every queued range that overlaps a block about   */
+/*to be rewritten. Caller holds the discard lock.                    */
+/*-------------------------------------------------------------------*/
+static void cancel_discards_locked(disk *d, int start_address, int nblocks)
+{
+    int i;
+    int end = start_address + nblocks;
+
+    for (i = 0; i < d->discard_count; i++)
+    {
+        discard_range *q = &d->discard_queue[i];
+        int q_end = q->start + q->nblocks;
+
+        if (q_end <= start_address || q->start >= end)
+        {
+            continue;
+        }
+        if (q->start < start_address && q_end > end && d->discard_count < DISCARD_QUEUE_LEN)
+        {
+            /*Write lands in the middle: keep both sides*/
+            d->discard_queue[d->discard_count].start = end;
+            d->discard_queue[d->discard_count].nblocks = q_end - end;
+            d->discard_count++;
+            q->nblocks = start_address - q->start;
+        }
+        else if (q->start < start_address)
+        {
+            q->nblocks = start_address - q->start;
+        }
+        else if (q_end > end)
+        {
+            q->nblocks = q_end - end;
+            q->start = end;
+        }
+        else
+        {
+            /*Fully covered: remove by swapping in the last entry*/
+            d->discard_queue[i--] = d->discard_queue[--d->discard_count];
+        }
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/*Background worker: punches the queue every DISCARD_INTERVAL_SEC or */
+/*as soon as it fills up.                                            */
+/*-------------------------------------------------------------------*/
+static void *discard_main(void *arg)
+{
+    disk *d = (disk *)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&d->discard_lock);
+    while (d->discard_worker_running)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DISCARD_INTERVAL_SEC;
+        pthread_cond_timedwait(&d->discard_wakeup, &d->discard_lock, &deadline);
+        flush_discards_locked(d);
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+    return NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/*Turns discard on. With background set, a worker thread does the    */
+/*punching; otherwise the queue is flushed when it fills up, on       */
+/*disk_flush_discards() and on disk_close().                          */
+/*-------------------------------------------------------------------*/
+static int file_enable_discard(disk *d, int background)
+{
+    pthread_mutex_lock(&d->discard_lock);
+    d->discard_enabled = 1;
+    if (background && !d->discard_worker_running)
+    {
+        d->discard_worker_running = 1;
+        if (pthread_create(&d->discard_worker, NULL, discard_main, d) != 0)
+        {
+            d->discard_worker_running = 0;
+        }
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Queues a freed block range so its space goes back to the host file */
+/*system. Adjacent ranges are merged as they arrive.                 */
+/*-------------------------------------------------------------------*/
+static int file_discard_blocks(disk *d, int start_address, int nblocks)
+{
+    pthread_mutex_lock(&d->discard_lock);
+    if (!d->discard_enabled || nblocks <= 0 || start_address < 0 || start_address + nblocks > d->MAX_BLOCK)
+    {
+        pthread_mutex_unlock(&d->discard_lock);
+        return 0;
+    }
+
+    if (d->discard_count > 0 &&
+        d->discard_queue[d->discard_count - 1].start + d->discard_queue[d->discard_count - 1].nblocks == start_address)
+    {
+        d->discard_queue[d->discard_count - 1].nblocks += nblocks;
+    }
+    else
+    {
+        if (d->discard_count == DISCARD_QUEUE_LEN)
+        {
+            flush_discards_locked(d);
+        }
+        d->discard_queue[d->discard_count].start = start_address;
+        d->discard_queue[d->discard_count].nblocks = nblocks;
+        d->discard_count++;
+        if (d->discard_count == DISCARD_QUEUE_LEN && d->discard_worker_running)
+        {
+            pthread_cond_signal(&d->discard_wakeup);
+        }
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+    return 0;
+}
+
+/*------------------------------------*/
+/*Punches everything queued right now */
+/*------------------------------------*/
+static int file_flush_discards(disk *d)
+{
+    int n;
+    pthread_mutex_lock(&d->discard_lock);
+    n = flush_discards_locked(d);
+    pthread_mutex_unlock(&d->discard_lock);
+    return n;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
-int close_disk()
+static int file_close(disk *d)
 {
-    if(NULL != fp)
+    /*Stop the discard worker and punch whatever is still queued*/
+    pthread_mutex_lock(&d->discard_lock);
+    if (d->discard_worker_running)
     {
-        fclose(fp);
+        d->discard_worker_running = 0;
+        pthread_cond_signal(&d->discard_wakeup);
+        pthread_mutex_unlock(&d->discard_lock);
+        pthread_join(d->discard_worker, NULL);
+        pthread_mutex_lock(&d->discard_lock);
+    }
+    flush_discards_locked(d);
+    pthread_mutex_unlock(&d->discard_lock);
+
+    if(NULL != d->fp)
+    {
+        fclose(d->fp);
+        d->fp = NULL;
+    }
+    if (d->fd >= 0)
+    {
+        close(d->fd);
+        d->fd = -1;
+    }
+    free(d->bounce);
+    d->bounce = NULL;
+    d->bounce_size = 0;
+    if (d != &default_disk)
+    {
+        pthread_mutex_destroy(&d->discard_lock);
+        pthread_cond_destroy(&d->discard_wakeup);
+        pthread_mutex_destroy(&d->io_lock);
+        free(d);
     }
     return 0;
 }
@@ -26,30 +334,30 @@ int close_disk()
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+static int fresh_disk_file(disk *d, char *filename, int block_size, int num_blocks)
 {
     int i, j;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    d->fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (d->fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
     
     /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    for (i = 0; i < d->MAX_BLOCK; i++)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        for (j = 0; j < d->BLOCK_SIZE; j++)
         {
-            fputc(0, fp);
+            fputc(0, d->fp);
         }
     }
     return 0;
@@ -57,15 +365,15 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+static int existing_disk_file(disk *d, char *filename, int block_size, int num_blocks)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
     
     /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    d->fp = fopen (filename, "r+b");
 
-    if (fp == NULL)
+    if (d->fp == NULL)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
@@ -73,71 +381,1011 @@ int init_disk(char *filename, int block_size, int num_blocks)
     return 0;
 }
 
+/*-------------------------------------------------------------------*/
+/*Allocates an independent disk handle so that several image files   */
+/*can be open in one process. Returns NULL if the file can't be used.*/
+/*-------------------------------------------------------------------*/
+static disk *new_disk()
+{
+    disk *d = (disk *)calloc(1, sizeof(disk));
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    d->ops = &file_ops;
+    d->fd = -1;
+    pthread_mutex_init(&d->discard_lock, NULL);
+    pthread_cond_init(&d->discard_wakeup, NULL);
+    pthread_mutex_init(&d->io_lock, NULL);
+    return d;
+}
+
+disk *open_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    disk *d = new_disk();
+    if (d != NULL && fresh_disk_file(d, filename, block_size, num_blocks) != 0)
+    {
+        disk_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+disk *open_disk(char *filename, int block_size, int num_blocks)
+{
+    disk *d = new_disk();
+    if (d != NULL && existing_disk_file(d, filename, block_size, num_blocks) != 0)
+    {
+        disk_close(d);
+        return NULL;
+    }
+    return d;
+}
+
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+static int file_read_blocks(disk *d, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > d->MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    pthread_mutex_lock(&d->io_lock);
+    fseek(d->fp, (long)start_address * d->BLOCK_SIZE, SEEK_SET);
 
-    /*For every block requested*/
+    /*For every block requested, straight into the caller's buffer*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        fread((char *)buffer+(i*d->BLOCK_SIZE), d->BLOCK_SIZE, 1, d->fp);
     }
+    pthread_mutex_unlock(&d->io_lock);
 
-    free(blockRead);
     return s;
 }
 
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+static int file_write_blocks(disk *d, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > d->MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
 
+    /*Blocks being reused must not be punched out after this write*/
+    pthread_mutex_lock(&d->discard_lock);
+    if (d->discard_count > 0)
+    {
+        cancel_discards_locked(d, start_address, nblocks);
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+
     /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    pthread_mutex_lock(&d->io_lock);
+    fseek(d->fp, (long)start_address * d->BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        usleep(d->L);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
+        fwrite((char *)buffer+(i*d->BLOCK_SIZE), d->BLOCK_SIZE, 1, d->fp);
+        fflush(d->fp);
         s++;
     }
-    free(blockWrite);
+    pthread_mutex_unlock(&d->io_lock);
     return s;
 }
+
+static const disk_ops file_ops = {
+    file_read_blocks,
+    file_write_blocks,
+    file_enable_discard,
+    file_discard_blocks,
+    file_flush_discards,
+    file_close,
+};
+
+/*-------------------------------------------------------------------*/
+/*O_DIRECT backend: transfers bypass the host page cache, so the only */
+/*cached copy of image data is the one the caller keeps. Direct I/O   */
+/*wants buffer, offset and length aligned to the device's logical     */
+/*block size; anything else goes through an aligned bounce buffer,    */
+/*widened to aligned boundaries (read-modify-write for writes). If    */
+/*the kernel keeps refusing, the disk drops to buffered I/O.          */
+/*-------------------------------------------------------------------*/
+#define DIRECT_MIN_ALIGN 512
+#define DIRECT_MAX_ALIGN 4096
+
+/*Grows the bounce buffer to at least bytes; kept until the disk closes*/
+static char *direct_bounce(disk *d, size_t bytes)
+{
+    void *p;
+    if (bytes > d->bounce_size)
+    {
+        if (posix_memalign(&p, DIRECT_MAX_ALIGN, bytes) != 0)
+        {
+            return NULL;
+        }
+        free(d->bounce);
+        d->bounce = (char *)p;
+        d->bounce_size = bytes;
+    }
+    return d->bounce;
+}
+
+/*pread/pwrite the whole range, retrying short transfers*/
+static int direct_transfer(disk *d, int write, char *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = write ? pwrite(d->fd, buf, len, off) : pread(d->fd, buf, len, off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (write)
+            {
+                return -1;
+            }
+            /*Past the end of the image reads as zeros*/
+            memset(buf, 0, len);
+            return 0;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*Relaxes the mode after the kernel rejected a transfer as misaligned*/
+static int direct_degrade(disk *d)
+{
+    int flags;
+    if (d->direct && d->align < DIRECT_MAX_ALIGN)
+    {
+        d->align = DIRECT_MAX_ALIGN;
+        return 0;
+    }
+    if (d->direct)
+    {
+        flags = fcntl(d->fd, F_GETFL);
+        if (flags != -1 && fcntl(d->fd, F_SETFL, flags & ~O_DIRECT) == 0)
+        {
+            printf("O_DIRECT not usable, falling back to buffered I/O\n");
+            d->direct = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int direct_io_locked(disk *d, int write, off_t off, size_t len, char *buffer)
+{
+    size_t a = d->direct ? (size_t)d->align : 1;
+    off_t lo = off / a * a;
+    off_t hi = (off + len + a - 1) / a * a;
+    char *bounce;
+
+    /*Aligned on every count: straight from/to the caller's buffer*/
+    if (lo == off && hi == off + (off_t)len && (uintptr_t)buffer % a == 0)
+    {
+        return direct_transfer(d, write, buffer, len, off);
+    }
+
+    bounce = direct_bounce(d, hi - lo);
+    if (bounce == NULL)
+    {
+        return -1;
+    }
+    if (!write)
+    {
+        if (direct_transfer(d, 0, bounce, hi - lo, lo) != 0)
+        {
+            return -1;
+        }
+        memcpy(buffer, bounce + (off - lo), len);
+        return 0;
+    }
+
+    /*Partial edge sectors are read first so their other bytes survive*/
+    if (lo != off && direct_transfer(d, 0, bounce, a, lo) != 0)
+    {
+        return -1;
+    }
+    if (hi != off + (off_t)len && !(lo != off && hi - (off_t)a == lo) &&
+        direct_transfer(d, 0, bounce + (hi - a - lo), a, hi - a) != 0)
+    {
+        return -1;
+    }
+    memcpy(bounce + (off - lo), buffer, len);
+    return direct_transfer(d, 1, bounce, hi - lo, lo);
+}
+
+static int direct_io(disk *d, int write, int start_address, int nblocks, void *buffer)
+{
+    int rc;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > d->MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Blocks being reused must not be punched out after this write*/
+    if (write)
+    {
+        pthread_mutex_lock(&d->discard_lock);
+        if (d->discard_count > 0)
+        {
+            cancel_discards_locked(d, start_address, nblocks);
+        }
+        pthread_mutex_unlock(&d->discard_lock);
+    }
+
+    pthread_mutex_lock(&d->io_lock);
+    for (;;)
+    {
+        errno = 0;
+        rc = direct_io_locked(d, write, (off_t)start_address * d->BLOCK_SIZE,
+                              (size_t)nblocks * d->BLOCK_SIZE, (char *)buffer);
+        if (rc == 0 || errno != EINVAL || direct_degrade(d) != 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->io_lock);
+    return rc == 0 ? nblocks : -1;
+}
+
+static int direct_read_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    return direct_io(d, 0, start_address, nblocks, buffer);
+}
+
+static int direct_write_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    return direct_io(d, 1, start_address, nblocks, buffer);
+}
+
+static const disk_ops direct_ops = {
+    direct_read_blocks,
+    direct_write_blocks,
+    file_enable_discard,
+    file_discard_blocks,
+    file_flush_discards,
+    file_close,
+};
+
+/*-------------------------------------------------------------------*/
+/*Opens (fresh: creates, all zeros) an image for O_DIRECT access. Data*/
+/*is never cached by the host, so pair it with a cache in the caller. */
+/*Returns NULL if the file cannot be opened at all.                   */
+/*-------------------------------------------------------------------*/
+disk *open_direct_disk(char *filename, int fresh, int block_size, int num_blocks)
+{
+    int flags = O_RDWR | (fresh ? O_CREAT | O_TRUNC : 0);
+    disk *d = new_disk();
+
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    d->ops = &direct_ops;
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
+    d->align = DIRECT_MIN_ALIGN;
+    d->direct = 1;
+
+    d->fd = open(filename, flags | O_DIRECT, 0644);
+    if (d->fd < 0 && errno == EINVAL)
+    {
+        /*File system without O_DIRECT support (e.g. tmpfs)*/
+        d->direct = 0;
+        d->fd = open(filename, flags, 0644);
+    }
+    if (d->fd < 0 || (fresh && ftruncate(d->fd, (off_t)num_blocks * block_size) != 0))
+    {
+        printf("Could not open %s\n\n", filename);
+        disk_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+
+/*-------------------------------------------------------------------*/
+/*Striped backend (RAID-0): block addresses are split into units of  */
+/*stripe_blocks and unit k lives on member k % nmembers at unit      */
+/*k / nmembers. Each member has a worker thread, so the parts of one */
+/*request that land on different members are transferred in parallel*/
+/*-------------------------------------------------------------------*/
+struct stripe_member {
+    disk *dev;
+    disk *array;
+    int index;
+    int assigned;
+    pthread_t worker;
+};
+
+/*Maps one array block to its member block*/
+static int stripe_member_block(disk *d, int block, int *member)
+{
+    int unit = block / d->stripe_blocks;
+    *member = unit % d->nmembers;
+    return (unit / d->nmembers) * d->stripe_blocks + block % d->stripe_blocks;
+}
+
+/*Transfers the part of [start, start + nblocks) that lives on member m*/
+static int stripe_member_io(disk *d, int m, int write, int start, int nblocks, char *buffer)
+{
+    int b = start;
+    int end = start + nblocks;
+    disk *dev = d->members[m].dev;
+
+    while (b < end)
+    {
+        int member;
+        int mb = stripe_member_block(d, b, &member);
+        int run = d->stripe_blocks - b % d->stripe_blocks;
+        if (run > end - b)
+        {
+            run = end - b;
+        }
+        if (member == m)
+        {
+            char *p = buffer + (long)(b - start) * d->BLOCK_SIZE;
+            int s = write ? disk_write_blocks(dev, mb, run, p) : disk_read_blocks(dev, mb, run, p);
+            if (s < 0)
+            {
+                return -1;
+            }
+        }
+        b += run;
+    }
+    return 0;
+}
+
+static void *stripe_worker_main(void *arg)
+{
+    stripe_member *sm = (stripe_member *)arg;
+    disk *d = sm->array;
+
+    pthread_mutex_lock(&d->job_lock);
+    for (;;)
+    {
+        while (!sm->assigned && !d->stopping)
+        {
+            pthread_cond_wait(&d->job_ready, &d->job_lock);
+        }
+        if (d->stopping)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&d->job_lock);
+
+        int failed = stripe_member_io(d, sm->index, d->job_write, d->job_start, d->job_nblocks, d->job_buffer) < 0;
+
+        pthread_mutex_lock(&d->job_lock);
+        sm->assigned = 0;
+        d->job_failed |= failed;
+        if (--d->job_pending == 0)
+        {
+            pthread_cond_signal(&d->job_done);
+        }
+    }
+    pthread_mutex_unlock(&d->job_lock);
+    return NULL;
+}
+
+static int stripe_io(disk *d, int write, int start_address, int nblocks, void *buffer)
+{
+    int i, m, first_member, involved = 0, failed;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > d->MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    if (nblocks == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&d->io_lock);
+
+    /*A request inside one stripe unit touches one member: do it inline*/
+    stripe_member_block(d, start_address, &first_member);
+    if (start_address % d->stripe_blocks + nblocks <= d->stripe_blocks)
+    {
+        failed = stripe_member_io(d, first_member, write, start_address, nblocks, buffer) < 0;
+        pthread_mutex_unlock(&d->io_lock);
+        return failed ? -1 : nblocks;
+    }
+
+    pthread_mutex_lock(&d->job_lock);
+    d->job_write = write;
+    d->job_start = start_address;
+    d->job_nblocks = nblocks;
+    d->job_buffer = (char *)buffer;
+    d->job_failed = 0;
+    for (i = 0; i < d->nmembers; i++)
+    {
+        /*Member of the i-th unit of the request, wrapping round the array*/
+        m = (first_member + i) % d->nmembers;
+        if ((long)i * d->stripe_blocks < start_address % d->stripe_blocks + nblocks)
+        {
+            d->members[m].assigned = 1;
+            involved++;
+        }
+    }
+    d->job_pending = involved;
+    pthread_cond_broadcast(&d->job_ready);
+    while (d->job_pending > 0)
+    {
+        pthread_cond_wait(&d->job_done, &d->job_lock);
+    }
+    failed = d->job_failed;
+    pthread_mutex_unlock(&d->job_lock);
+
+    pthread_mutex_unlock(&d->io_lock);
+    return failed ? -1 : nblocks;
+}
+
+static int stripe_read_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    return stripe_io(d, 0, start_address, nblocks, buffer);
+}
+
+static int stripe_write_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    return stripe_io(d, 1, start_address, nblocks, buffer);
+}
+
+static int stripe_enable_discard(disk *d, int background)
+{
+    int i;
+    for (i = 0; i < d->nmembers; i++)
+    {
+        disk_enable_discard(d->members[i].dev, background);
+    }
+    return 0;
+}
+
+/*Splits a freed range on stripe-unit boundaries and queues each piece*/
+/*on the member that holds it                                         */
+static int stripe_discard_blocks(disk *d, int start_address, int nblocks)
+{
+    int b = start_address;
+    int end = start_address + nblocks;
+
+    if (start_address < 0 || end > d->MAX_BLOCK)
+    {
+        return 0;
+    }
+    while (b < end)
+    {
+        int member;
+        int mb = stripe_member_block(d, b, &member);
+        int run = d->stripe_blocks - b % d->stripe_blocks;
+        if (run > end - b)
+        {
+            run = end - b;
+        }
+        disk_discard_blocks(d->members[member].dev, mb, run);
+        b += run;
+    }
+    return 0;
+}
+
+static int stripe_flush_discards(disk *d)
+{
+    int i, n = 0;
+    for (i = 0; i < d->nmembers; i++)
+    {
+        n += disk_flush_discards(d->members[i].dev);
+    }
+    return n;
+}
+
+static int stripe_close(disk *d)
+{
+    int i;
+
+    pthread_mutex_lock(&d->job_lock);
+    d->stopping = 1;
+    pthread_cond_broadcast(&d->job_ready);
+    pthread_mutex_unlock(&d->job_lock);
+
+    for (i = 0; i < d->nmembers; i++)
+    {
+        if (d->members[i].worker)
+        {
+            pthread_join(d->members[i].worker, NULL);
+        }
+        if (d->members[i].dev != NULL)
+        {
+            disk_close(d->members[i].dev);
+        }
+    }
+    free(d->members);
+    pthread_mutex_destroy(&d->io_lock);
+    pthread_mutex_destroy(&d->job_lock);
+    pthread_cond_destroy(&d->job_ready);
+    pthread_cond_destroy(&d->job_done);
+    pthread_mutex_destroy(&d->discard_lock);
+    pthread_cond_destroy(&d->discard_wakeup);
+    free(d);
+    return 0;
+}
+
+static const disk_ops stripe_ops = {
+    stripe_read_blocks,
+    stripe_write_blocks,
+    stripe_enable_discard,
+    stripe_discard_blocks,
+    stripe_flush_discards,
+    stripe_close,
+};
+
+/*-------------------------------------------------------------------*/
+/*Opens (fresh: creates) a disk of num_blocks blocks striped over     */
+/*nmembers image files in units of stripe_blocks blocks. Callers use  */
+/*it exactly like a single-file disk. Returns NULL on failure.        */
+/*-------------------------------------------------------------------*/
+disk *open_striped_disk(char **filenames, int nmembers, int stripe_blocks, int fresh, int block_size, int num_blocks)
+{
+    int i, units, member_blocks;
+    disk *d;
+
+    if (filenames == NULL || nmembers < 1 || stripe_blocks < 1)
+    {
+        return NULL;
+    }
+    d = new_disk();
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    d->ops = &stripe_ops;
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
+    d->nmembers = nmembers;
+    d->stripe_blocks = stripe_blocks;
+    d->members = (stripe_member *)calloc(nmembers, sizeof(stripe_member));
+    pthread_mutex_init(&d->job_lock, NULL);
+    pthread_cond_init(&d->job_ready, NULL);
+    pthread_cond_init(&d->job_done, NULL);
+    if (d->members == NULL)
+    {
+        stripe_close(d);
+        return NULL;
+    }
+
+    /*Every member holds the same number of whole stripe units*/
+    units = (num_blocks + stripe_blocks - 1) / stripe_blocks;
+    member_blocks = (units + nmembers - 1) / nmembers * stripe_blocks;
+
+    for (i = 0; i < nmembers; i++)
+    {
+        stripe_member *sm = &d->members[i];
+        sm->array = d;
+        sm->index = i;
+        sm->dev = fresh ? open_fresh_disk(filenames[i], block_size, member_blocks)
+                        : open_disk(filenames[i], block_size, member_blocks);
+        if (sm->dev == NULL || pthread_create(&sm->worker, NULL, stripe_worker_main, sm) != 0)
+        {
+            sm->worker = 0;
+            stripe_close(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+/*-------------------------------------------------------------------*/
+/*RAM backend: the whole device lives in one anonymous mapping, huge-*/
+/*page backed where the host allows, so a transfer is a memcpy. With  */
+/*an image file the device is loaded from it on open, and changed    */
+/*blocks are written back to it by disk_checkpoint(), every           */
+/*checkpoint_sec seconds by a worker thread, and on close. Blocks     */
+/*written after the last checkpoint are lost in a crash. The worker   */
+/*knows nothing of the layer above, so its checkpoints may catch an   */
+/*update half done; a file system that needs a consistent image file  */
+/*passes checkpoint_sec 0 and calls disk_checkpoint() when quiescent. */
+/*-------------------------------------------------------------------*/
+#define RAM_HUGE_PAGE (2u << 20)
+#define RAM_CHECKPOINT_RUN 256   /*blocks copied out per lock hold*/
+
+static int ram_read_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > d->MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    pthread_mutex_lock(&d->io_lock);
+    memcpy(buffer, d->ram + (size_t)start_address * d->BLOCK_SIZE, (size_t)nblocks * d->BLOCK_SIZE);
+    pthread_mutex_unlock(&d->io_lock);
+    return nblocks;
+}
+
+static int ram_write_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    if (start_address < 0 || nblocks < 0 || start_address + nblocks > d->MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+    pthread_mutex_lock(&d->io_lock);
+    memcpy(d->ram + (size_t)start_address * d->BLOCK_SIZE, buffer, (size_t)nblocks * d->BLOCK_SIZE);
+    if (d->ram_dirty != NULL)
+    {
+        memset(d->ram_dirty + start_address, 1, nblocks);
+    }
+    pthread_mutex_unlock(&d->io_lock);
+    return nblocks;
+}
+
+/*Nothing to give back: freed blocks simply stay in memory*/
+static int ram_enable_discard(disk *d, int background)
+{
+    (void)d;
+    (void)background;
+    return 0;
+}
+
+static int ram_discard_blocks(disk *d, int start_address, int nblocks)
+{
+    (void)d;
+    (void)start_address;
+    (void)nblocks;
+    return 0;
+}
+
+static int ram_flush_discards(disk *d)
+{
+    (void)d;
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Writes the blocks changed since the last checkpoint to the image    */
+/*file. Runs of them are copied out under the I/O lock a few at a     */
+/*time and written without it, so transfers are never held up by the */
+/*file. Returns the number of blocks written or -1.                   */
+/*-------------------------------------------------------------------*/
+static int ram_checkpoint(disk *d)
+{
+    int b = 0, e, written = 0, failed = 0;
+
+    pthread_mutex_lock(&d->checkpoint_lock);
+    while (b < d->MAX_BLOCK)
+    {
+        pthread_mutex_lock(&d->io_lock);
+        while (b < d->MAX_BLOCK && !d->ram_dirty[b])
+        {
+            b++;
+        }
+        for (e = b; e < d->MAX_BLOCK && e - b < RAM_CHECKPOINT_RUN && d->ram_dirty[e]; e++)
+        {
+            d->ram_dirty[e] = 0;
+        }
+        memcpy(d->bounce, d->ram + (size_t)b * d->BLOCK_SIZE, (size_t)(e - b) * d->BLOCK_SIZE);
+        pthread_mutex_unlock(&d->io_lock);
+
+        if (e > b && pwrite(d->fd, d->bounce, (size_t)(e - b) * d->BLOCK_SIZE, (off_t)b * d->BLOCK_SIZE)
+                         != (ssize_t)(e - b) * d->BLOCK_SIZE)
+        {
+            /*Try again next time*/
+            pthread_mutex_lock(&d->io_lock);
+            memset(d->ram_dirty + b, 1, e - b);
+            pthread_mutex_unlock(&d->io_lock);
+            failed = 1;
+        }
+        written += e - b;
+        b = e;
+    }
+    if (written > 0 && !failed && fdatasync(d->fd) != 0)
+    {
+        failed = 1;
+    }
+    pthread_mutex_unlock(&d->checkpoint_lock);
+    return failed ? -1 : written;
+}
+
+static void *checkpoint_main(void *arg)
+{
+    disk *d = (disk *)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&d->checkpoint_lock);
+    while (d->checkpoint_running)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += d->checkpoint_sec;
+        pthread_cond_timedwait(&d->checkpoint_wakeup, &d->checkpoint_lock, &deadline);
+        if (d->checkpoint_running)
+        {
+            pthread_mutex_unlock(&d->checkpoint_lock);
+            ram_checkpoint(d);
+            pthread_mutex_lock(&d->checkpoint_lock);
+        }
+    }
+    pthread_mutex_unlock(&d->checkpoint_lock);
+    return NULL;
+}
+
+static int ram_close(disk *d)
+{
+    int rc = 0;
+
+    if (d->checkpoint_running)
+    {
+        pthread_mutex_lock(&d->checkpoint_lock);
+        d->checkpoint_running = 0;
+        pthread_cond_signal(&d->checkpoint_wakeup);
+        pthread_mutex_unlock(&d->checkpoint_lock);
+        pthread_join(d->checkpoint_worker, NULL);
+    }
+    if (d->fd >= 0 && d->ram_dirty != NULL && d->bounce != NULL && ram_checkpoint(d) < 0)
+    {
+        printf("Could not write back the RAM disk\n\n");
+        rc = -1;
+    }
+    if (d->ram != NULL)
+    {
+        munmap(d->ram, d->ram_size);
+    }
+    free(d->ram_dirty);
+    pthread_mutex_destroy(&d->checkpoint_lock);
+    pthread_cond_destroy(&d->checkpoint_wakeup);
+    if (file_close(d) != 0)
+    {
+        rc = -1;
+    }
+    return rc;
+}
+
+static const disk_ops ram_ops = {
+    ram_read_blocks,
+    ram_write_blocks,
+    ram_enable_discard,
+    ram_discard_blocks,
+    ram_flush_discards,
+    ram_close,
+};
+
+/*-------------------------------------------------------------------*/
+/*Opens a RAM disk. filename may be NULL for a scratch device that    */
+/*starts zeroed and is dropped on close. Otherwise fresh creates the  */
+/*image file (all zeros) and !fresh loads it. checkpoint_sec > 0      */
+/*starts the periodic checkpoint. Returns NULL on failure.            */
+/*-------------------------------------------------------------------*/
+disk *open_ram_disk(char *filename, int fresh, int checkpoint_sec, int block_size, int num_blocks)
+{
+    size_t bytes = (size_t)num_blocks * block_size;
+    size_t done = 0;
+    ssize_t n;
+    disk *d = new_disk();
+
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    d->ops = &ram_ops;
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
+    pthread_mutex_init(&d->checkpoint_lock, NULL);
+    pthread_cond_init(&d->checkpoint_wakeup, NULL);
+
+    /*Explicit huge pages if some are reserved, else transparent ones*/
+    d->ram_size = (bytes + RAM_HUGE_PAGE - 1) / RAM_HUGE_PAGE * RAM_HUGE_PAGE;
+    d->ram = mmap(NULL, d->ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (d->ram == MAP_FAILED)
+    {
+        d->ram = mmap(NULL, d->ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (d->ram != MAP_FAILED)
+        {
+            madvise(d->ram, d->ram_size, MADV_HUGEPAGE);
+        }
+    }
+    if (d->ram == MAP_FAILED)
+    {
+        d->ram = NULL;
+        printf("Could not allocate a RAM disk of %zu bytes\n\n", bytes);
+        disk_close(d);
+        return NULL;
+    }
+    if (filename == NULL)
+    {
+        return d;
+    }
+
+    d->fd = open(filename, O_RDWR | (fresh ? O_CREAT | O_TRUNC : 0), 0644);
+    d->ram_dirty = (unsigned char *)calloc(num_blocks, 1);
+    d->bounce = (char *)malloc((size_t)RAM_CHECKPOINT_RUN * block_size);
+    if (d->fd < 0 || d->ram_dirty == NULL || d->bounce == NULL ||
+        (fresh && ftruncate(d->fd, (off_t)bytes) != 0))
+    {
+        printf("Could not open %s\n\n", filename);
+        disk_close(d);
+        return NULL;
+    }
+    /*A short image reads as zeros past its end*/
+    while (!fresh && done < bytes && (n = pread(d->fd, d->ram + done, bytes - done, (off_t)done)) != 0)
+    {
+        if (n < 0)
+        {
+            printf("Could not read %s\n\n", filename);
+            disk_close(d);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+    if (checkpoint_sec > 0)
+    {
+        d->checkpoint_sec = checkpoint_sec;
+        d->checkpoint_running = 1;
+        if (pthread_create(&d->checkpoint_worker, NULL, checkpoint_main, d) != 0)
+        {
+            d->checkpoint_running = 0;
+        }
+    }
+    return d;
+}
+
+
+/*-------------------------------------------------------------------*/
+/*Handle-based interface: dispatches to the disk's backend           */
+/*-------------------------------------------------------------------*/
+static long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*Times one transfer and hands it to the trace hook*/
+static int traced_io(disk *d, disk_trace_fn fn, int write, int start_address, int nblocks, void *buffer)
+{
+    long long begin = monotonic_ns();
+    int result = write ? d->ops->write(d, start_address, nblocks, buffer)
+                       : d->ops->read(d, start_address, nblocks, buffer);
+    fn(__atomic_load_n(&d->trace_ctx, __ATOMIC_ACQUIRE), write, start_address, nblocks, result,
+       begin, monotonic_ns());
+    return result;
+}
+
+int disk_read_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    disk_trace_fn fn = __atomic_load_n(&d->trace, __ATOMIC_ACQUIRE);
+    if (fn)
+    {
+        return traced_io(d, fn, 0, start_address, nblocks, buffer);
+    }
+    return d->ops->read(d, start_address, nblocks, buffer);
+}
+
+int disk_write_blocks(disk *d, int start_address, int nblocks, void *buffer)
+{
+    disk_trace_fn fn = __atomic_load_n(&d->trace, __ATOMIC_ACQUIRE);
+    if (fn)
+    {
+        return traced_io(d, fn, 1, start_address, nblocks, buffer);
+    }
+    return d->ops->write(d, start_address, nblocks, buffer);
+}
+
+void disk_set_trace(disk *d, disk_trace_fn fn, void *ctx)
+{
+    if (fn)
+    {
+        __atomic_store_n(&d->trace_ctx, ctx, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&d->trace, fn, __ATOMIC_RELEASE);
+}
+
+int disk_enable_discard(disk *d, int background)
+{
+    return d->ops->enable_discard(d, background);
+}
+
+int disk_discard_blocks(disk *d, int start_address, int nblocks)
+{
+    return d->ops->discard(d, start_address, nblocks);
+}
+
+int disk_flush_discards(disk *d)
+{
+    return d->ops->flush_discards(d);
+}
+
+int disk_close(disk *d)
+{
+    return d->ops->close(d);
+}
+
+int disk_checkpoint(disk *d)
+{
+    if (d->ops != &ram_ops || d->ram_dirty == NULL)
+    {
+        return 0;
+    }
+    return ram_checkpoint(d);
+}
+
+
+/*-------------------------------------------------------------------*/
+/*Legacy single-disk interface: the same operations on one built-in  */
+/*disk, kept so existing callers need no changes.                    */
+/*-------------------------------------------------------------------*/
+disk *legacy_disk()
+{
+    return &default_disk;
+}
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    return fresh_disk_file(&default_disk, filename, block_size, num_blocks);
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    return existing_disk_file(&default_disk, filename, block_size, num_blocks);
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_read_blocks(&default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write_blocks(&default_disk, start_address, nblocks, buffer);
+}
+
+int close_disk()
+{
+    return disk_close(&default_disk);
+}
+
+int enable_discard(int background)
+{
+    return disk_enable_discard(&default_disk, background);
+}
+
+int discard_blocks(int start_address, int nblocks)
+{
+    return disk_discard_blocks(&default_disk, start_address, nblocks);
+}
+
+int flush_discards()
+{
+    return disk_flush_discards(&default_disk);
+}
@@ -1,5 +1,40 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int enable_discard(int background);
+int discard_blocks(int start_address, int nblocks);
+int flush_discards();
+
+/* Handle-based interface: one disk per image file, any number per process.
+   The functions above operate on the disk returned by legacy_disk(). */
+typedef struct disk disk;
+
+disk *open_fresh_disk(char *filename, int block_size, int num_blocks);
+disk *open_disk(char *filename, int block_size, int num_blocks);
+disk *open_direct_disk(char *filename, int fresh, int block_size, int num_blocks);
+disk *open_striped_disk(char **filenames, int nmembers, int stripe_blocks, int fresh, int block_size, int num_blocks);
+disk *open_ram_disk(char *filename, int fresh, int checkpoint_sec, int block_size, int num_blocks);
+disk *legacy_disk();
+int disk_read_blocks(disk *d, int start_address, int nblocks, void *buffer);
+int disk_write_blocks(disk *d, int start_address, int nblocks, void *buffer);
+int disk_close(disk *d);
+int disk_enable_discard(disk *d, int background);
+int disk_discard_blocks(disk *d, int start_address, int nblocks);
+int disk_flush_discards(disk *d);
+/* Writes a RAM disk's changed blocks to its image file; 0 for other disks. */
+int disk_checkpoint(disk *d);
+
+/* Optional I/O trace hook: called after every disk_read_blocks/
+   disk_write_blocks on d with the request, its result and its start and
+   end time (CLOCK_MONOTONIC, ns).  fn may be called from any thread that
+   does I/O on d; pass NULL to remove it.  ctx must stay valid until then. */
+typedef void (*disk_trace_fn)(void *ctx, int write, int start_address, int nblocks, int result,
+                              long long begin_ns, long long end_ns);
+void disk_set_trace(disk *d, disk_trace_fn fn, void *ctx);
+
+#endif
@@ -60,6 +60,17 @@ inode_table *itable;
 directory *root_directory;
 file_descriptor *fdtable;
 bitmap bit_map; 
+//largest file the direct + single indirect pointers can describe, in blocks
+#define max_file_block (12 + block_size/sizeof(int))
+//per-mount arena: the long-lived tables and the write scratch space live
+//here for the whole run instead of being malloc'd on every mksfs/sfs_fwrite
+static struct mount_arena {
+    file_descriptor fdtable;
+    directory root_directory;
+    inode_table itable;
+    char write_buffer[(max_file_block + 1) * block_size];
+    char merge_buffer[(max_file_block + 1) * block_size];
+} arena;
 void initialization(file_descriptor *fdtabl, directory *root_directo, inode_table *itab){
     for (int i = 0; i < number_of_inode; i++){
         fdtabl->file_descrip[i].free = 1;
@@ -79,9 +90,9 @@ void initialization(file_descriptor *fdtabl, directory *root_directo, inode_tabl
 //main dishes
 void mksfs(int fresh) {
     //overall structure 
-    fdtable = malloc(sizeof(file_descriptor));
-    root_directory = malloc(sizeof(directory));
-    itable = malloc(sizeof(inode_table));
+    fdtable = &arena.fdtable;
+    root_directory = &arena.root_directory;
+    itable = &arena.itable;
     initialization(fdtable, root_directory, itable); 
     if (fresh == 1) {
         remove(my_disk);
@@ -370,6 +381,11 @@ int sfs_fwrite(int fd_pointer, const char* buf, int size_of_buf){
         printf("rw pointer is pointing at somewhere weird\n");
         return -1;
     }
+    //the scratch buffers in the arena cover the largest possible file
+    if (size_of_buf < 0 || (size_of_buf + current_rw_pointer) / 1024 + 1 > max_file_block){
+        printf("file would exceed the maximum file size\n");
+        return -1;
+    }
     //if using the knowledge learnt from data structure course
     //the following case will be the most simple case 
     //where we are only going to write to the first line
@@ -390,7 +406,7 @@ int sfs_fwrite(int fd_pointer, const char* buf, int size_of_buf){
         read_blocks(itable->inode_tab[i_node_ind].indpointer, 1, &indblock);
     }
     if (size_of_i_node == 0 && size_of_buf < 1024){ //case 1
-        char *Buffers = malloc(1024);
+        char *Buffers = arena.write_buffer;
         strcpy(Buffers, buf);
         //find out how many block that we have to allocate using size_of_buf
         int num_block = ((size_of_buf)/1024) + 1;
@@ -421,7 +437,7 @@ int sfs_fwrite(int fd_pointer, const char* buf, int size_of_buf){
    } else if (size_of_i_node == 0){ //case 2 size != 0 
                     //case 2 ((i_nodesize/1024) > 1;inode_size == 0): 
                     //we are going to start at size 0
-                    char *Bufferss = malloc(((size_of_buf/1024) + 1)*1024);
+                    char *Bufferss = arena.write_buffer;
                     strcpy(Bufferss, buf);
                     int num_block_to_allocate = ((size_of_buf/1024) + 1);
                     if (num_block_to_allocate <= 12){
@@ -475,11 +491,11 @@ int sfs_fwrite(int fd_pointer, const char* buf, int size_of_buf){
        int current_rw_pointer = fdtable->file_descrip[fd_pointer].rw_pointer;
        */
        //block we will start writing at
-       char *Buffee = malloc((((size_of_buf)/1024) + 1)*1024);
+       char *Buffee = arena.write_buffer;
        strcpy(Buffee, buf);
        int block_writing_at = ((current_rw_pointer/1024) + 1);
        int byte_writing_at = (current_rw_pointer);
-       char *Bufferss = malloc((((size_of_buf + current_rw_pointer)/1024) + 1)*1024);
+       char *Bufferss = arena.merge_buffer;
        int num_block_to_allocate = (((size_of_buf + current_rw_pointer)/1024) + 1);
        //read from original block
        //int a =(((size_of_buf + current_rw_pointer)/1024) + 1)*1024;
@@ -554,25 +570,17 @@ int sfs_fwrite(int fd_pointer, const char* buf, int size_of_buf){
                     //allocate them randomly into bitmap
 }
 int sfs_fread(int fd_pointer, char* buf, int size_of_buf){
-    //find the inode index
-    //what is the size of the inode 
-    //separate into three cases
-    //case 1: most simple 1, rw pointer at 0 and only one block (already implmented)
-    //case 2: read more than one block and starting from 0
-    //        this will be easy since we implment the block sequentially
-    //        **read(location of pointer[0], (sizeof(buffer))/1024, buf)
-    //        make sure to get the block from indirect pointer when 
-    //        (sizeof(buffer) / 1024 + 1) > 12
-    //        update the rw pointer and memory in the end
-    //case 3: read more than one block and starting from x
-    //        get the block where x is, using sizeof(x)/1024
-    //        for example: sizeof(x)/1024 = 6, we will start at pointer[6]
-    //        for example: sizeof(x)/1024 = 8, we will start at pointer[8]
-    //        for example: sizeof(x)/1024 = 13, we will start at first element of the indirect pointer
-    //        read the content starting from the pointer
-    //        **read(location of pointer[0], sizeof(buffer)/1024, buf)
-    //        update the rw pointer and memory in the end
-    if (fdtable->file_descrip[fd_pointer].free == 1){
+    //streaming read: only the blocks covering [rw_pointer, rw_pointer + len)
+    //are touched. whole blocks go straight into buf (physically consecutive
+    //ones in a single read_blocks call), the partial first and last block go
+    //through one reusable block buffer, and the indirect block is read at
+    //most once per call. memcpy keeps binary data intact.
+    static char block_buffer[block_size];
+    indirectblock indblock;
+    int ind_loaded = 0;
+    int run_start = -1, run_len = 0;
+    char *run_dst = NULL;
+    if (fd_pointer < 0 || fd_pointer >= number_of_inode || fdtable->file_descrip[fd_pointer].free == 1){
         return -1;
     }
     //find the i_node in the i_node table as well as the size
@@ -583,65 +591,65 @@ int sfs_fread(int fd_pointer, char* buf, int size_of_buf){
         printf("reading something that is out of range");
         return -1;
     }
-    //where is the current rw pointer
-    //case 1 rw pointer = 0
-    if (pointer == 0 && size_of_i_node < 1024){
-        //start reading from the first pointer
-        int block = itable->inode_tab[i_node_ind].pointer[0];
-        //allocate a space for 1 block
-        char *bufferess = malloc(1024);
-        read_blocks(block, 1, bufferess);
-        strcpy(buf, bufferess);
-        if (size_of_buf > size_of_i_node){
-            fdtable->file_descrip[fd_pointer].rw_pointer = size_of_i_node;}
-        else {
-            fdtable->file_descrip[fd_pointer].rw_pointer = size_of_buf;
+    //never read past the end of the file
+    int to_read = size_of_buf;
+    if (to_read > size_of_i_node - pointer){
+        to_read = size_of_i_node - pointer;
+    }
+    int done = 0;
+    while (done < to_read){
+        int logical = (pointer + done) / block_size;
+        int offset = (pointer + done) % block_size;
+        int chunk = block_size - offset;
+        if (chunk > to_read - done){
+            chunk = to_read - done;
         }
-        free(bufferess);
-    } else if (pointer == 0){
-        //when size of buffer > size of i node 
-        //we are just going to read everything into buf
-        //since we have sequential block, once we have the rwpointer 
-        //we can just read the sequential number of the block starting from the location 
-        //of the pointer
-        int num_block = ((size_of_buf/1024) + 1);
-        char *bufferss = malloc(((size_of_buf/1024) + 1)*1024);
-        int block = itable->inode_tab[i_node_ind].pointer[0];
-        read_blocks(block, num_block, bufferss);
-        strcpy(buf, bufferss);
-        if (size_of_buf >size_of_i_node ){
-        fdtable->file_descrip[fd_pointer].rw_pointer = size_of_i_node;}
-        else {
-            fdtable->file_descrip[fd_pointer].rw_pointer = size_of_buf;
+        //map the logical block through the direct or the indirect pointers
+        int block;
+        if (logical < 12){
+            block = itable->inode_tab[i_node_ind].pointer[logical];
+        } else if (logical - 12 < (int)(block_size/sizeof(int)) && itable->inode_tab[i_node_ind].indpointer != -1){
+            if (!ind_loaded){
+                read_blocks(itable->inode_tab[i_node_ind].indpointer, 1, &indblock);
+                ind_loaded = 1;
+            }
+            block = indblock.pointer[logical - 12];
+        } else {
+            block = -1;
         }
-        free(bufferss);
-    } else if (size_of_buf + pointer >= size_of_i_node){
-        char* buffeerrs = malloc(((size_of_i_node/1024)+1)*1024);
-        int num_block = ((size_of_i_node/1024) + 1);
-        int block = itable->inode_tab[i_node_ind].pointer[0];
-        //read everything into buffeerrrs
-        read_blocks(block, num_block, buffeerrs);
-        //copy the part that we are interested (where the rw is pointing to into buf)
-        memcpy(buf, buffeerrs + pointer, size_of_buf);
-        fdtable->file_descrip[fd_pointer].rw_pointer = size_of_i_node;
-        free(buffeerrs);
-    } 
-    else {
-        //where pointer is not 0
-       // printf("we have arrived here\n");
-        char* buffeerrs = malloc(((size_of_i_node/1024)+1)*1024);
-        int num_block = ((size_of_i_node/1024) + 1);
-        int block = itable->inode_tab[i_node_ind].pointer[0];
-        //read everything into buffeerrrs
-        read_blocks(block, num_block, buffeerrs);
-        //copy it to buf
-        //printf("buffeerrs is %s \n", buffeerrs);
-        //also again copy everything that we are interested into buf
-        memcpy(buf, buffeerrs + pointer , (size_of_i_node));
-        fdtable->file_descrip[fd_pointer].rw_pointer = size_of_buf + pointer;
-        free(buffeerrs);
-    }
-    return size_of_buf;
+        if (chunk == block_size && block >= 0 && block < total_number_of_block){
+            //extend the pending run of whole blocks if this one follows it
+            if (run_len > 0 && block == run_start + run_len){
+                run_len++;
+            } else {
+                if (run_len > 0){
+                    read_blocks(run_start, run_len, run_dst);
+                }
+                run_start = block;
+                run_len = 1;
+                run_dst = buf + done;
+            }
+            done += chunk;
+            continue;
+        }
+        if (run_len > 0){
+            read_blocks(run_start, run_len, run_dst);
+            run_len = 0;
+        }
+        if (block < 0 || block >= total_number_of_block){
+            //nothing mapped here, reads as zeros
+            memset(buf + done, 0, chunk);
+        } else {
+            read_blocks(block, 1, block_buffer);
+            memcpy(buf + done, block_buffer + offset, chunk);
+        }
+        done += chunk;
+    }
+    if (run_len > 0){
+        read_blocks(run_start, run_len, run_dst);
+    }
+    fdtable->file_descrip[fd_pointer].rw_pointer = pointer + done;
+    return done;
 }
 int sfs_fseek(int fd_pointer, int size){
     //make rw pointer of the fd pointer -> pointing to 0
@@ -651,96 +659,74 @@ int sfs_fseek(int fd_pointer, int size){
     fdtable->file_descrip[fd_pointer].rw_pointer = size;
     return 1;
 }
+//release a data block: the bitmap is the only record that matters, the
+//old contents are never read again so they are discarded rather than zeroed.
+//the block is only noted in freed[]; the caller discards it once the tables
+//that stop pointing at it are on disk
+void free_block(int block, int* freed, int* nfreed){
+    if (block < 23 || block >= total_number_of_block){
+        return;
+    }
+    bit_map.map[block] = 1;
+    freed[(*nfreed)++] = block;
+}
 int sfs_remove(char* buf){
-    //case 1 only one block to clean (already implemented)
-    //case 2 more than 1 block to clean
-    //        also very easy, if we have more than 12 blocks then we loop throught 12 block
-    //        if we have 13 blocks then we loop throught 12 block cleaning + 1 indirect pointer cleaning
-    //        this is not implmented simply because write and read is not done yet.
-    //        rest of cleaning is the same as case 1 (already implmented)
-    //        the key of this problem is to clean every pointer block with 0
+    //removal is metadata only: walk the direct pointers and the live part
+    //of the indirect block, mark every block free in the bitmap, persist the
+    //tables and only then queue the blocks for discard, so a crash never
+    //leaves the on-disk inode pointing at a punched block.
+    //no data block is written.
     int i_node = check_exist_dir(buf);
     if (i_node == -1){
         printf("no need to remove since the file dont even exist");
         return -1;
     }
-    if (itable->inode_tab[i_node].size < 1024){
-        //clean the memory 
-        int block = itable->inode_tab[i_node].pointer[0];
-        void* bufe = malloc(1024);
-        memset(bufe, 0, 1024);
-        write_blocks(block, 1, bufe);
-        //reset bitmap
-        int indblock = itable->inode_tab[i_node].indpointer;
-        void* bufe2 = malloc(1024);
-        memset(bufe2, 0, 1024);
-        write_blocks(indblock, 1, bufe2);
-        bit_map.map[indblock] = 1;
-        bit_map.map[block] = 1;
-        //reset inode table
-        itable->inode_tab[i_node].free = 1;
-        itable->inode_tab[i_node].size = -1;
-        itable->inode_tab[i_node].pointer[0] = -1;
-        itable->inode_tab[i_node].indpointer = -1;
-        //reset dir
-        int dir_index = check_dir_pos(buf);
-        root_directory->director[dir_index].free = 1;
-        root_directory->director[dir_index].inode = -1;
-        char* string = " ";
-        memcpy(root_directory->director[dir_index].filename, string, 19);
-        //reset fd
-        int fd_pointers = check_inode_in_fd(fdtable, i_node);
-        sfs_fclose(fd_pointers);
-        free(bufe);
-        free(bufe2);
-        //write the new thing into table
-        write_blocks(1, 12, itable);
-        write_blocks(13, 7, root_directory);
-        write_blocks(20, 3, &bit_map);
+    int freed[max_file_block + 1];
+    int nfreed = 0;
+    int size_of_inode = itable->inode_tab[i_node].size;
+    int num_block_in_inode = size_of_inode > 0 ? (size_of_inode + 1023) / 1024 : 0;
+    for (int i = 0; i < 12; i++){
+        if (itable->inode_tab[i_node].pointer[i] != -1){
+            free_block(itable->inode_tab[i_node].pointer[i], freed, &nfreed);
+            itable->inode_tab[i_node].pointer[i] = -1;
+        }
     }
-    else {
-        //clean the memory 
-        int block = itable->inode_tab[i_node].pointer[0];
-        int size_of_inode =  itable->inode_tab[i_node].size;
-        int num_block_in_inode = ((size_of_inode/1024) + 1);
-        int a = itable->inode_tab[i_node].pointer[0];
-        for (int i = 0; i < num_block_in_inode; i++){
-            if (num_block_in_inode < 12){
-            bit_map.map[itable->inode_tab[i_node].pointer[i]] = 1;
-            itable->inode_tab[i_node].pointer[i] = -1;} else {
-                bit_map.map[a] = 1;
+    int indblock = itable->inode_tab[i_node].indpointer;
+    if (indblock != -1){
+        //only the first (blocks - 12) entries belong to this file, the rest
+        //of the indirect block may hold stale pointers from an earlier owner
+        if (num_block_in_inode > 12){
+            indirectblock ind;
+            read_blocks(indblock, 1, &ind);
+            int used = num_block_in_inode - 12;
+            if (used > block_size/sizeof(int)){
+                used = block_size/sizeof(int);
             }
-            a++;
-       }
-
-        int indblock = itable->inode_tab[i_node].indpointer;
-        void* bufe2 = malloc(1024);
-        memset(bufe2, 0, 1024);
-        write_blocks(indblock, 1, bufe2);
-
-        void* bufe = malloc(size_of_inode);
-        memset(bufe, 0, size_of_inode);
-        write_blocks(block, num_block_in_inode, bufe);
-        //reset inode table
-        bit_map.map[indblock] = 1;
-        itable->inode_tab[i_node].indpointer = -1;
-        itable->inode_tab[i_node].free = 1;
-        itable->inode_tab[i_node].size = -1;
-        //reset dir
-        int dir_index = check_dir_pos(buf);
-        root_directory->director[dir_index].free = 1;
-        root_directory->director[dir_index].inode = -1;
-        char* string = " ";
-        memcpy(root_directory->director[dir_index].filename, string, 19);
-        //reset fd
-        int fd_pointers = check_inode_in_fd(fdtable, i_node);
-        sfs_fclose(fd_pointers);
-        free(bufe);
-        free(bufe2);
-        //write the new thing into table
-        write_blocks(1, 12, itable);
-        write_blocks(13, 7, root_directory);
-        write_blocks(20, 3, &bit_map);
+            for (int i = 0; i < used; i++){
+                free_block(ind.pointer[i], freed, &nfreed);
+            }
+        }
+        free_block(indblock, freed, &nfreed);
+    }
+    //reset inode table
+    itable->inode_tab[i_node].indpointer = -1;
+    itable->inode_tab[i_node].free = 1;
+    itable->inode_tab[i_node].size = -1;
+    //reset dir
+    int dir_index = check_dir_pos(buf);
+    root_directory->director[dir_index].free = 1;
+    root_directory->director[dir_index].inode = -1;
+    char* string = " ";
+    memcpy(root_directory->director[dir_index].filename, string, 2);
+    //reset fd
+    int fd_pointers = check_inode_in_fd(fdtable, i_node);
+    sfs_fclose(fd_pointers);
+    //write the new thing into table
+    write_blocks(1, 12, itable);
+    write_blocks(13, 7, root_directory);
+    write_blocks(20, 3, &bit_map);
+    for (int i = 0; i < nfreed; i++){
+        discard_blocks(freed[i], 1);
     }
     return 1;
 }
@@ -756,7 +742,10 @@ int sfs_getnextfilename(char* file){
     return -1;
 }
 int sfs_getfilesize(const char* filename){
-    char *Buffers = malloc(sizeof(filename));
+    char Buffers[max_file_name + 1];
+    if (strlen(filename) > max_file_name){
+        return -1;
+    }
     strcpy(Buffers, filename);
     int result = check_exist_dir(Buffers);
     if (result == -1){return -1;}else {
@@ -36,8 +36,31 @@
 #include <string>       // std::string
 #include <array>        // std::array
 #include <memory>       // std::unique_ptr
+#include <new>          // placement new, std::align_val_t
 #include <vector>       // std::vector
+#include <algorithm>    // std::copy_n, std::min
+#include <numeric>      // std::accumulate
+#include <map>          // free extents by offset
+#include <set>          // free extents by size
+#include <bitset>       // log‑mode fresh blocks
 #include <iostream>     // std::cerr for user‑friendly diagnostics
+#include <unordered_map> // fingerprint → block dedup index, dentry cache
+#include <cstddef>      // std::byte
+#include <stdexcept>    // std::runtime_error
+#include <atomic>       // lock‑free block‑buffer pool
+#include <memory_resource> // pooled node allocation for the indexes
+#include <type_traits>  // std::is_trivially_destructible_v
+#include <mutex>        // per‑mount lock
+#include <thread>       // writeback flusher
+#include <condition_variable>
+#include <chrono>
+#include <ctime>        // snapshot creation time
+#include <tuple>        // std::tie
+#include <string_view>  // fsck name sets
+#include <fcntl.h>      // open, for sfs_inspect
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
+#include <unistd.h>     // close
 
 //  Third‑party C header (provided by the assignment framework)
 extern "C" {
@@ -52,13 +75,42 @@ namespace sfs {
 
 constexpr std::uint32_t BLOCK_SIZE           = 1024;   ///< Bytes per block
 constexpr std::uint32_t MAX_FILE_NAME_LEN    = 20;     ///< Max ASCII chars (excluding NUL)
-constexpr std::uint32_t NUM_INODES           = 200;    ///< Fixed inode table size
+constexpr std::uint32_t MAX_OPEN_FILES       = 200;    ///< Descriptor table size
 constexpr std::uint32_t TOTAL_BLOCKS         = 3000;   ///< Size of the fake disk image
-constexpr std::uint32_t DIR_BLOCK            = 14;     ///< First block reserved for root dir
 constexpr const char    DISK_NAME[]          = "jojo_disk"; ///< Backing file name
 
-//  Magic number used by the reference solution – kept for compatibility
-constexpr std::uint32_t MAGIC_NUMBER = 0xACBD0005;
+//  Magic number of this layout.  The reference solution's 0xACBD0005
+//  images keep file data in blocks 23+, where this layout has its block
+//  tables, and 0xACBD0006 images keep the root in a flat table in blocks
+//  13‑19, where this layout has inodes, so both are refused rather than
+//  misread.
+constexpr std::uint32_t MAGIC_NUMBER    = 0xACBD0007;
+constexpr std::uint32_t LEGACY_MAGIC    = 0xACBD0005;
+constexpr std::uint32_t FLAT_ROOT_MAGIC = 0xACBD0006;
+
+//  Allocation policy.
+constexpr std::uint32_t MAX_FILE_BLOCKS      = 12 + BLOCK_SIZE / sizeof(std::int32_t); ///< direct + single indirect
+constexpr std::uint32_t LOCALITY_WINDOW      = 256;    ///< How far past a goal block we look for a fit
+constexpr std::uint32_t PREALLOC_WINDOW      = 8;      ///< Extra blocks reserved per FD for later appends
+
+//  Block‑sharing meta‑data lives right after the bitmap (blocks 20‑22).
+constexpr std::uint32_t REFCOUNT_BLOCK       = 23;     ///< First block of the per‑block reference counts
+constexpr std::uint32_t REFCOUNT_BLOCKS      = (TOTAL_BLOCKS * sizeof(std::uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+constexpr std::uint32_t FPRINT_BLOCK         = REFCOUNT_BLOCK + REFCOUNT_BLOCKS; ///< First block of the fingerprints
+constexpr std::uint32_t FPRINT_BLOCKS        = (TOTAL_BLOCKS * sizeof(std::uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+constexpr std::uint32_t DATA_BLOCK           = FPRINT_BLOCK + FPRINT_BLOCKS; ///< First block past the fixed meta‑data
+
+//  Inode types (Inode::type).  Inode 0 is always the root directory.
+constexpr std::uint8_t  INODE_FILE           = 0;
+constexpr std::uint8_t  INODE_DIR            = 1;      ///< Entries live in a B+tree rooted at direct[0]
+constexpr std::int32_t  ROOT_INODE           = 0;
+
+//  Feature bits recorded in SuperBlock::features.
+constexpr std::uint32_t FEATURE_DEDUP        = 1u << 0; ///< Content‑addressed data blocks
+constexpr std::uint32_t FEATURE_LOG          = 1u << 1; ///< Log‑structured data placement
+
+constexpr std::size_t   MAX_SNAPSHOTS        = 16;     ///< Snapshot slots in the super‑block
+constexpr std::uint32_t SNAPSHOT_MAGIC       = 0x534E4150; ///< "SNAP" – marks a snapshot header
 
 //─────────────────────────────────────────────────────────────────────────────
 //  POD‑style structures.  The memory layout must stay 100 % identical to the
@@ -66,25 +118,53 @@ constexpr std::uint32_t MAGIC_NUMBER = 0xACBD0005;
 //  virtual functions and keep the aggregates *trivially* copyable.
 //─────────────────────────────────────────────────────────────────────────────
 
+/// On‑disk inode (direct‑only for first 12 data blocks; single‑level indirect).
+struct Inode {
+    std::uint8_t  free      = 1;                              ///< 1 → unused, 0 → allocated
+    std::uint8_t  type      = INODE_FILE;                     ///< INODE_FILE / INODE_DIR (former padding)
+    std::int32_t  size      = -1;                             ///< File size in *bytes* (entry count for dirs)
+    std::array<std::int32_t, 12> direct {};                   ///< Direct block numbers (see physOf)
+    std::int32_t  indirect  = -1;                             ///< Block # of the indirect block
+
+    // Helper to zero‑init arrays.
+    Inode() { direct.fill(-1); }
+};
+
+/// The inode table is a list of blocks of INODES_PER_BLOCK inodes each.  A
+/// fresh image has INODE_TABLE_BLOCKS of them in blocks 1‑19; when every
+/// inode is taken, another block from the data area is appended, up to one
+/// inode per block of the disk.
+constexpr std::uint32_t INODES_PER_BLOCK   = BLOCK_SIZE / sizeof(Inode);
+constexpr std::uint32_t INODE_TABLE_BLOCKS = 19;
+constexpr std::uint32_t MAX_INODE_BLOCKS   = (TOTAL_BLOCKS + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+constexpr std::uint32_t MAX_INODES         = MAX_INODE_BLOCKS * INODES_PER_BLOCK;
+
+/// Blocks 1‑19, the inode table as formatted.
+constexpr std::array<std::int32_t, MAX_INODE_BLOCKS> formattedInodeBlocks()
+{
+    std::array<std::int32_t, MAX_INODE_BLOCKS> blocks {};
+    for (std::uint32_t k = 0; k < INODE_TABLE_BLOCKS; ++k) blocks[k] = static_cast<std::int32_t>(1 + k);
+    return blocks;
+}
+
 /// Super‑block – occupies physical block 0.
 struct SuperBlock {
     std::uint32_t magic            = MAGIC_NUMBER;
     std::uint32_t blockSize        = BLOCK_SIZE;
     std::uint32_t fsSize           = TOTAL_BLOCKS;             ///< Total blocks on disk
-    std::uint32_t inodeTableBlocks = (NUM_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE; // rounded‑up length
+    std::uint32_t inodeTableBlocks = INODE_TABLE_BLOCKS;       ///< Entries of inodeBlocks in use
     std::uint32_t rootInode        = 0;                       ///< Index of the root directory inode
+    std::uint32_t features         = 0;                       ///< FEATURE_* bits (0 on legacy images)
+    std::array<std::int32_t, MAX_SNAPSHOTS> snapshots {};     ///< First block of each snapshot, 0 = free slot
+    std::array<std::int32_t, MAX_INODE_BLOCKS> inodeBlocks = formattedInodeBlocks(); ///< Inode table, in order
 };
+static_assert(sizeof(SuperBlock) <= BLOCK_SIZE, "super-block must fit block 0");
 
-/// On‑disk inode (direct‑only for first 12 data blocks; single‑level indirect).
-struct Inode {
-    std::uint8_t  free      = 1;                              ///< 1 → unused, 0 → allocated
-    std::int32_t  size      = -1;                             ///< File size in *bytes*
-    std::array<std::int32_t, 12> direct {};                   ///< Direct block numbers
-    std::int32_t  indirect  = -1;                             ///< Block # of the indirect block
-
-    // Helper to zero‑init arrays.
-    Inode() { direct.fill(-1); }
-};
+//  Block pointers: ≥ 0 is a written block, −1 is unmapped and ≤ −2 encodes a
+//  block reserved by sfs_fallocate but never written (reads back as zeros).
+inline bool         isUnwritten(std::int32_t p)   { return p <= -2; }
+inline std::int32_t markUnwritten(std::int32_t b) { return -b - 2; }
+inline std::int32_t physOf(std::int32_t p)        { return p >= 0 ? p : (p <= -2 ? -p - 2 : -1); }
 
 /// Indirect block – fits exactly into one physical block.
 struct IndirectBlock {
@@ -92,29 +172,67 @@ struct IndirectBlock {
     IndirectBlock() { pointers.fill(-1); }
 };
 
-/// Single entry in the root directory table.
-struct DirEntry {
-    std::uint8_t  free                     = 1;               ///< 1 → slot available
-    std::int32_t  inode                    = -1;              ///< Owning inode index
-    std::array<char, MAX_FILE_NAME_LEN + 1> filename {{0}};   ///< C‑style NUL‑terminated string
+/// One block of the inode table.
+struct InodeBlock {
+    std::array<Inode, INODES_PER_BLOCK> inodes;
+    std::array<char, BLOCK_SIZE - INODES_PER_BLOCK * sizeof(Inode)> pad {};
 };
+static_assert(sizeof(InodeBlock) == BLOCK_SIZE, "inode block must fill one block");
 
-/// Root directory – fixed‑size flat table.
-struct Directory {
-    std::array<DirEntry, NUM_INODES> entries;                 ///< Up to 200 files in root
-    std::size_t                       cursor = 0;             ///< For sequential listing APIs
+/// In‑memory inode table, room for MAX_INODE_BLOCKS blocks.  Inodes past
+/// the blocks the super‑block lists stay free.
+struct InodeTable {
+    std::array<InodeBlock, MAX_INODE_BLOCKS> blocks;
+
+    Inode&       operator[](std::size_t i)       { return blocks[i / INODES_PER_BLOCK].inodes[i % INODES_PER_BLOCK]; }
+    const Inode& operator[](std::size_t i) const { return blocks[i / INODES_PER_BLOCK].inodes[i % INODES_PER_BLOCK]; }
+};
+
+/// First block of a snapshot.  The frozen inode table follows it, so a
+/// snapshot is 1 + inodeBlocks contiguous blocks.
+struct SnapshotHeader {
+    std::uint32_t magic   = SNAPSHOT_MAGIC;
+    std::array<char, MAX_FILE_NAME_LEN + 1> name {{0}};
+    std::int64_t  created = 0;                                ///< time() when taken
+    std::uint32_t inodeBlocks = 0;                            ///< Blocks of the frozen inode table
+};
+
+/// Directory B+tree node – exactly one block.  Leaves map names to inode
+/// numbers; internal nodes hold separators where vals[i] covers every key
+/// below keys[i] and vals[count] the rest.  Deletion frees a leaf once it
+/// is empty, and an internal node once its last child is gone, but never
+/// merges or rebalances, so nodes may be underfull and paths uneven.
+constexpr std::size_t BTREE_KEY_LEN = 24;                     ///< MAX_FILE_NAME_LEN + 1, word‑aligned
+constexpr std::size_t BTREE_ORDER   = (BLOCK_SIZE - 2 * sizeof(std::uint16_t) - sizeof(std::int32_t))
+                                    / (BTREE_KEY_LEN + sizeof(std::int32_t));
+using BTreeKey = std::array<char, BTREE_KEY_LEN>;
+
+struct BTreeNode {
+    std::uint16_t leaf  = 1;
+    std::uint16_t count = 0;
+    std::array<BTreeKey, BTREE_ORDER>          keys {};
+    std::array<std::int32_t, BTREE_ORDER + 1>  vals {};       ///< Inode (leaf) or child block (internal)
+    std::array<char, BLOCK_SIZE - 2 * sizeof(std::uint16_t)
+                     - BTREE_ORDER * BTREE_KEY_LEN
+                     - (BTREE_ORDER + 1) * sizeof(std::int32_t)> pad {};
 };
+static_assert(sizeof(BTreeNode) == BLOCK_SIZE, "B+tree node must fill one block");
 
 /// File‑descriptor entry (process‑local; never written to disk).
 struct FdEntry {
     std::uint8_t  free      = 1;                              ///< 1 → unused, 0 → open
     std::int32_t  inode     = -1;                             ///< Inode index of the open file
     std::int32_t  rwPtr     = -1;                             ///< Read/write cursor inside the file
+    std::int32_t  prealloc    = -1;                           ///< Next block of the preallocation window
+    std::int32_t  preallocLen = 0;                            ///< Blocks left in the window (free in the bitmap)
+    std::uint8_t  advice      = SFS_FADV_NORMAL;              ///< Access pattern from sfs_fadvise
+    std::int32_t  raLast      = -1;                           ///< Last file block read (sequential detection)
+    std::int32_t  raNext      = 0;                            ///< Read‑ahead already queued up to this block
 };
 
 /// Process‑local FD table.
 struct FdTable {
-    std::array<FdEntry, NUM_INODES> fds;                      ///< Hard limit = NUM_INODES
+    std::array<FdEntry, MAX_OPEN_FILES> fds;                  ///< Hard limit = MAX_OPEN_FILES
 };
 
 /// Simple bitmap – one byte per block for human readability.
@@ -123,456 +241,5706 @@ struct Bitmap {
     Bitmap() { used.fill(1); }                                ///< All blocks start free
 };
 
-//─────────────────────────────────────────────────────────────────────────────
-//  Global singletons (kept for continuity with the teaching skeleton).
-//  In production you would encapsulate these in a "Mount" object.
-//─────────────────────────────────────────────────────────────────────────────
+/// Per‑block reference counts.  0 on an allocated block means "one owner",
+/// so images that never share a block never have to touch this table.
+struct RefCounts {
+    std::array<std::uint16_t, TOTAL_BLOCKS> refs {};
+};
 
-inline std::unique_ptr<FdTable>     g_fdTable;
-inline std::unique_ptr<Directory>   g_rootDir;
-inline std::unique_ptr<std::array<Inode, NUM_INODES>> g_inodeTable;
-inline Bitmap                       g_bitmap;   // static‑lifetime plain object
+/// Per‑block content fingerprint (0 → not indexed).  Persisted so that the
+/// in‑memory dedup index can be rebuilt at mount without reading data blocks.
+struct Fingerprints {
+    std::array<std::uint64_t, TOTAL_BLOCKS> hash {};
+};
 
 //─────────────────────────────────────────────────────────────────────────────
-//  Helper utilities (internal linkage)
+//  Per‑mount memory.  The long‑lived tables are carved out of a fixed arena
+//  when the file system is mounted, transient block buffers come from a
+//  lock‑free pool inside that arena, and the node‑based indexes draw from a
+//  pooled memory resource.  After warm‑up, read/write/open/close never touch
+//  the global heap.
 //─────────────────────────────────────────────────────────────────────────────
-namespace detail {
 
-/// Zero‑initialises all runtime tables so that every *free* flag is set and
-/// every pointer contains a sentinel value understood by the SFS logic.
-inline void clearRuntimeState()
-{
-    g_fdTable  = std::make_unique<FdTable>();      // default‑constructed → already "free"
-    g_rootDir  = std::make_unique<Directory>();
-    g_inodeTable = std::make_unique<std::array<Inode, NUM_INODES>>();
+constexpr std::size_t IO_BUFFER_ALIGN = 4096;  ///< Pool slab alignment (page)
+constexpr std::size_t IO_POOL_BLOCKS  = 16;    ///< Block buffers in flight at once
+constexpr std::uint32_t CACHE_DEFAULT_BLOCKS = 256; ///< Block cache size of a new mount
+constexpr int           CACHE_MAX_RUN        = 16;  ///< Longer transfers stream past the cache
+constexpr std::uint32_t WB_BACKGROUND_PCT    = 25;  ///< Dirty share of the cache that wakes the flusher
+constexpr std::uint32_t WB_THROTTLE_PCT      = 50;  ///< Dirty share at which writers write back themselves
+constexpr int           WB_INTERVAL_MS       = 100; ///< Flusher period
+constexpr int           WB_EXPIRE_MS         = 1000;///< Age at which a dirty block is written back
+constexpr std::size_t   PREFETCH_QUEUE       = 32;  ///< Pending read‑ahead / WILLNEED runs per mount
+constexpr std::uint32_t VIEW_PIN_PCT         = 50;  ///< Share of the cache read views may pin
+constexpr int           RA_NORMAL_BLOCKS     = 4;   ///< Read‑ahead window of a sequential reader
+constexpr int           RA_SEQUENTIAL_BLOCKS = 16;  ///< Read‑ahead window under SFS_FADV_SEQUENTIAL
+constexpr unsigned      FSCK_MAX_THREADS     = 16;  ///< Scanner threads of sfs_fsck
+constexpr std::size_t   FSCK_GRAIN           = 32;  ///< Fewest inodes / pointer blocks worth a scanner thread
+constexpr int           FSCK_READ_RUN        = 64;  ///< Longest scanner read, in blocks
+constexpr int           FSCK_READ_GAP        = 8;   ///< Unneeded blocks a scanner read may span to stay sequential
+constexpr int           FSCK_MAX_DEPTH       = 16;  ///< Deeper B+trees are treated as damaged (cycles)
+constexpr int           FSCK_PASSES          = 4;   ///< Scan/repair rounds before giving up
+constexpr int           DEFRAG_BATCH_BLOCKS  = 64;  ///< Blocks the background defragmenter moves per lock hold
+constexpr int           DEFRAG_MIN_PAUSE_MS  = 1;   ///< Pause between unthrottled batches, to let callers in
+constexpr int           LOG_SEGMENT_BLOCKS   = 64;  ///< Unit the log‑mode cleaner frees at a time
+constexpr int           LOG_SEGMENTS         = (TOTAL_BLOCKS - DATA_BLOCK + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+constexpr int           LOG_CHECKPOINT_MS    = 1000; ///< Longest a log‑mode update waits for its checkpoint
+constexpr std::size_t   LOG_PENDING_MAX      = 256; ///< Superseded blocks held back before a checkpoint is forced
+constexpr int           LOG_CLEAN_RESERVE    = 4;   ///< Free segments the background cleaner keeps ahead of the log
+constexpr int           INSPECT_BUCKETS      = 12;  ///< Free‑run histogram buckets: 1, 2–3, 4–7 … blocks
+constexpr std::uint32_t TRACE_MAGIC          = 0x52544653; ///< "SFTR" – first word of a trace file
+constexpr std::uint32_t TRACE_VERSION        = 1;
+constexpr std::size_t   TRACE_BUFFER_BYTES   = 64 * 1024; ///< Trace records buffered before a write
 
-    // Reserve inode 0 for the root directory – mark as allocated.
-    (*g_inodeTable)[0].free = 0;
-    (*g_inodeTable)[0].size = sizeof(Directory);
+constexpr std::size_t alignUp(std::size_t n, std::size_t a) { return (n + a - 1) / a * a; }
 
-    // Pre‑allocate physical blocks for the directory itself so that the FS can
-    // boot even before any user file has been created.  We simply map the first
-    // 8 contiguous blocks after the inode table (per the original design).
-    for (std::size_t i = 0; i < 8; ++i) {
-        (*g_inodeTable)[0].direct[i] = DIR_BLOCK + static_cast<std::int32_t>(i);
-        g_bitmap.used[DIR_BLOCK + i] = 0;          // mark as **in‑use**
+/// Bump allocator with static storage; reset() at mount time recycles it.
+/// Only trivially destructible objects may live here.
+class Arena {
+public:
+    static constexpr std::size_t CAPACITY =
+        alignUp(sizeof(FdTable), IO_BUFFER_ALIGN) + alignUp(sizeof(InodeTable), IO_BUFFER_ALIGN) +
+        IO_POOL_BLOCKS * BLOCK_SIZE;
+
+    void* allocate(std::size_t bytes, std::size_t align)
+    {
+        const std::size_t at = alignUp(used_, align);
+        if (at + bytes > CAPACITY) throw std::bad_alloc();  // sizes are fixed – cannot happen
+        used_ = at + bytes;
+        return bytes_ + at;
     }
 
-    // Reserve all meta‑data blocks (super‑block + inode table + dir table + bitmap)
-    constexpr std::size_t META_BLOCKS = 1                         // super‑block
-                                      + ((NUM_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE)
-                                      + 7                         // hard‑coded dir table length (unchanged)
-                                      + 3;                        // bitmap length (unchanged)
-    for (std::size_t i = 0; i < META_BLOCKS; ++i)
-        g_bitmap.used[i] = 0;
-}
+    template <class T>
+    T* make()
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+        return new (allocate(sizeof(T), alignof(T))) T();
+    }
 
-/// Finds the first free block in the bitmap; returns −1 if none.  **O(n)**.
-inline int nextFreeBlock()
-{
-    for (std::size_t i = 0; i < g_bitmap.used.size(); ++i)
-        if (g_bitmap.used[i]) return static_cast<int>(i);
-    return -1;
-}
+    void reset() { used_ = 0; }
 
-/// Finds *n* contiguous free blocks, marks them as allocated, and returns the
-/// starting index or −1 if none found.  Naïve **O(n·n)** scan – identical to
-/// the reference.
-inline int allocateContiguousBlocks(std::size_t n)
-{
-    for (std::size_t i = 0; i + n <= g_bitmap.used.size(); ++i) {
-        bool runFree = true;
-        for (std::size_t j = 0; j < n; ++j)
-            if (!g_bitmap.used[i + j]) { runFree = false; break; }
-        if (runFree) {
-            for (std::size_t j = 0; j < n; ++j) g_bitmap.used[i + j] = 0;
-            return static_cast<int>(i);
+private:
+    alignas(IO_BUFFER_ALIGN) std::byte bytes_[CAPACITY];
+    std::size_t used_ = 0;
+};
+
+/// Fixed set of block‑sized, block‑aligned buffers handed out through a
+/// Treiber stack.  The head packs a generation tag next to the index so a
+/// pop racing with pop/push cannot succeed on a stale next link (ABA).
+class BlockPool {
+public:
+    void init(Arena& arena)
+    {
+        slab_ = static_cast<char*>(arena.allocate(IO_POOL_BLOCKS * BLOCK_SIZE, IO_BUFFER_ALIGN));
+        for (std::uint32_t i = 0; i < IO_POOL_BLOCKS; ++i)
+            next_[i].store(i + 1, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_release);
+    }
+
+    /// Returns a free buffer, or nullptr when all of them are in use.
+    char* acquire()
+    {
+        std::uint64_t head = head_.load(std::memory_order_acquire);
+        for (;;) {
+            const std::uint32_t idx = static_cast<std::uint32_t>(head);
+            if (idx >= IO_POOL_BLOCKS) return nullptr;
+            const std::uint64_t next = ((head >> 32) + 1) << 32 | next_[idx].load(std::memory_order_relaxed);
+            if (head_.compare_exchange_weak(head, next, std::memory_order_acquire))
+                return slab_ + idx * BLOCK_SIZE;
         }
     }
-    return -1;
-}
 
-/// Returns the inode index for *filename* if it exists in the root directory;
-/// otherwise −1.
-inline int inodeOf(const char* filename)
-{
-    for (const auto& e : g_rootDir->entries)
-        if (!e.free && std::strcmp(filename, e.filename.data()) == 0)
-            return e.inode;
-    return -1;
-}
+    void release(char* buf)
+    {
+        const auto idx = static_cast<std::uint32_t>((buf - slab_) / BLOCK_SIZE);
+        std::uint64_t head = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            next_[idx].store(static_cast<std::uint32_t>(head), std::memory_order_relaxed);
+            const std::uint64_t next = ((head >> 32) + 1) << 32 | idx;
+            if (head_.compare_exchange_weak(head, next, std::memory_order_release)) return;
+        }
+    }
 
-/// Returns the directory‐slot index for *filename* or −1 if not found.
-inline int dirSlotOf(const char* filename)
-{
-    for (std::size_t i = 0; i < g_rootDir->entries.size(); ++i)
-        if (!g_rootDir->entries[i].free &&
-            std::strcmp(filename, g_rootDir->entries[i].filename.data()) == 0)
-            return static_cast<int>(i);
-    return -1;
-}
+    bool owns(const char* buf) const { return buf >= slab_ && buf < slab_ + IO_POOL_BLOCKS * BLOCK_SIZE; }
 
-/// Returns the first free inode index or −1 if the table is full.
-inline int firstFreeInode()
-{
-    for (std::size_t i = 0; i < NUM_INODES; ++i)
-        if ((*g_inodeTable)[i].free) return static_cast<int>(i);
-    return -1;
-}
+private:
+    char*                                              slab_ = nullptr;
+    std::array<std::atomic<std::uint32_t>, IO_POOL_BLOCKS> next_ {};
+    std::atomic<std::uint64_t>                         head_ {IO_POOL_BLOCKS};
+};
 
-/// Returns the first free directory‑entry slot or −1 if none.
-inline int firstFreeDirSlot()
-{
-    for (std::size_t i = 0; i < g_rootDir->entries.size(); ++i)
-        if (g_rootDir->entries[i].free) return static_cast<int>(i);
-    return -1;
-}
+/// LRU cache of image blocks, write‑through by default.  Frames are
+/// allocated when the capacity is set; lookups go through a pre‑reserved
+/// hash map and the recency list is threaded through index arrays, so hits,
+/// misses and evictions allocate nothing.  It matters most on an O_DIRECT
+/// image, where the host page cache no longer absorbs repeated reads.
+///
+/// With writeback on, short writes only dirty their frames and a flusher
+/// thread writes them back later: blocks dirty for WB_EXPIRE_MS on each
+/// WB_INTERVAL_MS tick, and everything as soon as WB_BACKGROUND_PCT of the
+/// frames are dirty.  A writer that takes the dirty share past
+/// WB_THROTTLE_PCT writes back itself before returning.  A writeback copies
+/// the chosen blocks aside, sorts them and writes contiguous runs with the
+/// cache unlocked, so the mount thread keeps going meanwhile.  Dirty frames
+/// are never evicted.  The cache has a lock of its own because the flusher
+/// does not take the mount lock.
+///
+/// Blocks can also be read *cold* (streaming readers) – they still enter
+/// the cache, but once more than coldLimit() of the frames are cold the
+/// oldest cold block is evicted first, so a scan cannot push out the
+/// working set.  prefetch() queues runs for a second thread that reads
+/// them in the background (read‑ahead, SFS_FADV_WILLNEED).
+///
+/// pin() lends a frame out to a read view (sfs_read_view) until unpin().
+/// A pinned frame is never evicted or overwritten: a write or drop of its
+/// block detaches it instead – out of the map and the recency list, on no
+/// free list – and the block moves to a fresh frame, so a view keeps the
+/// contents it was made with.  Resizing with frames pinned retires the old
+/// frame array whole; it is freed when the last of its pins goes.  At
+/// most VIEW_PIN_PCT of the frames are pinned at once, so writers always
+/// find frames to claim.
+class BlockCache {
+public:
+    BlockCache() = default;
+    ~BlockCache()
+    {
+        setWriteback(false);
+        stopPrefetcher();
+        freeFrames();
+        for (const Retired& r : retired_) ::operator delete(r.frames, std::align_val_t(IO_BUFFER_ALIGN));
+    }
+    BlockCache(const BlockCache&)            = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
 
-/// Returns the first free slot in the FD table or −1 if full.
-inline int firstFreeFd()
-{
-    for (std::size_t i = 0; i < g_fdTable->fds.size(); ++i)
-        if (g_fdTable->fds[i].free) return static_cast<int>(i);
-    return -1;
-}
+    std::uint32_t capacity() const { return capacity_; }
+    bool          writeback() const { return writeback_; }   ///< Only changed by the owner's thread
 
-/// Locates an open FD that references *inode*.  Returns −1 if none.
-inline int fdOfInode(int inode)
-{
-    for (std::size_t i = 0; i < g_fdTable->fds.size(); ++i)
-        if (g_fdTable->fds[i].inode == inode && !g_fdTable->fds[i].free)
-            return static_cast<int>(i);
-    return -1;
-}
+    /// Sets the image that misses are read from and dirty blocks go to.
+    void attach(disk* dev)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        quiescePrefetch(lk);
+        dev_ = dev;
+    }
 
-} // namespace detail
+    /// Drops every cached block – dirty ones too, so sync() first – and
+    /// reallocates for *blocks* frames (0 disables).
+    void resize(std::uint32_t blocks)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        quiescePrefetch(lk);
+        idle_.wait(lk, [&] { return !flushing_; });
+        if (pinned_) {   // views still read the old frames – keep them aside
+            retired_.push_back({frames_, capacity_, std::accumulate(pin_.begin(), pin_.end(), std::uint64_t {0})});
+            frames_  = nullptr;
+            pinned_  = 0;
+            capacity_ = ~0u;   // forces a fresh array below
+        }
+        if (blocks != capacity_) {
+            freeFrames();
+            if (blocks) {
+                frames_  = allocFrames(blocks);
+                staging_ = allocFrames(blocks);
+                tag_.assign(blocks, -1);
+                prev_.assign(blocks, NIL);
+                next_.assign(blocks, NIL);
+                dirty_.assign(blocks, 0);
+                cold_.assign(blocks, 0);
+                gen_.assign(blocks, 0);
+                pin_.assign(blocks, 0);
+                since_.assign(blocks, Clock::time_point {});
+                batch_.reserve(blocks);
+            }
+            capacity_ = blocks;
+        }
+        map_.clear();
+        map_.reserve(capacity_);
+        head_ = tail_ = free_ = NIL;
+        used_ = dirtyCount_ = coldCount_ = 0;
+    }
 
-//─────────────────────────────────────────────────────────────────────────────
-//  Public API implementation – functions must keep their C linkage so that
-//  assignment‑supplied test cases link.  All logic is merely moved into the
-//  *sfs* namespace for clarity.
-//─────────────────────────────────────────────────────────────────────────────
+    /// Reads [start, start + n).  Served from the frames when all blocks are
+    /// cached; otherwise from the image, overlaid with the cached copies
+    /// (which may be newer), and short runs are kept – as cold blocks if
+    /// *cold* is set.
+    int read(int start, int n, void* buf, bool cold = false)
+    {
+        auto* dst = static_cast<char*>(buf);
+        std::unique_lock<std::mutex> lk(mu_);
+        if (!capacity_) return disk_read_blocks(dev_, start, n, buf);
 
-extern "C" {
+        int cached = 0;
+        while (cached < n && map_.count(start + cached)) ++cached;
+        if (cached < n) {
+            const int rc = disk_read_blocks(dev_, start, n, buf);
+            if (rc != n) return rc;
+        }
+        for (int i = 0; i < n; ++i) {
+            char* b = dst + std::size_t(i) * BLOCK_SIZE;
+            const auto it = map_.find(start + i);
+            if (it != map_.end()) {
+                hit(it->second, cold);
+                std::memcpy(b, frame(it->second), BLOCK_SIZE);
+            } else if (n <= CACHE_MAX_RUN) {
+                const std::uint32_t f = claim(lk, start + i, cold);
+                if (f != NIL) std::memcpy(frame(f), b, BLOCK_SIZE);
+            }
+        }
+        return n;
+    }
 
-void mksfs(int fresh)
-{
-    using namespace detail;
+    /// Writes [start, start + n).  With writeback on, a short run only
+    /// dirties frames; otherwise the image is written and cached copies are
+    /// refreshed.
+    int write(int start, int n, const void* buf)
+    {
+        const auto* src = static_cast<const char*>(buf);
+        std::unique_lock<std::mutex> lk(mu_);
+        invalidatePrefetch(start, n);
+        if (writeback_ && capacity_ && n <= CACHE_MAX_RUN) {
+            const auto now = Clock::now();
+            for (int i = 0; i < n; ++i) {
+                const auto it = map_.find(start + i);
+                std::uint32_t f = NIL;
+                if (it != map_.end() && !pin_[it->second]) {
+                    hit(f = it->second, false);
+                } else {
+                    detach(it);
+                    if ((f = claim(lk, start + i)) == NIL) return -1;
+                }
+                std::memcpy(frame(f), src + std::size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+                if (!dirty_[f]) {
+                    dirty_[f] = 1;
+                    since_[f] = now;
+                    ++dirtyCount_;
+                }
+                gen_[f] = ++genCounter_;
+            }
+            if (dirtyCount_ * 100 > capacity_ * WB_THROTTLE_PCT)
+                return writebackLocked(lk, All {}) == 0 ? n : -1;
+            if (dirtyCount_ * 100 > capacity_ * WB_BACKGROUND_PCT) wake_.notify_one();
+            return n;
+        }
 
-    clearRuntimeState();  // (re)initialise in‑memory tables
+        // An older copy of these blocks may be on its way to the image.
+        idle_.wait(lk, [&] { return !flushing_ || !inBatch(start, n); });
+        const int rc = disk_write_blocks(dev_, start, n, const_cast<char*>(src));
+        if (!capacity_) return rc;
+        for (int i = 0; i < n; ++i) {
+            const auto it = map_.find(start + i);
+            std::uint32_t f = NIL;
+            if (rc != n) {
+                if (it != map_.end()) dropFrame(it);   // image contents unknown – forget them
+                continue;
+            }
+            if (it != map_.end() && !pin_[it->second]) {
+                hit(f = it->second, false);
+                if (dirty_[f]) {
+                    dirty_[f] = 0;
+                    --dirtyCount_;
+                }
+            } else {
+                detach(it);
+                if (n <= CACHE_MAX_RUN) f = claim(lk, start + i);
+            }
+            if (f != NIL) std::memcpy(frame(f), src + std::size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        return rc;
+    }
 
-    if (fresh) {
-        std::remove(DISK_NAME);  // start from a blank image every time
-        init_fresh_disk(DISK_NAME, BLOCK_SIZE, TOTAL_BLOCKS);
+    /// Pins the frames holding *blocks* – read in if not cached – and
+    /// stores their contents in *out*, valid until unpin(); a negative
+    /// entry (hole) gets nullptr.  Stops at the first block it cannot lend
+    /// (cache off, pin budget spent, no clean frame free) and returns how
+    /// many entries it filled; read() the rest.
+    int pin(const std::int32_t* blocks, int n, const char** out, bool cold)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        int i = 0;
+        for (; i < n; ++i) {
+            out[i] = nullptr;
+            if (blocks[i] < 0) continue;
+            if (!capacity_ || pinned_ * 100 >= capacity_ * VIEW_PIN_PCT) break;
+            std::uint32_t f = NIL;
+            if (const auto it = map_.find(blocks[i]); it != map_.end()) {
+                hit(f = it->second, cold);
+            } else {
+                if ((f = claim(lk, blocks[i], cold, false)) == NIL) break;   // never waits on writeback
+                if (disk_read_blocks(dev_, blocks[i], 1, frame(f)) != 1) {
+                    dropFrame(map_.find(blocks[i]));
+                    break;
+                }
+            }
+            if (pin_[f]++ == 0) ++pinned_;
+            out[i] = frame(f);
+        }
+        return i;
+    }
 
-        // 1.  Construct an up‑to‑date super‑block and write it to block 0.
-        SuperBlock sb;  // ".fsSize" and others initialise via default‑members
-        write_blocks(0, 1, &sb);
+    /// Returns frames lent out by pin().
+    void unpin(const char* const* data, std::size_t n)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (std::size_t i = 0; i < n; ++i) unpinLocked(data[i]);
+    }
 
-        // 2.  Write the inode table.
-        const std::size_t inodeTableBlocks = (sizeof(*g_inodeTable) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        write_blocks(1, static_cast<int>(inodeTableBlocks), g_inodeTable.get());
+    /// Forgets *blk* (e.g. once it has been freed), even if dirty.
+    void drop(int blk)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        invalidatePrefetch(blk, 1);
+        const auto it = map_.find(blk);
+        if (it != map_.end()) dropFrame(it);
+    }
 
-        // 3.  Persist the directory (empty but pre‑allocated).  Original code
-        //     hard‑coded it to 7 blocks – we follow suit for binary parity.
-        write_blocks(13, 7, g_rootDir.get());
+    /// Writes back the dirty blocks among the sorted *blocks*, then drops
+    /// them all from the cache.
+    int evict(const std::int32_t* blocks, std::size_t count)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        const int rc = writebackLocked(lk, [&](int blk, Clock::time_point) {
+            return std::binary_search(blocks, blocks + count, blk);
+        });
+        for (std::size_t i = 0; i < count; ++i) {
+            invalidatePrefetch(blocks[i], 1);
+            const auto it = map_.find(blocks[i]);
+            if (it != map_.end() && !dirty_[it->second]) dropFrame(it);
+        }
+        return rc;
+    }
 
-        // 4.  Persist the bitmap (3 blocks in the skeleton).
-        write_blocks(20, 3, &g_bitmap);
+    /// Queues [start, start + n) to be read into the cache in the
+    /// background.  Best effort: dropped when the queue is full.
+    void prefetch(int start, int n, bool cold)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!capacity_ || !dev_ || pfCount_ == PREFETCH_QUEUE) return;
+        int cached = 0;
+        while (cached < n && map_.count(start + cached)) ++cached;
+        if (cached == n) return;
+        if (!pfBuf_) {
+            pfBuf_      = allocFrames(CACHE_MAX_RUN);
+            prefetcher_ = std::thread([this] { prefetcherMain(); });
+        }
+        pfQueue_[(pfHead_ + pfCount_++) % PREFETCH_QUEUE] = {start + cached, n - cached, cold};
+        pfWake_.notify_one();
+    }
 
-    } else {
-        // Mount existing image – populate all runtime tables.
-        init_disk(DISK_NAME, BLOCK_SIZE, TOTAL_BLOCKS);
+    /// Writes back every dirty block.
+    int sync()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        return writebackLocked(lk, All {});
+    }
 
-        SuperBlock sb;  read_blocks(0, 1, &sb);        // currently unused
-        read_blocks(1, 12, g_inodeTable.get());
-        read_blocks(13, 7, g_rootDir.get());
-        read_blocks(20, 3, &g_bitmap);
+    /// Writes back the dirty blocks among the sorted *blocks* and all dirty
+    /// blocks below *below*.
+    int sync(const std::int32_t* blocks, std::size_t count, int below)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        return writebackLocked(lk, [&](int blk, Clock::time_point) {
+            return blk < below || std::binary_search(blocks, blocks + count, blk);
+        });
     }
-}
 
-//─────────────────────────────────────────────────────────────────────────
-//  File‑creation & open (returns logical FD)
-//─────────────────────────────────────────────────────────────────────────
+    /// Starts or stops the flusher.  Stopping writes everything back.
+    int setWriteback(bool on)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        if (on == writeback_) return 0;
+        if (on) {
+            writeback_ = true;
+            stop_      = false;
+            flusher_   = std::thread([this] { flusherMain(); });
+            return 0;
+        }
+        stop_ = true;
+        wake_.notify_all();
+        lk.unlock();
+        flusher_.join();
+        lk.lock();
+        writeback_ = false;
+        return writebackLocked(lk, All {});
+    }
 
-int sfs_fopen(const char* filename)
-{
-    using namespace detail;
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::uint32_t NIL = ~0u;
 
-    if (std::strlen(filename) >= MAX_FILE_NAME_LEN)
-        return -1;  // name too long – reject per original spec
+    struct All {
+        bool operator()(int, Clock::time_point) const { return true; }
+    };
 
-    int inodeIdx = inodeOf(filename);
+    struct PrefetchRun {
+        std::int32_t start;
+        std::int32_t n;        ///< At most CACHE_MAX_RUN (pfBuf_ size)
+        bool         cold;
+    };
 
-    //────────────────────────────
-    //  Case A – new file.
-    //────────────────────────────
-    if (inodeIdx < 0) {
-        const int freeInode = firstFreeInode();
-        const int freeDir   = firstFreeDirSlot();
-        const int freeFd    = firstFreeFd();
-        if (freeInode < 0 || freeDir < 0 || freeFd < 0) {
-            std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
-            return -1;
-        }
+    struct BatchEntry {
+        std::int32_t  blk;
+        std::uint32_t frame;
+        std::uint64_t gen;     ///< Frame generation when copied aside
+    };
 
-        // 1.  Directory entry ←→ inode mapping.
-        auto& dirEnt          = g_rootDir->entries[freeDir];
-        dirEnt.free           = 0;
-        dirEnt.inode          = freeInode;
-        std::strncpy(dirEnt.filename.data(), filename, MAX_FILE_NAME_LEN);
+    struct Retired {           ///< Frame array replaced by resize() while pinned
+        char*         frames;
+        std::uint32_t capacity;
+        std::uint64_t pins;
+    };
 
-        // 2.  Inode initialisation (empty file = size 0).
-        auto& ino             = (*g_inodeTable)[freeInode];
-        ino.free              = 0;
-        ino.size              = 0;
-        // all block pointers are already −1 from the constructor
+    static char* allocFrames(std::uint32_t blocks)
+    {
+        return static_cast<char*>(::operator new(std::size_t(blocks) * BLOCK_SIZE,
+                                                 std::align_val_t(IO_BUFFER_ALIGN)));
+    }
 
-        // 3.  FD initialisation (cursor = 0).
-        auto& fd              = g_fdTable->fds[freeFd];
-        fd.free               = 0;
-        fd.inode              = freeInode;
-        fd.rwPtr              = 0;
+    void freeFrames()
+    {
+        for (char* p : {frames_, staging_})
+            if (p) ::operator delete(p, std::align_val_t(IO_BUFFER_ALIGN));
+        frames_ = staging_ = nullptr;
+    }
 
-        // 4.  Flush updated tables to disk (minimal durability).
-        write_blocks(1, 12, g_inodeTable.get());
-        write_blocks(13, 7, g_rootDir.get());
+    char* frame(std::uint32_t f) { return frames_ + std::size_t(f) * BLOCK_SIZE; }
 
-        return freeFd;
+    void unlink(std::uint32_t f)
+    {
+        (prev_[f] != NIL ? next_[prev_[f]] : head_) = next_[f];
+        (next_[f] != NIL ? prev_[next_[f]] : tail_) = prev_[f];
     }
 
-    //────────────────────────────
-    //  Case B – file exists.
-    //────────────────────────────
-    int fdIdx = fdOfInode(inodeIdx);
-    if (fdIdx >= 0)
-        return fdIdx;   // already open → return same logical FD
+    void pushFront(std::uint32_t f)
+    {
+        prev_[f] = NIL;
+        next_[f] = head_;
+        (head_ != NIL ? prev_[head_] : tail_) = f;
+        head_ = f;
+    }
 
-    // Otherwise allocate a new FD entry.
-    fdIdx = firstFreeFd();
-    if (fdIdx < 0) {
-        std::cerr << "[SFS] Per‑process FD table exhausted.\n";
-        return -1;
+    void touch(std::uint32_t f)
+    {
+        if (f == head_) return;
+        unlink(f);
+        pushFront(f);
     }
-    auto& fd = g_fdTable->fds[fdIdx];
-    fd.free  = 0;
-    fd.inode = inodeIdx;
-    fd.rwPtr = (*g_inodeTable)[inodeIdx].size;  // append mode like original
-    return fdIdx;
-}
 
-//─────────────────────────────────────────────────────────────────────────
-//  Close FD
-//─────────────────────────────────────────────────────────────────────────
+    /// A use of frame *f*; a normal use promotes a cold block.
+    void hit(std::uint32_t f, bool cold)
+    {
+        touch(f);
+        if (!cold && cold_[f]) {
+            cold_[f] = 0;
+            --coldCount_;
+        }
+    }
 
-int sfs_fclose(int fd)
-{
-    if (fd < 0 || static_cast<std::size_t>(fd) >= g_fdTable->fds.size())
-        return -1;
-    auto& e = g_fdTable->fds[fd];
-    if (e.free) return -1;   // not open
-    e = {};                  // default‑construct → marks as free
-    return 0;
-}
+    std::uint32_t coldLimit() const { return std::max<std::uint32_t>(2 * CACHE_MAX_RUN, capacity_ / 8); }
 
-//─────────────────────────────────────────────────────────────────────────
-//  Seek – sets read/write cursor (absolute offset, no bounds checking)
-//─────────────────────────────────────────────────────────────────────────
+    template <class It>
+    void dropFrame(It it)
+    {
+        const std::uint32_t f = it->second;
+        map_.erase(it);
+        unlink(f);
+        if (dirty_[f]) {
+            dirty_[f] = 0;
+            --dirtyCount_;
+        }
+        if (cold_[f]) {
+            cold_[f] = 0;
+            --coldCount_;
+        }
+        tag_[f] = -1;
+        if (pin_[f]) return;   // a view still reads it – unpin() frees it
+        next_[f] = free_;
+        free_    = f;
+    }
 
-int sfs_fseek(int fd, int loc)
-{
-    if (fd < 0 || static_cast<std::size_t>(fd) >= g_fdTable->fds.size())
-        return -1;
-    auto& e = g_fdTable->fds[fd];
-    if (e.free) return -1;
-    e.rwPtr = loc;
-    return 0;
-}
+    void unpinLocked(const char* data)
+    {
+        if (!data) return;
+        if (frames_ && data >= frames_ && data < frames_ + std::size_t(capacity_) * BLOCK_SIZE) {
+            const auto f = static_cast<std::uint32_t>((data - frames_) / BLOCK_SIZE);
+            if (--pin_[f]) return;
+            --pinned_;
+            if (tag_[f] == -1) {   // detached while pinned – free it now
+                next_[f] = free_;
+                free_    = f;
+            }
+            return;
+        }
+        for (auto r = retired_.begin(); r != retired_.end(); ++r)
+            if (data >= r->frames && data < r->frames + std::size_t(r->capacity) * BLOCK_SIZE) {
+                if (--r->pins == 0) {
+                    ::operator delete(r->frames, std::align_val_t(IO_BUFFER_ALIGN));
+                    retired_.erase(r);
+                }
+                return;
+            }
+    }
 
-//─────────────────────────────────────────────────────────────────────────
-//  Helper for both read & write: returns a mutable reference to the indirect
-//  block for *inode*, allocating it lazily if necessary.
-//─────────────────────────────────────────────────────────────────────────
+    /// Takes a pinned frame out of the cache before its block changes.
+    template <class It>
+    void detach(It it)
+    {
+        if (it != map_.end() && pin_[it->second]) dropFrame(it);
+    }
 
-static IndirectBlock& ensureIndirectBlock(int inodeIdx)
-{
-    auto& ino = (*g_inodeTable)[inodeIdx];
-    static IndirectBlock scratch;  // static to keep lifetime outside function
+    /// Takes a frame for the uncached *blk*, evicting the least recently
+    /// used clean block – a cold one while there are too many of those.
+    /// With every frame dirty it writes back first (unless *mayWait* is
+    /// false); the lock is dropped meanwhile, so *blk* may be cached by then.
+    std::uint32_t claim(std::unique_lock<std::mutex>& lk, int blk, bool cold = false, bool mayWait = true)
+    {
+        std::uint32_t f = NIL;
+        while (f == NIL) {
+            if (const auto it = map_.find(blk); it != map_.end()) {
+                hit(it->second, cold);
+                return it->second;
+            }
+            if (free_ != NIL) {
+                f     = free_;
+                free_ = next_[f];
+            } else if (used_ < capacity_) {
+                f = used_++;
+            } else {
+                if (coldCount_ > coldLimit())
+                    for (std::uint32_t v = tail_; v != NIL && f == NIL; v = prev_[v])
+                        if (cold_[v] && !dirty_[v] && !pin_[v]) f = v;
+                for (std::uint32_t v = tail_; v != NIL && f == NIL; v = prev_[v])
+                    if (!dirty_[v] && !pin_[v]) f = v;
+                if (f == NIL) {
+                    if (!mayWait || !dirtyCount_ || writebackLocked(lk, All {}) != 0) return NIL;
+                    continue;
+                }
+                unlink(f);
+                map_.erase(tag_[f]);
+                coldCount_ -= cold_[f];
+            }
+        }
+        cold_[f]  = cold;
+        coldCount_ += cold;
+        tag_[f]   = blk;
+        dirty_[f] = 0;
+        gen_[f]   = ++genCounter_;
+        map_.emplace(blk, f);
+        pushFront(f);
+        return f;
+    }
 
-    if (ino.indirect < 0) {
-        const int blk = detail::nextFreeBlock();
-        if (blk < 0) throw std::runtime_error("SFS: no space for indirect block");
-        g_bitmap.used[blk] = 0;
-        ino.indirect = blk;
-        scratch = {};                                   // zero‑init
-        write_blocks(blk, 1, &scratch);                 // persist empty template
-    } else {
-        read_blocks(ino.indirect, 1, &scratch);
+    bool inBatch(int start, int n) const
+    {
+        const auto it = std::lower_bound(batch_.begin(), batch_.end(), start,
+                                         [](const BatchEntry& e, int b) { return e.blk < b; });
+        return it != batch_.end() && it->blk < start + n;
     }
-    return scratch;
-}
 
-//─────────────────────────────────────────────────────────────────────────
-//  Write – simplified algorithm (only handles fresh writes starting at offset
-//          0 and files ≤ 12 blocks).  The original student code contains many
-//          edge‑case branches; porting *all* would clutter this example.  The
-//          full logic can be restored incrementally as an exercise.
-//─────────────────────────────────────────────────────────────────────────
+    /// Writes back the dirty blocks *pick* selects as one sorted batch.  The
+    /// lock is dropped for the disk writes; a block redirtied meanwhile
+    /// stays dirty.  One batch is in flight at a time.  Data and indirect
+    /// blocks go out before the fixed metadata below DATA_BLOCK, so the
+    /// inode table and bitmap never reach the image ahead of the blocks
+    /// they point at.
+    template <class Pick>
+    int writebackLocked(std::unique_lock<std::mutex>& lk, Pick pick)
+    {
+        idle_.wait(lk, [&] { return !flushing_; });
+        batch_.clear();
+        for (std::uint32_t f = 0; f < used_; ++f)
+            if (dirty_[f] && pick(tag_[f], since_[f])) batch_.push_back({tag_[f], f, gen_[f]});
+        if (batch_.empty()) return 0;
 
-int sfs_fwrite(int fd, const char* buf, int length)
-{
-    if (fd < 0 || static_cast<std::size_t>(fd) >= g_fdTable->fds.size())
-        return -1;
-    auto& fde = g_fdTable->fds[fd];
-    if (fde.free) return -1;
+        std::sort(batch_.begin(), batch_.end(),
+                  [](const BatchEntry& a, const BatchEntry& b) { return a.blk < b.blk; });
+        for (std::size_t i = 0; i < batch_.size(); ++i)
+            std::memcpy(staging_ + i * BLOCK_SIZE, frame(batch_[i].frame), BLOCK_SIZE);
+        flushing_ = true;
+        disk* dev = dev_;
+        lk.unlock();
 
-    auto& ino = (*g_inodeTable)[fde.inode];
+        // Writes [from, to) of the batch as contiguous runs; returns where it stopped.
+        auto writeRuns = [&](std::size_t from, std::size_t to) {
+            while (from < to) {
+                std::size_t end = from + 1;
+                while (end < to && batch_[end].blk == batch_[end - 1].blk + 1) ++end;
+                const int len = static_cast<int>(end - from);
+                if (disk_write_blocks(dev, batch_[from].blk, len, staging_ + from * BLOCK_SIZE) != len) break;
+                from = end;
+            }
+            return from;
+        };
+        const std::size_t split = static_cast<std::size_t>(
+            std::lower_bound(batch_.begin(), batch_.end(), static_cast<int>(DATA_BLOCK),
+                             [](const BatchEntry& e, int b) { return e.blk < b; }) - batch_.begin());
+        const std::size_t dataDone = writeRuns(split, batch_.size());
+        const std::size_t metaDone = dataDone == batch_.size() ? writeRuns(0, split) : 0;
 
-    // For brevity we only implement the *fresh file* case (size = 0).  The
-    // original skeleton has 350 lines of ad‑hoc branching which are beyond the
-    // scope of this demonstrative port.
-    if (ino.size != 0 || fde.rwPtr != 0) {
-        std::cerr << "[SFS] Demonstration port supports only fresh writes.\n";
-        return -1;
+        lk.lock();
+        for (std::size_t i = 0; i < batch_.size(); ++i) {
+            const BatchEntry& e = batch_[i];
+            if ((i < split ? i >= metaDone : i >= dataDone)) continue;   // not written
+            if (tag_[e.frame] == e.blk && gen_[e.frame] == e.gen && dirty_[e.frame]) {
+                dirty_[e.frame] = 0;
+                --dirtyCount_;
+            }
+        }
+        flushing_ = false;
+        idle_.notify_all();
+        if (dataDone < batch_.size() || metaDone < split) {
+            std::cerr << "[SFS] Writeback of block " << batch_[dataDone < batch_.size() ? dataDone : metaDone].blk
+                      << " failed.\n";
+            return -1;
+        }
+        return 0;
     }
 
-    const std::size_t neededBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (neededBlocks > 12) {
-        std::cerr << "[SFS] Demo limitation: direct blocks only (≤ 12).\n";
-        return -1;
-    }
+    bool overBackground() const { return dirtyCount_ * 100 > capacity_ * WB_BACKGROUND_PCT; }
 
-    // Allocate contiguous region for decent performance (matches original).
-    const int startBlk = detail::allocateContiguousBlocks(neededBlocks);
-    if (startBlk < 0) return -1;   // ENOSPC
+    void flusherMain()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        while (!stop_) {
+            wake_.wait_for(lk, std::chrono::milliseconds(WB_INTERVAL_MS),
+                           [&] { return stop_ || overBackground(); });
+            if (stop_) break;
+            if (overBackground()) {
+                writebackLocked(lk, All {});
+            } else {
+                const auto cutoff = Clock::now() - std::chrono::milliseconds(WB_EXPIRE_MS);
+                writebackLocked(lk, [&](int, Clock::time_point t) { return t <= cutoff; });
+            }
+        }
+    }
 
-    // Persist user data.
-    write_blocks(startBlk, static_cast<int>(neededBlocks), buf);
+    /// Called on every change to the image or the cache's contents: a run
+    /// being read in the background must not land over newer data.
+    void invalidatePrefetch(int start, int n)
+    {
+        if (pfBusy_ && start < pfEnd_ && pfStart_ < start + n) pfStale_ = true;
+    }
 
-    // Update inode + FD.
-    for (std::size_t i = 0; i < neededBlocks; ++i)
-        ino.direct[i] = startBlk + static_cast<int>(i);
-    ino.size  = length;
-    fde.rwPtr = length;
+    /// Empties the prefetch queue and waits for the run in progress.
+    void quiescePrefetch(std::unique_lock<std::mutex>& lk)
+    {
+        pfCount_ = 0;
+        pfIdle_.wait(lk, [&] { return !pfBusy_; });
+    }
 
-    // Flush meta‑data to disk.
-    write_blocks(1, 12, g_inodeTable.get());
-    write_blocks(20, 3, &g_bitmap);
+    void stopPrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            pfStop_ = true;
+            pfWake_.notify_all();
+        }
+        if (prefetcher_.joinable()) prefetcher_.join();
+        if (pfBuf_) ::operator delete(pfBuf_, std::align_val_t(IO_BUFFER_ALIGN));
+        pfBuf_ = nullptr;
+    }
 
-    return length;
-}
+    void prefetcherMain()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            pfWake_.wait(lk, [&] { return pfStop_ || pfCount_ > 0; });
+            if (pfStop_) break;
+            const PrefetchRun r = pfQueue_[pfHead_];
+            pfHead_ = (pfHead_ + 1) % PREFETCH_QUEUE;
+            --pfCount_;
+            if (!dev_ || !capacity_) continue;
 
-//─────────────────────────────────────────────────────────────────────────
-//  Read – naïve version (reads up to *length* or EOF, whichever is smaller).
-//─────────────────────────────────────────────────────────────────────────
+            pfBusy_  = true;
+            pfStale_ = false;
+            pfStart_ = r.start;
+            pfEnd_   = r.start + r.n;
+            disk* dev = dev_;
+            lk.unlock();
+            const int rc = disk_read_blocks(dev, r.start, r.n, pfBuf_);
+            lk.lock();
+            for (int i = 0; rc == r.n && !pfStale_ && i < r.n; ++i) {
+                if (map_.count(r.start + i)) continue;
+                const std::uint32_t f = claim(lk, r.start + i, r.cold, false);   // never waits on writeback
+                if (f == NIL) break;
+                std::memcpy(frame(f), pfBuf_ + std::size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+            pfBusy_ = false;
+            pfIdle_.notify_all();
+        }
+    }
 
-int sfs_fread(int fd, char* buf, int length)
-{
-    if (fd < 0 || static_cast<std::size_t>(fd) >= g_fdTable->fds.size())
-        return -1;
-    auto& fde = g_fdTable->fds[fd];
-    if (fde.free) return -1;
+    std::mutex                                             mu_;
+    std::condition_variable                                wake_;   ///< Flusher: time to work
+    std::condition_variable                                idle_;   ///< No batch in flight
+    disk*                                                  dev_      = nullptr;
+    char*                                                  frames_   = nullptr;
+    char*                                                  staging_  = nullptr;  ///< Batch being written back
+    std::uint32_t                                          capacity_ = 0;
+    std::uint32_t                                          used_     = 0;  ///< Frames ever handed out
+    std::uint32_t                                          head_ = NIL, tail_ = NIL, free_ = NIL;
+    std::uint32_t                                          dirtyCount_ = 0;
+    std::uint64_t                                          genCounter_ = 0;
+    std::vector<std::int32_t>                              tag_;          ///< Block held by each frame
+    std::vector<std::uint32_t>                             prev_, next_;  ///< LRU links / free list
+    std::vector<std::uint8_t>                              dirty_;
+    std::vector<std::uint8_t>                              cold_;
+    std::uint32_t                                          coldCount_ = 0;
+    std::vector<std::uint64_t>                             gen_;          ///< Bumped on every change
+    std::vector<std::uint32_t>                             pin_;          ///< Read views holding each frame
+    std::uint32_t                                          pinned_ = 0;   ///< Frames with a pin
+    std::vector<Retired>                                   retired_;
+    std::vector<Clock::time_point>                         since_;        ///< When the frame became dirty
+    std::vector<BatchEntry>                                batch_;        ///< Sorted by block
+    /// The map's nodes come from a pool of its own: the prefetcher claims
+    /// frames on its thread, so only mu_ may guard the allocations.
+    std::pmr::unsynchronized_pool_resource                 pool_;
+    std::pmr::unordered_map<std::int32_t, std::uint32_t>   map_ {&pool_}; ///< block → frame
+    bool                                                   writeback_ = false;
+    bool                                                   flushing_  = false;
+    bool                                                   stop_      = false;
+    std::thread                                            flusher_;
 
-    auto& ino = (*g_inodeTable)[fde.inode];
-    if (fde.rwPtr >= ino.size) return 0;               // EOF
+    std::array<PrefetchRun, PREFETCH_QUEUE>                pfQueue_ {};
+    std::size_t                                            pfHead_  = 0, pfCount_ = 0;
+    std::condition_variable                                pfWake_;
+    std::condition_variable                                pfIdle_;
+    bool                                                   pfBusy_  = false;
+    bool                                                   pfStale_ = false;  ///< Run in progress overtaken
+    bool                                                   pfStop_  = false;
+    std::int32_t                                           pfStart_ = 0, pfEnd_ = 0;
+    char*                                                  pfBuf_   = nullptr;
+    std::thread                                            prefetcher_;
+};
 
-    const int readable = std::min(length, ino.size - fde.rwPtr);
-    const int startBlk = fde.rwPtr / BLOCK_SIZE;
-    const int offset   = fde.rwPtr % BLOCK_SIZE;
-    const int endBlk   = (fde.rwPtr + readable - 1) / BLOCK_SIZE;
+using PathString = std::pmr::string;
 
-    // Copy block‑by‑block via a scratch buffer (simpler than partial reads).
-    std::array<char, BLOCK_SIZE> scratch {};
-    int bytesRead = 0;
-    for (int blkIdx = startBlk; blkIdx <= endBlk; ++blkIdx) {
-        int physBlk = (blkIdx < 12) ? ino.direct[blkIdx]
-                                    : ensureIndirectBlock(fde.inode).pointers[blkIdx - 12];
-        read_blocks(physBlk, 1, scratch.data());
+//─────────────────────────────────────────────────────────────────────────────
+//  Tracer – optional per‑mount record of the API calls made on a mount and
+//  of every transfer to and from its image (sfs_trace_start), for offline
+//  replay with sfs_replay.  A trace is a TraceHeader followed by 32‑byte
+//  TraceRecords, each followed by its path bytes.  Records go through a
+//  buffer sized at start, so tracing allocates nothing per call.  Data is
+//  not recorded, only its position and length.
+//─────────────────────────────────────────────────────────────────────────────
 
-        int blkOffset = (blkIdx == startBlk) ? offset : 0;
-        int blkEnd    = (blkIdx == endBlk) ? ((fde.rwPtr + readable) % BLOCK_SIZE) : BLOCK_SIZE;
-        if (blkEnd == 0) blkEnd = BLOCK_SIZE;  // exact multiple
+enum TraceOp : std::uint8_t {
+    TRACE_FOPEN = 1, TRACE_FCLOSE, TRACE_FSEEK, TRACE_FWRITE, TRACE_FREAD, TRACE_FALLOCATE,
+    TRACE_REMOVE, TRACE_CLONE, TRACE_GETFILESIZE, TRACE_GETNEXTFILENAME, TRACE_MKDIR,
+    TRACE_RMDIR, TRACE_READDIR, TRACE_SYNC, TRACE_FSYNC,
+    TRACE_DISK_READ, TRACE_DISK_WRITE,                    ///< image I/O below the cache
+    TRACE_FTRUNCATE,                                      ///< after the disk records, so older traces keep their codes
+    TRACE_FADVISE, TRACE_READDIR_PLUS, TRACE_SNAPSHOT_CREATE, TRACE_SNAPSHOT_DELETE,
+    TRACE_SNAPSHOT_LIST, TRACE_DEFRAG_STEP, TRACE_LOG_CLEAN, TRACE_SET_DEDUP,
+    TRACE_SET_CACHE_BLOCKS, TRACE_SET_WRITEBACK, TRACE_SET_DISCARD, TRACE_SET_LOG_MODE,
+    TRACE_OPS
+};
 
-        std::memcpy(buf + bytesRead, scratch.data() + blkOffset, blkEnd - blkOffset);
-        bytesRead += blkEnd - blkOffset;
-    }
+constexpr std::uint32_t TRACE_WRITEBACK = 1u << 0;
+constexpr std::uint32_t TRACE_DEDUP     = 1u << 1;
+constexpr std::uint32_t TRACE_LOG       = 1u << 2;
 
-    fde.rwPtr += bytesRead;
-    return bytesRead;
-}
+struct TraceHeader {
+    std::uint32_t magic       = TRACE_MAGIC;
+    std::uint32_t version     = TRACE_VERSION;
+    std::uint32_t blockSize   = BLOCK_SIZE;
+    std::uint32_t totalBlocks = TOTAL_BLOCKS;
+    std::int64_t  created     = 0;                        ///< time() at sfs_trace_start
+    std::uint32_t cacheBlocks = 0;                        ///< Mount settings then, applied by the replay
+    std::uint32_t flags       = 0;                        ///< TRACE_WRITEBACK | TRACE_DEDUP | TRACE_LOG
+};
 
-//─────────────────────────────────────────────────────────────────────────
-//  Remove (unlink) – simplified (direct blocks only)
-//─────────────────────────────────────────────────────────────────────────
+/// One call.  For disk records, fd is the first block and length the
+/// block count.  Two paths (sfs_clone, or sfs_readdir's directory and the
+/// name passed in) are stored back to back, separated by a NUL.  Settings
+/// and counts (sfs_set_*, sfs_defrag_step, sfs_log_clean) go in length.
+struct TraceRecord {
+    std::uint8_t  op       = 0;                           ///< TraceOp
+    std::uint8_t  arg      = 0;                           ///< sfs_fadvise's advice
+    std::uint16_t pathLen  = 0;                           ///< Path bytes after the record
+    std::int32_t  fd       = -1;
+    std::int32_t  offset   = 0;                           ///< File position before the call, or its argument
+    std::int32_t  length   = 0;
+    std::int32_t  result   = 0;
+    std::uint32_t duration = 0;                           ///< ns, saturated
+    std::uint64_t start    = 0;                           ///< ns since sfs_trace_start
+};
+static_assert(sizeof(TraceRecord) == 32, "trace records are 32 bytes");
 
-int sfs_remove(const char* filename)
-{
-    using namespace detail;
+class Tracer {
+public:
+    Tracer() = default;
+    ~Tracer() { stop(); }
+    Tracer(const Tracer&)            = delete;
+    Tracer& operator=(const Tracer&) = delete;
 
-    const int inodeIdx = inodeOf(filename);
-    if (inodeIdx < 0) return -1;  // ENOENT
+    bool active() const { return active_.load(std::memory_order_acquire); }
 
-    // Reject if file is still open.
-    if (fdOfInode(inodeIdx) >= 0) {
-        std::cerr << "[SFS] Cannot unlink – file still open.\n";
-        return -1;
+    static std::uint64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);   // the clock disk_emu's trace hook uses
+        return std::uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
     }
 
-    auto& ino = (*g_inodeTable)[inodeIdx];
-
-    const std::size_t blocksUsed = (ino.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (std::size_t i = 0; i < blocksUsed && i < 12; ++i) {
-        if (ino.direct[i] >= 0) g_bitmap.used[ino.direct[i]] = 1;
-    }
-    if (blocksUsed > 12 && ino.indirect >= 0) {
-        IndirectBlock ib;  read_blocks(ino.indirect, 1, &ib);
-        for (std::size_t j = 0; j < blocksUsed - 12; ++j)
-            if (ib.pointers[j] >= 0) g_bitmap.used[ib.pointers[j]] = 1;
-        g_bitmap.used[ino.indirect] = 1; // free the indirect block itself
+    int start(const char* path, TraceHeader h)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (out_) {
+            std::cerr << "[SFS] A trace is already being recorded on this mount.\n";
+            return -1;
+        }
+        out_ = std::fopen(path, "wb");
+        if (!out_) {
+            std::cerr << "[SFS] Cannot create trace file " << path << ".\n";
+            return -1;
+        }
+        h.created = static_cast<std::int64_t>(std::time(nullptr));
+        buf_.reserve(TRACE_BUFFER_BYTES);
+        buf_.assign(reinterpret_cast<const char*>(&h), reinterpret_cast<const char*>(&h + 1));
+        t0_     = now();
+        failed_ = false;
+        active_.store(true, std::memory_order_release);
+        return 0;
+    }
+
+    /// Flushes and closes the trace.  Returns −1 if any of it was lost.
+    int stop()
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!out_) return 0;
+        active_.store(false, std::memory_order_release);
+        flushLocked();
+        failed_ |= std::fclose(out_) != 0;
+        out_ = nullptr;
+        if (failed_) std::cerr << "[SFS] The trace could not be written completely.\n";
+        return failed_ ? -1 : 0;
+    }
+
+    void record(TraceOp op, std::int32_t fd, std::int32_t offset, std::int32_t length, std::int32_t result,
+                std::uint64_t begin, std::uint64_t end, std::string_view path = {}, std::string_view path2 = {},
+                std::uint8_t arg = 0)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (!out_) return;
+        path  = path.substr(0, TRACE_BUFFER_BYTES / 4);   // both fit the buffer and pathLen
+        path2 = path2.substr(0, TRACE_BUFFER_BYTES / 4);
+        TraceRecord r;
+        r.op       = op;
+        r.arg      = arg;
+        r.pathLen  = static_cast<std::uint16_t>(path.size() + (path2.empty() ? 0 : path2.size() + 1));
+        r.fd       = fd;
+        r.offset   = offset;
+        r.length   = length;
+        r.result   = result;
+        r.duration = static_cast<std::uint32_t>(std::min<std::uint64_t>(end - begin, UINT32_MAX));
+        r.start    = begin > t0_ ? begin - t0_ : 0;
+        if (buf_.size() + sizeof(r) + r.pathLen > TRACE_BUFFER_BYTES) flushLocked();
+        buf_.insert(buf_.end(), reinterpret_cast<const char*>(&r), reinterpret_cast<const char*>(&r + 1));
+        buf_.insert(buf_.end(), path.begin(), path.end());
+        if (!path2.empty()) {
+            buf_.push_back('\0');
+            buf_.insert(buf_.end(), path2.begin(), path2.end());
+        }
+    }
+
+    /// disk_trace_fn; *ctx* is the Tracer.
+    static void diskHook(void* ctx, int write, int start, int n, int result, long long begin, long long end)
+    {
+        auto* t = static_cast<Tracer*>(ctx);
+        if (t->active())
+            t->record(write ? TRACE_DISK_WRITE : TRACE_DISK_READ, start, 0, n, result,
+                      std::uint64_t(begin), std::uint64_t(end));
+    }
+
+private:
+    void flushLocked()
+    {
+        if (!buf_.empty() && std::fwrite(buf_.data(), 1, buf_.size(), out_) != buf_.size()) failed_ = true;
+        buf_.clear();
+    }
+
+    std::mutex        mu_;                 ///< API and disk records come from several threads
+    std::FILE*        out_    = nullptr;
+    std::vector<char> buf_;
+    std::uint64_t     t0_     = 0;
+    bool              failed_ = false;
+    std::atomic<bool> active_ {false};
+};
+
+//─────────────────────────────────────────────────────────────────────────────
+//  I/O scheduler.  Calls on one mount are serialised by its lock, so the
+//  scheduler sits in front of that lock rather than in front of each disk
+//  request: a call waits here, holding nothing, until its class has tokens
+//  and it is the class's turn, and only then takes the mount.  A request
+//  throttled below the lock would hold the mount and stall every class.
+//
+//  Each class has two token buckets – calls and bytes – refilled at its
+//  limits and holding up to one second's worth.  A call is admitted while
+//  the buckets are not in debt and then pays its full cost, so one large
+//  read is not split but delays the class's next call.  Among classes that
+//  are ready the highest priority wins; equal priorities are served in
+//  order of virtual time (start‑time fair queueing), which advances by a
+//  call's cost over the class weight.  Off until a class is configured.
+//─────────────────────────────────────────────────────────────────────────────
+
+class IoScheduler {
+public:
+    IoScheduler()
+    {
+        for (auto& c : classes_) c.cfg = {1, 1, 0, 0};
+        classes_[SFS_IO_BACKGROUND].cfg.priority = 0;
+        fdClass_.fill(SFS_IO_DEFAULT);
+    }
+    IoScheduler(const IoScheduler&)            = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+    void configure(int cls, const sfs_io_class& cfg)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        Class& c = classes_[cls];
+        c.cfg    = cfg;
+        c.ops    = cfg.iops;
+        c.bytes  = cfg.bytes_per_sec;
+        c.refill = Tracer::now();
+        enabled_ = true;
+        cv_.notify_all();
+    }
+
+    sfs_io_class config(int cls)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        return classes_[cls].cfg;
+    }
+
+    void assign(int fd, int cls)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        fdClass_[fd] = static_cast<std::uint8_t>(cls);
+        enabled_     = true;
+    }
+
+    /// Class of descriptor *fd*; SFS_IO_DEFAULT for calls without one.
+    int classOf(int fd)
+    {
+        if (fd < 0 || static_cast<std::size_t>(fd) >= fdClass_.size()) return SFS_IO_DEFAULT;
+        std::lock_guard<std::mutex> lk(mu_);
+        return fdClass_[fd];
+    }
+
+    /// Called when *fd* is closed, so that the next file to get it starts
+    /// in the default class.
+    void forget(int fd)
+    {
+        if (!enabled() || fd < 0 || static_cast<std::size_t>(fd) >= fdClass_.size()) return;
+        std::lock_guard<std::mutex> lk(mu_);
+        fdClass_[fd] = SFS_IO_DEFAULT;
+    }
+
+    /// Waits until a call of class *cls* moving *bytes* may take the mount.
+    /// False if *cancel* returned true first (it is checked on every wake‑up).
+    template <class Cancel>
+    bool enter(int cls, std::int64_t bytes, Cancel&& cancel)
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        Class& c = classes_[cls];
+        if (!c.waiting++) c.vtime = std::max(c.vtime, vnow_);   // joins the backlog at the current virtual time
+        const std::uint64_t t0 = Tracer::now();
+        bool waited = false;
+        for (;;) {
+            if (cancel()) {
+                --c.waiting;
+                return false;
+            }
+            const std::uint64_t now = Tracer::now();
+            for (auto& k : classes_) refill(k, now);
+            if (!busy_ && ready(c) && first(cls)) break;
+            waited = true;
+            if (ready(c)) cv_.wait(lk);
+            else          cv_.wait_for(lk, std::chrono::nanoseconds(debtNs(c)));
+        }
+        --c.waiting;
+        busy_ = true;
+        if (c.cfg.iops)          c.ops   -= 1;
+        if (c.cfg.bytes_per_sec) c.bytes -= double(bytes);
+        vnow_    = c.vtime;
+        c.vtime += double(bytes + BLOCK_SIZE) / std::max(1, c.cfg.weight);
+
+        const std::uint64_t waitNs = Tracer::now() - t0;
+        ++c.stats.ops;
+        c.stats.bytes += bytes;
+        if (waited) {
+            ++c.stats.throttled;
+            c.stats.wait_ms    += waitNs / 1e6;
+            c.stats.max_wait_ms = std::max(c.stats.max_wait_ms, waitNs / 1e6);
+        }
+        return true;
+    }
+
+    /// Hands the mount on after a successful enter().
+    void leave()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            busy_ = false;
+        }
+        cv_.notify_all();
+    }
+
+    /// Wakes waiters so that they re‑check their cancel condition.
+    void wake()
+    {
+        { std::lock_guard<std::mutex> lk(mu_); }
+        cv_.notify_all();
+    }
+
+    sfs_io_stats stats(int cls)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        return classes_[cls].stats;
+    }
+
+private:
+    struct Class {
+        sfs_io_class  cfg {};
+        double        ops     = 0;      ///< Call tokens
+        double        bytes   = 0;      ///< Byte tokens
+        std::uint64_t refill  = 0;      ///< Tracer::now() of the last refill
+        double        vtime   = 0;      ///< Fair‑queueing virtual time
+        int           waiting = 0;      ///< Calls of this class in enter()
+        sfs_io_stats  stats {};
+    };
+
+    static void refill(Class& c, std::uint64_t now)
+    {
+        const double dt = (now - c.refill) / 1e9;
+        c.refill = now;
+        if (c.cfg.iops)          c.ops   = std::min<double>(c.cfg.iops, c.ops + dt * c.cfg.iops);
+        if (c.cfg.bytes_per_sec) c.bytes = std::min<double>(c.cfg.bytes_per_sec, c.bytes + dt * c.cfg.bytes_per_sec);
+    }
+
+    static bool ready(const Class& c)
+    {
+        return (!c.cfg.iops || c.ops >= 1) && (!c.cfg.bytes_per_sec || c.bytes >= 0);
+    }
+
+    /// Time until the buckets of *c* are out of debt.
+    static std::int64_t debtNs(const Class& c)
+    {
+        double s = 0;
+        if (c.cfg.iops && c.ops < 1)            s = std::max(s, (1 - c.ops) / c.cfg.iops);
+        if (c.cfg.bytes_per_sec && c.bytes < 0) s = std::max(s, -c.bytes / c.cfg.bytes_per_sec);
+        return static_cast<std::int64_t>(s * 1e9) + 1;
+    }
+
+    /// True if no other ready class with waiters goes before *cls*.
+    bool first(int cls) const
+    {
+        const Class& c = classes_[cls];
+        for (int k = 0; k < SFS_IO_CLASSES; ++k) {
+            const Class& o = classes_[k];
+            if (k == cls || !o.waiting || !ready(o)) continue;
+            if (o.cfg.priority > c.cfg.priority) return false;
+            if (o.cfg.priority == c.cfg.priority && (o.vtime < c.vtime || (o.vtime == c.vtime && k < cls))) return false;
+        }
+        return true;
+    }
+
+    std::mutex                               mu_;
+    std::condition_variable                  cv_;
+    std::array<Class, SFS_IO_CLASSES>        classes_;
+    std::array<std::uint8_t, MAX_OPEN_FILES> fdClass_;   ///< Per descriptor, like FdTable
+    double                                   vnow_  = 0;
+    bool                                     busy_  = false;   ///< A call holds the mount
+    std::atomic<bool>                        enabled_ {false};
+};
+
+/// Admission of one call through a mount's IoScheduler; a no‑op while the
+/// scheduler is off.
+class IoTicket {
+public:
+    template <class Cancel>
+    IoTicket(IoScheduler& s, int cls, std::int64_t bytes, Cancel&& cancel)
+        : sched_(s.enabled() ? &s : nullptr)
+    {
+        if (sched_ && !sched_->enter(cls, bytes, cancel)) {
+            sched_     = nullptr;
+            cancelled_ = true;
+        }
+    }
+    IoTicket(IoScheduler& s, int cls, std::int64_t bytes) : IoTicket(s, cls, bytes, [] { return false; }) {}
+    ~IoTicket() { if (sched_) sched_->leave(); }
+    IoTicket(const IoTicket&)            = delete;
+    IoTicket& operator=(const IoTicket&) = delete;
+
+    bool cancelled() const { return cancelled_; }
+
+private:
+    IoScheduler* sched_;
+    bool         cancelled_ = false;
+};
+
+class Mount;
+
+/// Behind sfs_view::priv: the spans handed out and the cache frames they
+/// keep pinned.  Released views go back to their mount's pool with their
+/// arrays and copy buffer, so a warm sfs_read_view allocates nothing.
+struct ReadView {
+    Mount*                   mount = nullptr;
+    std::vector<sfs_span>    spans;
+    std::vector<const char*> pins;
+    std::unique_ptr<char[]>  copy;          ///< Blocks the cache could not lend
+    int                      copyBytes = 0; ///< … and its size
+};
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Mount – everything one mounted image owns: its disk handle, the metadata
+//  tables, the in‑memory indexes and the per‑mount memory above.  Mounts are
+//  independent, so a process can drive many images at once, one thread per
+//  mount.  The legacy C API works on a built‑in default mount.
+//─────────────────────────────────────────────────────────────────────────────
+
+class Mount {
+public:
+    Mount()                        = default;
+    Mount(const Mount&)            = delete;
+    Mount& operator=(const Mount&) = delete;
+
+    disk*                          dev        = nullptr;  ///< Backing image (disk_emu handle)
+    std::mutex                     lock;                  ///< Serialises the handle‑based API
+
+    Arena                          arena;
+    BlockPool                      blockPool;
+    /// Node allocations of the in‑memory indexes and path strings are
+    /// recycled through this pool instead of going back to the heap.
+    std::pmr::unsynchronized_pool_resource metaPool;
+
+    FdTable*                       fdTable    = nullptr;  // both live in arena
+    InodeTable*                    inodeTable = nullptr;
+    std::array<char, MAX_FILE_NAME_LEN + 1> listCursor {}; ///< Last name sfs_getnextfilename returned
+    Bitmap                         bitmap;
+    SuperBlock                     super;                 ///< Mounted super‑block (feature bits)
+    RefCounts                      refs;
+    Fingerprints                   fprints;
+    std::bitset<REFCOUNT_BLOCKS + FPRINT_BLOCKS> blockMetaDirty; ///< Table blocks persistBlockMeta() marked
+    std::bitset<TOTAL_BLOCKS>      discardPending;       ///< Freed, not yet discarded (flushDiscards)
+    std::int32_t                   discardCount = 0;
+    std::pmr::unordered_map<std::uint64_t, std::int32_t> dedupIndex {&metaPool};   // fingerprint → block
+    std::pmr::unordered_map<PathString, std::int32_t>    dentryCache {&metaPool};  // "a/b/c" → inode
+    std::pmr::map<std::int32_t, std::int32_t>            freeByOffset {&metaPool}; // start → length
+    std::pmr::set<std::pair<std::int32_t, std::int32_t>> freeBySize {&metaPool};   // (length, start)
+    BlockCache                     cache;                 ///< Recently used image blocks
+    std::uint32_t                  cacheBlocks = CACHE_DEFAULT_BLOCKS; ///< Configured cache size
+    bool                           coldReads  = false;   ///< Current read is a streaming one (see sfs_fadvise)
+
+    bool                           readOnly   = false;   ///< Snapshot mount
+    Mount*                         origin     = nullptr; ///< Snapshot mount: the live mount it reads through
+    int                            originSlot = -1;      ///< … and the snapshot's slot there
+    std::array<std::atomic<int>, MAX_SNAPSHOTS> snapshotPins {}; ///< Open snapshot mounts per slot
+    std::atomic<int> readViews {0};                             ///< Views not yet released (sfs_read_view)
+    bool                           closing    = false;   ///< sfs_mount_close committed: no new views or snapshot mounts
+    std::vector<std::unique_ptr<ReadView>> viewPool;             ///< Released views, kept for reuse
+
+    std::int32_t                   defragCursor = 0;     ///< Inode the next defrag batch starts at
+    std::int32_t                   defragFiles  = 0;     ///< Files relocated so far
+    std::int32_t                   defragBlocks = 0;     ///< … and their blocks
+    std::thread                    defragThread;         ///< Background defragmenter (handle mounts)
+    std::mutex                     defragMu;             ///< Guards defragStop
+    std::condition_variable        defragCv;             ///< Cuts the defragmenter's pause short
+    bool                           defragStop   = false;
+    std::atomic<bool>              defragBusy {false};   ///< Defragmenter still has work
+
+    std::int32_t                   logHead      = DATA_BLOCK; ///< Where the next log‑mode block is appended
+    bool                           logDirty     = false; ///< Tables changed since the last checkpoint
+    std::uint64_t                  logSince     = 0;     ///< … since when (Tracer::now())
+    std::vector<std::int32_t>      logPending;           ///< Superseded blocks, freed by the next checkpoint
+    std::bitset<TOTAL_BLOCKS>      logFresh;             ///< Allocated since the last checkpoint
+    std::array<std::uint64_t, LOG_SEGMENTS> logStamp {}; ///< Last append into each segment
+    std::int32_t                   logCheckpoints = 0;   ///< Checkpoints written so far
+    std::int32_t                   logCleaned   = 0;     ///< Segments the cleaner freed
+    std::int32_t                   logMoved     = 0;     ///< … and the live blocks it moved
+    std::thread                    logThread;            ///< Checkpointer and cleaner (handle mounts)
+    std::mutex                     logMu;                ///< Guards logStop
+    std::condition_variable        logCv;                ///< Cuts the cleaner's pause short
+    bool                           logStop      = false;
+    std::thread                    ckptThread;           ///< Periodic RAM‑disk checkpoints (sfs_mount_open_ram)
+    std::mutex                     ckptMu;               ///< Guards ckptStop
+    std::condition_variable        ckptCv;               ///< Cuts the checkpointer's pause short
+    bool                           ckptStop     = false;
+
+    Tracer                         trace;                ///< sfs_trace_start
+    IoScheduler                    qos;                  ///< I/O classes (handle mounts)
+};
+
+inline Mount                g_defaultMount;      // behind mksfs() & co.
+inline thread_local Mount*  t_mount = nullptr;   // set by MountScope
+
+/// The mount the calling thread is operating on.
+inline Mount& mnt() { return t_mount ? *t_mount : g_defaultMount; }
+
+/// Locks *m* and makes it the calling thread's current mount until the end
+/// of the scope.
+class MountScope {
+public:
+    explicit MountScope(Mount& m) : guard_(m.lock), prev_(t_mount) { t_mount = &m; }
+    ~MountScope() { t_mount = prev_; }
+    MountScope(const MountScope&)            = delete;
+    MountScope& operator=(const MountScope&) = delete;
+
+private:
+    std::lock_guard<std::mutex> guard_;
+    Mount*                      prev_;
+};
+
+/// Block I/O against the current mount's image, through its block cache.
+inline int diskRead(int start, int n, void* buf)  { return mnt().cache.read(start, n, buf, mnt().coldReads); }
+inline int diskWrite(int start, int n, void* buf) { return mnt().cache.write(start, n, buf); }
+
+/// RAII handle on one pooled block buffer of the current mount.  Falls back
+/// to an aligned heap block only if more than IO_POOL_BLOCKS are in flight.
+class PooledBlock {
+public:
+    PooledBlock() : pool_(mnt().blockPool), buf_(pool_.acquire())
+    {
+        if (!buf_) buf_ = static_cast<char*>(::operator new(BLOCK_SIZE, std::align_val_t(BLOCK_SIZE)));
+    }
+    ~PooledBlock()
+    {
+        if (pool_.owns(buf_)) pool_.release(buf_);
+        else ::operator delete(buf_, std::align_val_t(BLOCK_SIZE));
+    }
+    PooledBlock(const PooledBlock&)            = delete;
+    PooledBlock& operator=(const PooledBlock&) = delete;
+
+    char* data() { return buf_; }
+    void  fill(char c) { std::memset(buf_, c, BLOCK_SIZE); }
+    template <class T> T* as() { static_assert(sizeof(T) == BLOCK_SIZE); return reinterpret_cast<T*>(buf_); }
+
+private:
+    BlockPool& pool_;
+    char*      buf_;
+};
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Helper utilities (internal linkage)
+//─────────────────────────────────────────────────────────────────────────────
+namespace detail {
+
+/// Zero‑initialises all runtime tables so that every *free* flag is set and
+/// every pointer contains a sentinel value understood by the SFS logic.
+inline void clearRuntimeState()
+{
+    Mount& m = mnt();
+    m.arena.reset();
+    m.fdTable    = m.arena.make<FdTable>();          // default‑constructed → already "free"
+    m.inodeTable = m.arena.make<InodeTable>();
+    m.listCursor = {};
+    m.blockPool.init(m.arena);
+    m.bitmap     = {};
+    m.super      = {};
+    m.refs       = {};
+    m.blockMetaDirty.reset();
+    m.discardPending.reset();
+    m.discardCount = 0;
+    m.fprints    = {};
+    m.dedupIndex.clear();
+    m.dentryCache.clear();
+    m.freeByOffset.clear();
+    m.freeBySize.clear();
+    m.defragCursor = 0;
+    m.logHead      = DATA_BLOCK;
+    m.logDirty     = false;
+    m.logPending.clear();
+    m.logPending.reserve(TOTAL_BLOCKS);   // superseded blocks never allocate on the write path
+    m.logFresh.reset();
+    m.logStamp     = {};
+    m.cache.resize(m.cacheBlocks);   // nothing cached belongs to a freshly (re)loaded image
+
+    // Reserve inode 0 for the root directory – mark as allocated.  Like
+    // every directory it starts without a B+tree (direct[0] = −1).
+    (*m.inodeTable)[ROOT_INODE].free = 0;
+    (*m.inodeTable)[ROOT_INODE].type = INODE_DIR;
+    (*m.inodeTable)[ROOT_INODE].size = 0;
+
+    // Reserve all meta‑data blocks (super‑block, inode table as formatted,
+    // bitmap, reference counts and fingerprints).
+    for (std::size_t i = 0; i < DATA_BLOCK; ++i)
+        m.bitmap.used[i] = 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Free‑space index.  Free extents are kept twice – by start block and by
+//  (length, start) – so the allocator can do goal‑directed placement near a
+//  hint and fall back to best fit, both in O(log n).  The bitmap stays the
+//  on‑disk truth; the index is rebuilt from it at mount.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Removes [start, start + len) – which must lie inside one free extent –
+/// from the index without touching the bitmap.
+inline void extentTake(int start, int len)
+{
+    if (mnt().discardCount)   // handed out again – its old contents are no longer dead
+        for (int b = start; b < start + len; ++b)
+            if (mnt().discardPending[b]) {
+                mnt().discardPending.reset(b);
+                --mnt().discardCount;
+            }
+    auto it = std::prev(mnt().freeByOffset.upper_bound(start));
+    const int eStart = it->first, eLen = it->second;
+    mnt().freeBySize.erase({eLen, eStart});
+    mnt().freeByOffset.erase(it);
+    if (start > eStart) {
+        mnt().freeByOffset.emplace(eStart, start - eStart);
+        mnt().freeBySize.emplace(start - eStart, eStart);
+    }
+    const int tail = eStart + eLen - (start + len);
+    if (tail > 0) {
+        mnt().freeByOffset.emplace(start + len, tail);
+        mnt().freeBySize.emplace(tail, start + len);
+    }
+}
+
+/// Returns [start, start + len) to the index, coalescing with neighbours.
+inline void extentInsert(int start, int len)
+{
+    auto next = mnt().freeByOffset.lower_bound(start);
+    if (next != mnt().freeByOffset.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == start) {
+            start = prev->first;
+            len  += prev->second;
+            mnt().freeBySize.erase({prev->second, prev->first});
+            mnt().freeByOffset.erase(prev);
+        }
+    }
+    if (next != mnt().freeByOffset.end() && next->first == start + len) {
+        len += next->second;
+        mnt().freeBySize.erase({next->second, next->first});
+        mnt().freeByOffset.erase(next);
+    }
+    mnt().freeByOffset.emplace(start, len);
+    mnt().freeBySize.emplace(len, start);
+}
+
+/// Rebuilds the index from the bitmap.
+inline void rebuildFreeExtents()
+{
+    mnt().freeByOffset.clear();
+    mnt().freeBySize.clear();
+    for (std::size_t i = 0; i < TOTAL_BLOCKS; ) {
+        if (!mnt().bitmap.used[i]) { ++i; continue; }
+        std::size_t j = i;
+        while (j < TOTAL_BLOCKS && mnt().bitmap.used[j]) ++j;
+        extentInsert(static_cast<int>(i), static_cast<int>(j - i));
+        i = j;
+    }
+}
+
+/// Picks *n* contiguous free blocks and removes them from the index (the
+/// bitmap is left alone).  With a *goal* the run starts at the goal when
+/// possible, else in the first fitting extent within LOCALITY_WINDOW blocks
+/// after it; otherwise the smallest extent that fits is used.  −1 if none.
+inline int reserveExtent(int n, int goal = -1)
+{
+    if (n <= 0) return -1;
+    if (goal >= 0 && goal < static_cast<int>(TOTAL_BLOCKS)) {
+        auto it = mnt().freeByOffset.upper_bound(goal);
+        if (it != mnt().freeByOffset.begin()) {
+            auto prev = std::prev(it);
+            if (prev->first + prev->second >= goal + n) { extentTake(goal, n); return goal; }
+        }
+        for (; it != mnt().freeByOffset.end() && it->first < goal + static_cast<int>(LOCALITY_WINDOW); ++it)
+            if (it->second >= n) { const int start = it->first; extentTake(start, n); return start; }
+    }
+    auto fit = mnt().freeBySize.lower_bound({n, -1});
+    if (fit == mnt().freeBySize.end()) return -1;
+    const int start = fit->second;
+    extentTake(start, n);
+    return start;
+}
+
+/// Finds *n* contiguous free blocks (near *goal* when given), marks them as
+/// allocated, and returns the starting index or −1 if none found.
+inline int allocateContiguousBlocks(std::size_t n, int goal = -1)
+{
+    const int start = reserveExtent(static_cast<int>(n), goal);
+    if (start < 0) return -1;
+    for (std::size_t j = 0; j < n; ++j) mnt().bitmap.used[start + j] = 0;
+    return start;
+}
+
+/// Calls fn(start, n) for each run of consecutive written blocks backing
+/// file blocks [from, to) of *ino*, in file order, cut at CACHE_MAX_RUN.
+template <class Fn>
+inline void forEachRun(const Inode& ino, int from, int to, Fn&& fn)
+{
+    PooledBlock indirect;
+    if (to > 12 && ino.indirect >= 0) diskRead(ino.indirect, 1, indirect.data());
+    int runStart = -1, runLen = 0;
+    for (int l = from; l < to; ++l) {
+        const std::int32_t p = l < 12 ? ino.direct[l]
+                             : ino.indirect >= 0 ? indirect.as<IndirectBlock>()->pointers[l - 12] : -1;
+        if (p >= 0 && runLen && p == runStart + runLen && runLen < CACHE_MAX_RUN) {
+            ++runLen;
+            continue;
+        }
+        if (runLen) fn(runStart, runLen);
+        runStart = p;
+        runLen   = p >= 0 ? 1 : 0;   // unmapped and unwritten blocks cost no I/O
+    }
+    if (runLen) fn(runStart, runLen);
+}
+
+/// Queues read‑ahead after a read of file blocks [first, last] through
+/// *fde*: RA_SEQUENTIAL_BLOCKS ahead under SFS_FADV_SEQUENTIAL, and
+/// RA_NORMAL_BLOCKS when a normal reader carries on where it stopped.
+inline void readAhead(FdEntry& fde, const Inode& ino, int first, int last)
+{
+    int window = 0;
+    if (fde.advice == SFS_FADV_SEQUENTIAL)                         window = RA_SEQUENTIAL_BLOCKS;
+    else if (fde.advice == SFS_FADV_NORMAL &&
+             (first == fde.raLast || first == fde.raLast + 1))     window = RA_NORMAL_BLOCKS;
+    fde.raLast = last;
+    if (!window) return;
+
+    const int fileBlocks = (ino.size + static_cast<int>(BLOCK_SIZE) - 1) / static_cast<int>(BLOCK_SIZE);
+    const int from = std::max(last + 1, fde.raNext);
+    const int to   = std::min(last + 1 + window, fileBlocks);
+    if (from >= to) return;
+    const bool cold = fde.advice == SFS_FADV_SEQUENTIAL;
+    forEachRun(ino, from, to, [&](int start, int n) { mnt().cache.prefetch(start, n, cold); });
+    fde.raNext = to;
+}
+
+/// Returns the unused part of an FD's preallocation window to the index.
+inline void releasePrealloc(FdEntry& fde)
+{
+    if (fde.preallocLen > 0) extentInsert(fde.prealloc, fde.preallocLen);
+    fde.prealloc    = -1;
+    fde.preallocLen = 0;
+}
+
+/// Allocates one data block for the file open on *fde*, as close to *goal*
+/// (normally the block after the file's previous one) as possible.  *want*
+/// is how many more blocks the caller expects to need; the run is reserved
+/// in one go together with a PREALLOC_WINDOW tail that later appends consume
+/// until the FD is closed.  Returns −1 when the disk is full.
+inline int allocateForFile(FdEntry& fde, int want, int goal)
+{
+    if (fde.preallocLen > 0 && fde.prealloc == goal) {
+        const int blk = fde.prealloc++;
+        --fde.preallocLen;
+        mnt().bitmap.used[blk] = 0;
+        return blk;
+    }
+    releasePrealloc(fde);
+
+    int len   = want + static_cast<int>(PREALLOC_WINDOW);
+    int start = reserveExtent(len, goal);
+    if (start < 0) start = reserveExtent(len = want, goal);
+    if (start < 0) start = reserveExtent(len = 1, goal);
+    if (start < 0) return -1;
+
+    mnt().bitmap.used[start] = 0;
+    if (len > 1) { fde.prealloc = start + 1; fde.preallocLen = len - 1; }
+    return start;
+}
+
+/// Reads *bytes* starting at block *start* into *dst* without overrunning
+/// *dst* when the structure is not a whole number of blocks.
+inline void readRegion(int start, void* dst, std::size_t bytes)
+{
+    const std::size_t whole = bytes / BLOCK_SIZE;
+    if (whole) diskRead(start, static_cast<int>(whole), dst);
+    if (bytes % BLOCK_SIZE) {
+        PooledBlock tail;
+        diskRead(start + static_cast<int>(whole), 1, tail.data());
+        std::memcpy(static_cast<char*>(dst) + whole * BLOCK_SIZE, tail.data(), bytes % BLOCK_SIZE);
+    }
+}
+
+/// Counterpart of readRegion(); the tail of the last block is zero‑padded.
+inline void writeRegion(int start, const void* src, std::size_t bytes)
+{
+    const std::size_t whole = bytes / BLOCK_SIZE;
+    if (whole) diskWrite(start, static_cast<int>(whole), const_cast<void*>(src));
+    if (bytes % BLOCK_SIZE) {
+        PooledBlock tail;
+        tail.fill(0);
+        std::memcpy(tail.data(), static_cast<const char*>(src) + whole * BLOCK_SIZE, bytes % BLOCK_SIZE);
+        diskWrite(start + static_cast<int>(whole), 1, tail.data());
+    }
+}
+
+inline void logCheckpoint();
+inline void flushBlockMeta();
+
+/// Hands the blocks releaseBlock() freed to the disk's discard queue.  Only
+/// called once the metadata that frees them has been written, so a crash
+/// never leaves the image mapping a punched block.
+/// With writeback on, that metadata may still sit in the cache, so the
+/// blocks wait for the next full sync (syncAll, mount close).
+inline void flushDiscards(bool synced = false)
+{
+    Mount& m = mnt();
+    if (!m.discardCount || (m.cache.writeback() && !synced)) return;
+    for (std::size_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        if (!m.discardPending[b]) continue;
+        std::size_t end = b + 1;
+        while (end < TOTAL_BLOCKS && m.discardPending[end]) ++end;
+        disk_discard_blocks(m.dev, static_cast<int>(b), static_cast<int>(end - b));
+        b = end;
+    }
+    m.discardPending.reset();
+    m.discardCount = 0;
+}
+
+/// Number of inodes in the blocks the super‑block lists.
+inline std::size_t inodeCount() { return std::size_t(mnt().super.inodeTableBlocks) * INODES_PER_BLOCK; }
+
+/// Reads (or writes) the inode table from (to) the blocks the super‑block
+/// lists, one request per run of consecutive blocks.
+template <class Io>
+inline void inodeTableIo(Io io)
+{
+    const SuperBlock& sb = mnt().super;
+    for (std::uint32_t k = 0; k < sb.inodeTableBlocks; ) {
+        std::uint32_t end = k + 1;
+        while (end < sb.inodeTableBlocks && sb.inodeBlocks[end] == sb.inodeBlocks[end - 1] + 1) ++end;
+        io(sb.inodeBlocks[k], static_cast<int>(end - k), &mnt().inodeTable->blocks[k]);
+        k = end;
+    }
+}
+inline void readInodeTable()  { inodeTableIo(diskRead); }
+inline void writeInodeTable() { inodeTableIo(diskWrite); }
+
+/// Write‑back helpers for the fixed meta‑data tables.  In log mode the
+/// inode table only goes out as part of a checkpoint, which also covers
+/// whatever log‑mode writes changed since the last one.  Reference counts
+/// and fingerprints marked by persistBlockMeta() go out first; blocks
+/// freed so far are discarded after.
+inline void persistInodeTable()
+{
+    flushBlockMeta();
+    if (mnt().logDirty) logCheckpoint();
+    else                writeInodeTable();
+    flushDiscards();
+}
+inline void persistBitmap()
+{
+    flushBlockMeta();
+    writeRegion(20, &mnt().bitmap, sizeof(mnt().bitmap));
+    flushDiscards();
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Block sharing (dedup).  Every data block carries a reference count; with
+//  FEATURE_DEDUP enabled, freshly written blocks are fingerprinted and looked
+//  up in mnt().dedupIndex so identical content maps onto one physical block.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// 64‑bit FNV‑1a over one block.  0 is reserved for "no fingerprint".
+inline std::uint64_t fingerprint(const void* data)
+{
+    const auto* p = static_cast<const unsigned char*>(data);
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    for (std::size_t i = 0; i < BLOCK_SIZE; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+/// Number of owners of an allocated block (implicit 1 when never shared).
+inline std::uint32_t refsOf(int blk)
+{
+    return mnt().refs.refs[blk] ? mnt().refs.refs[blk] : 1;
+}
+
+/// Marks the table blocks that hold the counter / fingerprint of *blk*.
+/// flushBlockMeta() writes them once per call, ahead of the inode table
+/// or bitmap, instead of two writes per block touched.
+inline void persistBlockMeta(int blk)
+{
+    mnt().blockMetaDirty.set(blk * sizeof(std::uint16_t) / BLOCK_SIZE);
+    mnt().blockMetaDirty.set(REFCOUNT_BLOCKS + blk * sizeof(std::uint64_t) / BLOCK_SIZE);
+}
+
+/// Writes the table blocks persistBlockMeta() marked, in contiguous runs.
+inline void flushBlockMeta()
+{
+    auto& dirty = mnt().blockMetaDirty;
+    if (dirty.none()) return;
+    const auto* refs = reinterpret_cast<const char*>(&mnt().refs);
+    const auto* fps  = reinterpret_cast<const char*>(&mnt().fprints);
+    for (std::size_t i = 0; i < dirty.size();) {
+        if (!dirty[i]) {
+            ++i;
+            continue;
+        }
+        const bool        isRef = i < REFCOUNT_BLOCKS;
+        const std::size_t limit = isRef ? REFCOUNT_BLOCKS : dirty.size();
+        std::size_t end = i + 1;
+        while (end < limit && dirty[end]) ++end;
+        const std::size_t first = isRef ? i : i - REFCOUNT_BLOCKS;
+        const std::size_t bytes = isRef ? sizeof(mnt().refs) : sizeof(mnt().fprints);
+        writeRegion(REFCOUNT_BLOCK + static_cast<int>(i), (isRef ? refs : fps) + first * BLOCK_SIZE,
+                    std::min((end - i) * BLOCK_SIZE, bytes - first * BLOCK_SIZE));
+        i = end;
+    }
+    dirty.reset();
+}
+
+/// Adds an owner to an allocated block; the caller checks that the count
+/// has room (refsOf(blk) < UINT16_MAX).
+inline void retainBlock(int blk)
+{
+    mnt().refs.refs[blk] = static_cast<std::uint16_t>(refsOf(blk) + 1);
+    persistBlockMeta(blk);
+}
+
+/// Drops one owner; the bitmap bit is only cleared by the last owner.
+/// Returns true if the block went back to the free pool.
+inline bool releaseBlock(int blk)
+{
+    if (blk < 0) return false;
+    if (refsOf(blk) > 1) {
+        --mnt().refs.refs[blk];
+        persistBlockMeta(blk);
+        return false;
+    }
+    mnt().bitmap.used[blk] = 1;
+    extentInsert(blk, 1);
+    if (!mnt().discardPending[blk]) {   // contents are dead – never zeroed, only punched (flushDiscards)
+        mnt().discardPending.set(blk);
+        ++mnt().discardCount;
+    }
+    mnt().cache.drop(blk);
+    if (mnt().refs.refs[blk] || mnt().fprints.hash[blk]) {
+        auto it = mnt().dedupIndex.find(mnt().fprints.hash[blk]);
+        if (it != mnt().dedupIndex.end() && it->second == blk) mnt().dedupIndex.erase(it);
+        mnt().refs.refs[blk]    = 0;
+        mnt().fprints.hash[blk] = 0;
+        persistBlockMeta(blk);
+    }
+    return true;
+}
+
+/// Returns a block already holding exactly *data* (retained on behalf of the
+/// caller), or −1.  Fingerprint hits are verified byte‑for‑byte.
+inline int dedupLookup(const void* data, std::uint64_t hash)
+{
+    auto it = mnt().dedupIndex.find(hash);
+    if (it == mnt().dedupIndex.end() || refsOf(it->second) >= UINT16_MAX) return -1;   // no owner left to add
+    PooledBlock existing;
+    diskRead(it->second, 1, existing.data());
+    if (std::memcmp(existing.data(), data, BLOCK_SIZE) != 0) return -1;
+    retainBlock(it->second);
+    return it->second;
+}
+
+/// Records *hash* as the content of freshly written block *blk*.
+inline void dedupInsert(int blk, std::uint64_t hash)
+{
+    mnt().fprints.hash[blk] = hash;
+    mnt().dedupIndex.emplace(hash, blk);
+    persistBlockMeta(blk);
+}
+
+/// Drops the fingerprint of *blk* before its content is overwritten.
+inline void dedupForget(int blk)
+{
+    auto it = mnt().dedupIndex.find(mnt().fprints.hash[blk]);
+    if (it != mnt().dedupIndex.end() && it->second == blk) mnt().dedupIndex.erase(it);
+    mnt().fprints.hash[blk] = 0;
+    persistBlockMeta(blk);
+}
+
+/// Rebuilds mnt().dedupIndex from the persisted fingerprints.
+inline void rebuildDedupIndex()
+{
+    mnt().dedupIndex.clear();
+    for (std::size_t i = 0; i < TOTAL_BLOCKS; ++i)
+        if (mnt().fprints.hash[i] && !mnt().bitmap.used[i])
+            mnt().dedupIndex.emplace(mnt().fprints.hash[i], static_cast<std::int32_t>(i));
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Log‑structured mode.  With FEATURE_LOG set, file data and indirect blocks
+//  are never overwritten once a checkpoint has made them part of the image:
+//  every update is appended at the log head, which walks forward through
+//  long free runs, so a stream of random overwrites reaches the disk as
+//  sequential writes.  The inode table – the inode map, at its fixed
+//  address – and the bitmap are not written per update but by a checkpoint
+//  at most LOG_CHECKPOINT_MS later.  Blocks superseded since then stay
+//  allocated until that checkpoint, so after a crash the image is exactly
+//  the last checkpoint.  Blocks allocated since the last checkpoint are
+//  not part of it and are rewritten in place.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Segment holding data block *blk*.
+inline int logSegment(int blk) { return (blk - static_cast<int>(DATA_BLOCK)) / LOG_SEGMENT_BLOCKS; }
+
+/// Allocates the block at the log head.  When the head's free run is used
+/// up, the log moves on to the next free run of at least a segment,
+/// wrapping around the disk, and only takes a shorter run if there is none.
+/// Returns −1 when the disk is full.
+inline int logAllocate()
+{
+    Mount& m = mnt();
+    if (m.freeByOffset.empty()) return -1;
+    auto next = m.freeByOffset.upper_bound(m.logHead);
+    int  blk  = -1;
+    if (next != m.freeByOffset.begin() && std::prev(next)->first + std::prev(next)->second > m.logHead) {
+        blk = m.logHead;
+    } else {
+        for (auto it = next; it != m.freeByOffset.end() && blk < 0; ++it)
+            if (it->second >= LOG_SEGMENT_BLOCKS) blk = it->first;
+        for (auto it = m.freeByOffset.begin(); it != next && blk < 0; ++it)
+            if (it->second >= LOG_SEGMENT_BLOCKS) blk = it->first;
+        if (blk < 0) blk = (next != m.freeByOffset.end() ? next : m.freeByOffset.begin())->first;
+    }
+    extentTake(blk, 1);
+    m.bitmap.used[blk] = 0;
+    m.logFresh.set(blk);
+    m.logHead = blk + 1;
+    if (blk >= static_cast<int>(DATA_BLOCK)) m.logStamp[logSegment(blk)] = Tracer::now();
+    return blk;
+}
+
+/// True if *blk* may be rewritten in place: outside log mode when nobody
+/// else owns it, in log mode only if no checkpoint refers to it yet.
+inline bool rewritable(int blk, bool logged)
+{
+    return blk >= 0 && refsOf(blk) == 1 && (!logged || mnt().logFresh.test(blk));
+}
+
+/// Drops the file's reference to a superseded block.  Blocks the last
+/// checkpoint still refers to are held until the next one.
+inline void logRelease(int blk)
+{
+    if (blk < 0) return;
+    if (mnt().logFresh.test(blk)) releaseBlock(blk);
+    else                          mnt().logPending.push_back(blk);
+}
+
+/// Writes a checkpoint: the bitmap with both old and new blocks in use,
+/// then the inode table – the commit point – and only then frees the
+/// superseded blocks.  A writeback cache would write these in block order,
+/// so with writeback on each step is synced before the next; if a sync
+/// fails, the checkpoint is left for the next attempt.
+inline void logCheckpoint()
+{
+    Mount& m = mnt();
+    flushBlockMeta();
+    writeRegion(20, &m.bitmap, sizeof(m.bitmap));
+    if (m.cache.writeback() && m.cache.sync() != 0) return;   // data and bitmap first
+    writeInodeTable();
+    if (m.cache.writeback() && m.cache.sync() != 0) return;   // the commit before any free
+    m.logDirty = false;
+    m.logFresh.reset();
+    if (!m.logPending.empty()) {
+        for (std::int32_t blk : m.logPending) releaseBlock(blk);
+        m.logPending.clear();
+        flushBlockMeta();   // shared blocks only lost a reference
+        writeRegion(20, &m.bitmap, sizeof(m.bitmap));
+    }
+    ++m.logCheckpoints;
+}
+
+/// Notes a log‑mode change to the tables and checkpoints once the oldest
+/// unsaved change is LOG_CHECKPOINT_MS old or LOG_PENDING_MAX blocks wait.
+inline void logDefer()
+{
+    Mount& m = mnt();
+    const std::uint64_t now = Tracer::now();
+    if (!m.logDirty) {
+        m.logDirty = true;
+        m.logSince = now;
+    }
+    if (m.logPending.size() >= LOG_PENDING_MAX || now - m.logSince >= LOG_CHECKPOINT_MS * 1000000ULL)
+        logCheckpoint();
+}
+
+/// Appends a block of free inodes to the table.  The block and the bitmap
+/// are written before the super‑block that lists it.  Returns the first
+/// new inode, or −1 if the table is at MAX_INODE_BLOCKS or the disk is full.
+inline int growInodeTable()
+{
+    Mount&      m  = mnt();
+    SuperBlock& sb = m.super;
+    if (sb.inodeTableBlocks >= MAX_INODE_BLOCKS) return -1;
+    const int blk = allocateContiguousBlocks(1);
+    if (blk < 0) return -1;
+    const std::uint32_t k = sb.inodeTableBlocks;
+    m.inodeTable->blocks[k] = {};
+    diskWrite(blk, 1, &m.inodeTable->blocks[k]);
+    persistBitmap();
+    if (m.cache.writeback() && m.cache.sync() != 0) return -1;   // the block stays allocated, unlisted
+    sb.inodeBlocks[k] = blk;
+    ++sb.inodeTableBlocks;
+    writeRegion(0, &sb, sizeof(sb));
+    return static_cast<int>(k * INODES_PER_BLOCK);
+}
+
+/// Returns the first free inode index, growing the table when every inode
+/// is in use; −1 if it cannot grow.
+inline int firstFreeInode()
+{
+    for (std::size_t i = 0; i < inodeCount(); ++i)
+        if ((*mnt().inodeTable)[i].free) return static_cast<int>(i);
+    return growInodeTable();
+}
+
+/// Returns the first free slot in the FD table or −1 if full.
+inline int firstFreeFd()
+{
+    for (std::size_t i = 0; i < mnt().fdTable->fds.size(); ++i)
+        if (mnt().fdTable->fds[i].free) return static_cast<int>(i);
+    return -1;
+}
+
+/// Locates an open FD that references *inode*.  Returns −1 if none.
+inline int fdOfInode(int inode)
+{
+    for (std::size_t i = 0; i < mnt().fdTable->fds.size(); ++i)
+        if (mnt().fdTable->fds[i].inode == inode && !mnt().fdTable->fds[i].free)
+            return static_cast<int>(i);
+    return -1;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Directory B+tree.  Every node is one block read/written in full; the tree
+//  root of a directory inode lives in direct[0] (−1 while empty).
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Index of the first key in *n* that is ≥ *name* (lower) / > *name* (upper).
+inline int lowerBound(const BTreeNode& n, const char* name)
+{
+    int lo = 0, hi = n.count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (std::strcmp(n.keys[mid].data(), name) < 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+inline int upperBound(const BTreeNode& n, const char* name)
+{
+    int lo = 0, hi = n.count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (std::strcmp(n.keys[mid].data(), name) <= 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+inline int allocNodeBlock()
+{
+    return allocateContiguousBlocks(1);
+}
+
+/// True if at least *n* blocks are free.
+inline bool haveFreeBlocks(int n)
+{
+    for (auto it = mnt().freeByOffset.begin(); n > 0 && it != mnt().freeByOffset.end(); ++it) n -= it->second;
+    return n <= 0;
+}
+
+/// Returns the value stored under *name* in the tree rooted at *blk*, or −1.
+inline int btreeLookup(int blk, const char* name)
+{
+    BTreeNode n;
+    while (blk >= 0) {
+        diskRead(blk, 1, &n);
+        if (n.leaf) {
+            const int i = lowerBound(n, name);
+            return (i < n.count && std::strcmp(n.keys[i].data(), name) == 0) ? n.vals[i] : -1;
+        }
+        blk = n.vals[upperBound(n, name)];
+    }
+    return -1;
+}
+
+/// Result of inserting below a node: the separator and new right sibling
+/// when the node had to split.
+struct BTreeSplit {
+    bool     happened = false;
+    BTreeKey key {};
+    int      right    = -1;
+};
+
+/// Blocks an insert of *name* into the tree rooted at *blk* can allocate:
+/// one per node that splits – the run of full nodes at the bottom of its
+/// path – plus a new root when that run reaches the top.
+inline int btreeInsertBlocks(int blk, const char* name)
+{
+    if (blk < 0) return 1;
+    BTreeNode n;
+    int full = 0, depth = 0;
+    for (;;) {
+        diskRead(blk, 1, &n);
+        ++depth;
+        full = n.count >= BTREE_ORDER ? full + 1 : 0;
+        if (n.leaf) break;
+        blk = n.vals[upperBound(n, name)];
+    }
+    return full == depth ? full + 1 : full;
+}
+
+/// Recursive insert.  Returns 1 on success, 0 if *name* already exists and
+/// −1 when no block is left for a split.  btreeInsert() checks for room
+/// first, so a split never fails halfway through the path.
+inline int btreeInsertAt(int blk, const char* name, int value, BTreeSplit& split)
+{
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+
+    // Work on an over‑wide copy so that a full node can take one more entry.
+    std::array<BTreeKey, BTREE_ORDER + 1>         keys;
+    std::array<std::int32_t, BTREE_ORDER + 2>     vals;
+    std::copy_n(n.keys.begin(), n.count, keys.begin());
+    std::copy_n(n.vals.begin(), n.count + 1, vals.begin());
+    int count = n.count;
+
+    BTreeKey newKey {};
+    int      pos = 0, newVal = value;
+    if (n.leaf) {
+        pos = lowerBound(n, name);
+        if (pos < n.count && std::strcmp(n.keys[pos].data(), name) == 0) return 0;
+        std::strncpy(newKey.data(), name, BTREE_KEY_LEN - 1);
+    } else {
+        pos = upperBound(n, name);
+        BTreeSplit child;
+        const int rc = btreeInsertAt(n.vals[pos], name, value, child);
+        if (rc <= 0 || !child.happened) return rc;
+        newKey = child.key;
+        newVal = child.right;
+    }
+
+    // Leaves keep vals[i] beside keys[i]; internal nodes put the new right
+    // child after its separator.
+    const int valPos = n.leaf ? pos : pos + 1;
+    std::copy_backward(keys.begin() + pos, keys.begin() + count, keys.begin() + count + 1);
+    std::copy_backward(vals.begin() + valPos, vals.begin() + count + 1, vals.begin() + count + 2);
+    keys[pos]    = newKey;
+    vals[valPos] = newVal;
+    ++count;
+
+    if (count <= static_cast<int>(BTREE_ORDER)) {
+        std::copy_n(keys.begin(), count, n.keys.begin());
+        std::copy_n(vals.begin(), count + 1, n.vals.begin());
+        n.count = static_cast<std::uint16_t>(count);
+        diskWrite(blk, 1, &n);
+        return 1;
+    }
+
+    // Split: leaves copy the middle key up, internal nodes move it up.
+    const int right = allocNodeBlock();
+    if (right < 0) return -1;
+    const int mid = count / 2;
+    BTreeNode r;
+    r.leaf = n.leaf;
+    if (n.leaf) {
+        r.count = static_cast<std::uint16_t>(count - mid);
+        std::copy(keys.begin() + mid, keys.begin() + count, r.keys.begin());
+        std::copy(vals.begin() + mid, vals.begin() + count, r.vals.begin());
+    } else {
+        r.count = static_cast<std::uint16_t>(count - mid - 1);
+        std::copy(keys.begin() + mid + 1, keys.begin() + count, r.keys.begin());
+        std::copy(vals.begin() + mid + 1, vals.begin() + count + 1, r.vals.begin());
+    }
+    n.count = static_cast<std::uint16_t>(mid);
+    std::copy_n(keys.begin(), mid, n.keys.begin());
+    std::copy_n(vals.begin(), mid + 1, n.vals.begin());
+    std::fill(n.keys.begin() + mid, n.keys.end(), BTreeKey {});
+
+    diskWrite(right, 1, &r);
+    diskWrite(blk, 1, &n);
+    split.happened = true;
+    split.key      = keys[mid];
+    split.right    = right;
+    return 1;
+}
+
+/// Inserts *name* → *value*, growing a new root when the old one splits.
+/// Returns −1, with the tree unchanged, unless every block the insert may
+/// need is free.
+inline int btreeInsert(std::int32_t& root, const char* name, int value)
+{
+    if (!haveFreeBlocks(btreeInsertBlocks(root, name))) return -1;
+    if (root < 0) {
+        const int blk = allocNodeBlock();
+        if (blk < 0) return -1;
+        BTreeNode leaf;
+        diskWrite(blk, 1, &leaf);
+        root = blk;
+    }
+    BTreeSplit split;
+    const int rc = btreeInsertAt(root, name, value, split);
+    if (rc > 0 && split.happened) {
+        const int blk = allocNodeBlock();
+        if (blk < 0) return -1;
+        BTreeNode top;
+        top.leaf    = 0;
+        top.count   = 1;
+        top.keys[0] = split.key;
+        top.vals[0] = root;
+        top.vals[1] = split.right;
+        diskWrite(blk, 1, &top);
+        root = blk;
+    }
+    return rc;
+}
+
+/// Recursive erase.  Returns 0 if *name* is not below *blk*, 1 once it is
+/// removed and 2 if that emptied *blk*, which is then freed.
+inline int btreeEraseAt(int blk, const char* name)
+{
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    if (n.leaf) {
+        const int i = lowerBound(n, name);
+        if (i >= n.count || std::strcmp(n.keys[i].data(), name) != 0) return 0;
+        if (n.count == 1) {
+            releaseBlock(blk);
+            return 2;
+        }
+        std::copy(n.keys.begin() + i + 1, n.keys.begin() + n.count, n.keys.begin() + i);
+        std::copy(n.vals.begin() + i + 1, n.vals.begin() + n.count, n.vals.begin() + i);
+        --n.count;
+        n.keys[n.count] = {};
+        diskWrite(blk, 1, &n);
+        return 1;
+    }
+
+    const int pos = upperBound(n, name);
+    const int rc  = btreeEraseAt(n.vals[pos], name);
+    if (rc != 2) return rc;
+    if (n.count == 0) {   // that was the only child
+        releaseBlock(blk);
+        return 2;
+    }
+    // Drop the child with the separator on one side of it; the neighbour
+    // that inherits the range gains no keys, since the child had none.
+    const int key = pos < n.count ? pos : pos - 1;
+    std::copy(n.keys.begin() + key + 1, n.keys.begin() + n.count, n.keys.begin() + key);
+    std::copy(n.vals.begin() + pos + 1, n.vals.begin() + n.count + 1, n.vals.begin() + pos);
+    n.vals[n.count] = 0;
+    --n.count;
+    n.keys[n.count] = {};
+    diskWrite(blk, 1, &n);
+    return 1;
+}
+
+/// Removes *name* from the tree rooted at *root*.  Nodes left empty are
+/// freed, and an internal root with a single child hands the tree to it,
+/// so an emptied directory has no blocks (*root* = −1).  Returns true if
+/// *name* was present.
+inline bool btreeErase(std::int32_t& root, const char* name)
+{
+    if (root < 0) return false;
+    const int rc = btreeEraseAt(root, name);
+    if (rc == 2) root = -1;
+    if (rc != 1) return rc == 2;
+    BTreeNode n;
+    for (diskRead(root, 1, &n); !n.leaf && n.count == 0; diskRead(root, 1, &n)) {
+        releaseBlock(root);
+        root = n.vals[0];
+    }
+    return true;
+}
+
+/// Finds the smallest key strictly greater than *after* ("" → first key).
+inline bool btreeNext(int blk, const char* after, char* outKey, int& outVal)
+{
+    if (blk < 0) return false;
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    if (n.leaf) {
+        const int i = upperBound(n, after);
+        if (i >= n.count) return false;
+        std::strcpy(outKey, n.keys[i].data());
+        outVal = n.vals[i];
+        return true;
+    }
+    for (int i = upperBound(n, after); i <= n.count; ++i)
+        if (btreeNext(n.vals[i], after, outKey, outVal)) return true;
+    return false;
+}
+
+/// Appends up to *max* − *filled* entries with keys greater than *after* to
+/// *out*, visiting each leaf once.  Returns the new fill level.
+inline int btreeCollect(int blk, const char* after, sfs_dirent_plus* out, int max, int filled)
+{
+    if (blk < 0 || filled >= max) return filled;
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    if (!n.leaf) {
+        for (int i = upperBound(n, after); i <= n.count && filled < max; ++i)
+            filled = btreeCollect(n.vals[i], after, out, max, filled);
+        return filled;
+    }
+    for (int i = upperBound(n, after); i < n.count && filled < max; ++i, ++filled) {
+        auto& e = out[filled];
+        std::strncpy(e.name, n.keys[i].data(), MAX_FILE_NAME_LEN);
+        e.name[MAX_FILE_NAME_LEN] = '\0';
+        e.inode = n.vals[i];
+        e.size  = (*mnt().inodeTable)[n.vals[i]].size;
+    }
+    return filled;
+}
+
+/// Returns every node of the tree to the allocator.
+inline void btreeFree(int blk)
+{
+    if (blk < 0) return;
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    if (!n.leaf)
+        for (int i = 0; i <= n.count; ++i) btreeFree(n.vals[i]);
+    releaseBlock(blk);
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Directory operations.  Every directory, the root included, is an inode
+//  whose entries live in a B+tree; the caller writes the inode table.
+//─────────────────────────────────────────────────────────────────────────────
+
+inline bool isDir(int inode)
+{
+    return inode >= 0 && static_cast<std::size_t>(inode) < MAX_INODES &&
+           !(*mnt().inodeTable)[inode].free && (*mnt().inodeTable)[inode].type == INODE_DIR;
+}
+
+/// Inode of *name* inside directory *dir*, or −1.
+inline int lookupIn(int dir, const char* name)
+{
+    return btreeLookup((*mnt().inodeTable)[dir].direct[0], name);
+}
+
+/// Adds *name* → *inode* to *dir*; the nodes and the bitmap are written.
+inline bool linkEntry(int dir, const char* name, int inode)
+{
+    auto& d = (*mnt().inodeTable)[dir];
+    if (btreeInsert(d.direct[0], name, inode) <= 0) return false;
+    ++d.size;
+    persistBitmap();
+    return true;
+}
+
+/// Removes *name* from *dir*; the nodes are written, and nodes it empties
+/// are freed (the caller persists the bitmap).
+inline void unlinkEntry(int dir, const char* name)
+{
+    auto& d = (*mnt().inodeTable)[dir];
+    if (btreeErase(d.direct[0], name)) --d.size;
+}
+
+/// Canonicalises *in* into "a/b/c" (no leading, trailing or doubled '/').
+/// Fails if any component is empty or too long for a directory entry.
+inline bool normalizePath(const char* in, PathString& out)
+{
+    out.clear();
+    for (const char* p = in; *p; ) {
+        while (*p == '/') ++p;
+        const char* start = p;
+        while (*p && *p != '/') ++p;
+        const std::size_t len = static_cast<std::size_t>(p - start);
+        if (len == 0) break;
+        if (len >= MAX_FILE_NAME_LEN) return false;
+        if (!out.empty()) out += '/';
+        out.append(start, len);
+    }
+    return true;
+}
+
+/// Resolves the first *end* characters of a normalised path to an inode,
+/// consulting and filling the dentry cache on the way.
+inline int resolvePrefix(const PathString& path, std::size_t end)
+{
+    if (end == 0) return ROOT_INODE;
+    const PathString key(path.data(), end, &mnt().metaPool);
+    auto it = mnt().dentryCache.find(key);
+    if (it != mnt().dentryCache.end()) return it->second;
+
+    const std::size_t slash  = key.rfind('/');
+    const int         parent = (slash == std::string::npos) ? ROOT_INODE : resolvePrefix(path, slash);
+    if (parent < 0 || !isDir(parent)) return -1;
+
+    const int inode = lookupIn(parent, key.c_str() + (slash == std::string::npos ? 0 : slash + 1));
+    if (inode >= 0) mnt().dentryCache.emplace(key, inode);
+    return inode;
+}
+
+/// Splits *in* into its normalised form, the parent directory inode and the
+/// final component.  Returns false for malformed paths or missing parents.
+inline bool locate(const char* in, PathString& path, int& parent, const char*& leaf)
+{
+    if (!normalizePath(in, path) || path.empty()) return false;
+    const std::size_t slash = path.rfind('/');
+    parent = (slash == std::string::npos) ? ROOT_INODE : resolvePrefix(path, slash);
+    leaf   = path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+    return parent >= 0 && isDir(parent);
+}
+
+/// Drops cached lookups for *path* and everything below it.
+inline void forgetDentries(const PathString& path)
+{
+    mnt().dentryCache.erase(path);
+    PathString prefix(path, &mnt().metaPool);
+    prefix += '/';
+    for (auto it = mnt().dentryCache.begin(); it != mnt().dentryCache.end(); )
+        it = (it->first.compare(0, prefix.size(), prefix) == 0) ? mnt().dentryCache.erase(it) : std::next(it);
+}
+
+/// Formats (fresh) or loads the image behind mnt().dev into the runtime
+/// tables, which clearRuntimeState() has just reset.
+inline bool formatOrLoad(bool fresh)
+{
+    if (fresh) {
+        // 1.  Construct an up‑to‑date super‑block and write it to block 0.
+        writeRegion(0, &mnt().super, sizeof(mnt().super));  // defaults from member initialisers
+
+        // 2.  Write the inode table; the root directory is its inode 0.
+        persistInodeTable();
+
+        // 3.  Persist the bitmap (3 blocks in the skeleton).
+        persistBitmap();
+
+        // 4.  Reference counts and fingerprints start zeroed, which is exactly
+        //     what a fresh disk image holds – nothing to write.
+
+    } else {
+        // Mount existing image – populate all runtime tables.
+        readRegion(0, &mnt().super, sizeof(mnt().super));
+        const SuperBlock& sb = mnt().super;
+        if (sb.magic == LEGACY_MAGIC) {
+            std::cerr << "[SFS] Image has the original layout, without block tables; format it again.\n";
+            return false;
+        }
+        if (sb.magic == FLAT_ROOT_MAGIC) {
+            std::cerr << "[SFS] Image has a flat root directory and a fixed inode table; format it again.\n";
+            return false;
+        }
+        const auto tableEnd = sb.inodeBlocks.begin() + std::min(sb.inodeTableBlocks, MAX_INODE_BLOCKS);
+        if (sb.magic != MAGIC_NUMBER || sb.blockSize != BLOCK_SIZE || sb.fsSize != TOTAL_BLOCKS ||
+            sb.inodeTableBlocks < INODE_TABLE_BLOCKS || sb.inodeTableBlocks > MAX_INODE_BLOCKS ||
+            std::any_of(sb.inodeBlocks.begin(), tableEnd,
+                        [](std::int32_t b) { return b <= 0 || b >= static_cast<std::int32_t>(TOTAL_BLOCKS); })) {
+            std::cerr << "[SFS] Not an SFS image (bad super‑block).\n";
+            return false;
+        }
+        readInodeTable();
+        readRegion(20, &mnt().bitmap, sizeof(mnt().bitmap));
+        readRegion(REFCOUNT_BLOCK, &mnt().refs, sizeof(mnt().refs));
+        readRegion(FPRINT_BLOCK, &mnt().fprints, sizeof(mnt().fprints));
+        rebuildDedupIndex();
+    }
+
+    rebuildFreeExtents();
+    return true;
+}
+
+/// False (with a diagnostic) on a read‑only snapshot mount.
+inline bool writable()
+{
+    if (!mnt().readOnly) return true;
+    std::cerr << "[SFS] Snapshot mounts are read‑only.\n";
+    return false;
+}
+
+/// True if the blocks of the files among inodes [first, last) of *table*
+/// can take one more owner for each pointer to them.  A block several
+/// files map (or one file maps several times, after dedup) gains that many
+/// owners.
+inline bool shareable(const InodeTable& table, std::size_t first, std::size_t last)
+{
+    std::vector<std::uint32_t> owners(TOTAL_BLOCKS);   // references each block would gain
+    auto fits = [&](std::int32_t p) {
+        const int b = physOf(p);
+        return b < 0 || refsOf(b) + ++owners[b] <= UINT16_MAX;
+    };
+    for (std::size_t i = first; i < last; ++i) {
+        const Inode& ino = table[i];
+        if (ino.free || ino.type != INODE_FILE) continue;
+        if (!std::all_of(ino.direct.begin(), ino.direct.end(), fits)) return false;
+        if (ino.indirect < 0) continue;
+        IndirectBlock ib;
+        diskRead(ino.indirect, 1, &ib);
+        if (!std::all_of(ib.pointers.begin(), ib.pointers.end(), fits)) return false;
+    }
+    return true;
+}
+
+/// Turns *ino*, a copy of a file inode, into a second owner of the file's
+/// data blocks.  The counts are only raised in memory (the caller persists
+/// the table), and the copy gets its own indirect block, which the caller
+/// must have room for.
+inline void shareFileBlocks(Inode& ino)
+{
+    auto share = [](std::int32_t p) {
+        if (physOf(p) >= 0) mnt().refs.refs[physOf(p)] = static_cast<std::uint16_t>(refsOf(physOf(p)) + 1);
+    };
+    std::for_each(ino.direct.begin(), ino.direct.end(), share);
+    if (ino.indirect >= 0) {
+        IndirectBlock ib;
+        diskRead(ino.indirect, 1, &ib);
+        std::for_each(ib.pointers.begin(), ib.pointers.end(), share);
+        ino.indirect = allocNodeBlock();
+        diskWrite(ino.indirect, 1, &ib);
+    }
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Snapshots.  A snapshot is a header plus a frozen copy of the inode table
+//  (1 + SnapshotHeader::inodeBlocks contiguous blocks) listed in the
+//  super‑block.  Data blocks are shared with the live file system through
+//  the reference counts, and the write path already copies a shared block
+//  before changing it, so taking a snapshot moves no file data.  Indirect
+//  blocks and directory B+trees are updated in place, so the snapshot gets
+//  its own copies of those.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Slot of the snapshot called *name*, or −1.
+inline int snapshotSlotOf(const char* name)
+{
+    SnapshotHeader h;
+    for (std::size_t i = 0; i < MAX_SNAPSHOTS; ++i) {
+        if (!mnt().super.snapshots[i]) continue;
+        readRegion(mnt().super.snapshots[i], &h, sizeof(h));
+        if (std::strcmp(h.name.data(), name) == 0) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+inline int freeBlockCount()
+{
+    int n = 0;
+    for (const auto& [start, len] : mnt().freeByOffset) n += len;
+    return n;
+}
+
+/// Number of nodes in the B+tree rooted at *blk*.
+inline int btreeBlocks(int blk)
+{
+    if (blk < 0) return 0;
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    int total = 1;
+    if (!n.leaf)
+        for (int i = 0; i <= n.count; ++i) total += btreeBlocks(n.vals[i]);
+    return total;
+}
+
+/// Copies the tree rooted at *blk* into new blocks; returns the new root.
+inline int btreeCopy(int blk)
+{
+    if (blk < 0) return blk;
+    BTreeNode n;
+    diskRead(blk, 1, &n);
+    if (!n.leaf)
+        for (int i = 0; i <= n.count; ++i) n.vals[i] = btreeCopy(n.vals[i]);
+    const int copy = allocNodeBlock();
+    diskWrite(copy, 1, &n);
+    return copy;
+}
+
+inline int snapshotCreate(const char* name)
+{
+    if (!writable()) return -1;
+    if (!name || !*name || std::strlen(name) > MAX_FILE_NAME_LEN) {
+        std::cerr << "[SFS] Invalid snapshot name.\n";
+        return -1;
+    }
+    if (snapshotSlotOf(name) >= 0) {
+        std::cerr << "[SFS] Snapshot " << name << " already exists.\n";
+        return -1;
+    }
+    auto& slots = mnt().super.snapshots;
+    const auto slot = std::find(slots.begin(), slots.end(), 0);
+    if (slot == slots.end()) {
+        std::cerr << "[SFS] Snapshot table full.\n";
+        return -1;
+    }
+
+    if (mnt().logDirty) logCheckpoint();   // the live tables on disk match the snapshot's
+
+    if (!shareable(*mnt().inodeTable, ROOT_INODE, inodeCount())) {
+        std::cerr << "[SFS] Too many owners of a block for a snapshot.\n";
+        return -1;
+    }
+
+    // Everything the snapshot needs of its own, so that it either fits or
+    // is not started.
+    const std::uint32_t tableBlocks = mnt().super.inodeTableBlocks;
+    int needed = 1 + static_cast<int>(tableBlocks);
+    for (std::size_t i = ROOT_INODE; i < inodeCount(); ++i) {
+        const Inode& ino = (*mnt().inodeTable)[i];
+        if (ino.free) continue;
+        if (ino.type == INODE_DIR) needed += btreeBlocks(ino.direct[0]);
+        else if (ino.indirect >= 0) ++needed;
+    }
+    const int start = needed <= freeBlockCount() ? allocateContiguousBlocks(1 + tableBlocks) : -1;
+    if (start < 0) {
+        std::cerr << "[SFS] Not enough space for a snapshot.\n";
+        return -1;
+    }
+
+    auto table = std::make_unique<InodeTable>(*mnt().inodeTable);
+    for (std::size_t i = ROOT_INODE; i < inodeCount(); ++i) {
+        Inode& ino = (*table)[i];
+        if (ino.free) continue;
+        if (ino.type == INODE_DIR) ino.direct[0] = btreeCopy(ino.direct[0]);
+        else shareFileBlocks(ino);
+    }
+
+    SnapshotHeader h;
+    std::strncpy(h.name.data(), name, MAX_FILE_NAME_LEN);
+    h.created     = static_cast<std::int64_t>(std::time(nullptr));
+    h.inodeBlocks = tableBlocks;
+    writeRegion(start, &h, sizeof(h));
+    diskWrite(start + 1, static_cast<int>(tableBlocks), table->blocks.data());
+    writeRegion(REFCOUNT_BLOCK, &mnt().refs, sizeof(mnt().refs));
+    persistBitmap();
+    *slot = start;
+    writeRegion(0, &mnt().super, sizeof(mnt().super));
+    return mnt().cache.sync();   // snapshot mounts read the image directly
+}
+
+inline int snapshotDelete(const char* name)
+{
+    if (!writable()) return -1;
+    const int slot = name ? snapshotSlotOf(name) : -1;
+    if (slot < 0) {
+        std::cerr << "[SFS] No such snapshot.\n";
+        return -1;
+    }
+    if (mnt().snapshotPins[slot] > 0) {
+        std::cerr << "[SFS] Snapshot " << name << " is mounted.\n";
+        return -1;
+    }
+    const int start = mnt().super.snapshots[slot];
+    SnapshotHeader h;
+    readRegion(start, &h, sizeof(h));
+    const std::uint32_t tableBlocks = std::min(h.inodeBlocks, MAX_INODE_BLOCKS);
+    auto table = std::make_unique<InodeTable>();
+    diskRead(start + 1, static_cast<int>(tableBlocks), table->blocks.data());
+    for (std::size_t i = ROOT_INODE; i < tableBlocks * INODES_PER_BLOCK; ++i) {
+        const Inode& ino = (*table)[i];
+        if (ino.free) continue;
+        if (ino.type == INODE_DIR) {
+            btreeFree(ino.direct[0]);
+            continue;
+        }
+        for (std::int32_t p : ino.direct) releaseBlock(physOf(p));
+        if (ino.indirect >= 0) {
+            IndirectBlock ib;
+            diskRead(ino.indirect, 1, &ib);
+            for (std::int32_t p : ib.pointers) releaseBlock(physOf(p));
+            releaseBlock(ino.indirect);
+        }
+    }
+    for (std::uint32_t i = 0; i < 1 + tableBlocks; ++i) releaseBlock(start + static_cast<int>(i));
+    mnt().super.snapshots[slot] = 0;
+    writeRegion(0, &mnt().super, sizeof(mnt().super));   // unreferenced before the blocks are freed
+    persistBitmap();
+    return 0;
+}
+
+/// Cursor‑style listing in slot order, like sfs_readdir.
+inline int snapshotNext(char* name)
+{
+    if (!name) return -1;
+    std::size_t i = 0;
+    if (*name) {
+        const int cur = snapshotSlotOf(name);
+        if (cur < 0) return -1;
+        i = static_cast<std::size_t>(cur) + 1;
+    }
+    for (; i < MAX_SNAPSHOTS; ++i) {
+        if (!mnt().super.snapshots[i]) continue;
+        SnapshotHeader h;
+        readRegion(mnt().super.snapshots[i], &h, sizeof(h));
+        std::strcpy(name, h.name.data());
+        return 0;
+    }
+    return -1;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Consistency check (sfs_fsck).  A scan runs in three stages, each spread
+//  over a small pool of threads:
+//    1. the inode tables (live and snapshots) are split into ranges; every
+//       thread checks the fields of its inodes and collects their indirect
+//       blocks and B+tree roots;
+//    2. B+tree nodes are read one tree level at a time;
+//    3. direct pointers and indirect blocks are checked against the now
+//       complete map of meta‑data blocks, and data blocks are counted.
+//  Pointer blocks are sorted by address and each thread reads its share in
+//  long sequential requests straight from the image (the cache is written
+//  back first).  Threads only record what they find; repairs are applied
+//  serially and the scan repeats until nothing structural is left.  The
+//  bitmap, reference counts and fingerprints are then checked against the
+//  final scan.
+//─────────────────────────────────────────────────────────────────────────────
+
+constexpr std::int32_t FSCK_SLOT_INDIRECT = 12;   ///< FsckRef::slot of Inode::indirect
+constexpr std::int32_t FSCK_SLOT_TREE     = -1;   ///< FsckRef::slot of a B+tree node
+
+/// One owner of a block: table (0 live, 1 + n the n‑th snapshot), inode and
+/// slot (0‑11 direct, FSCK_SLOT_INDIRECT, FSCK_SLOT_INDIRECT + 1 + i for
+/// entry i of the indirect block, or FSCK_SLOT_TREE).
+struct FsckRef {
+    std::int32_t table = 0;
+    std::int32_t inode = 0;
+    std::int32_t slot  = 0;
+    bool operator<(const FsckRef& o) const  { return std::tie(table, inode, slot) < std::tie(o.table, o.inode, o.slot); }
+    bool operator==(const FsckRef& o) const { return table == o.table && inode == o.inode && slot == o.slot; }
+};
+
+/// A pointer block to read: an indirect block or a B+tree node.
+struct FsckBlock {
+    std::int32_t block = -1;
+    FsckRef      owner;
+    std::int32_t depth = 0;                      ///< Tree level (nodes only)
+};
+
+/// A name found in a subdirectory B+tree (owner = table and directory).
+struct FsckEntry {
+    FsckRef      owner;
+    std::int32_t inode = -1;
+    BTreeKey     name {};
+};
+
+/// An inode table under check: the live one or a copy of a snapshot's.
+struct FsckTable {
+    InodeTable*                 inodes = nullptr;
+    int                         start  = -1;   ///< Snapshot area, −1 if live
+    int                         span   = 0;    ///< Blocks of the snapshot area
+    std::unique_ptr<InodeTable> ownInodes;
+    bool                        dirty  = false;
+};
+
+/// What a scan (or one scanner thread) found.
+struct FsckScan {
+    std::vector<std::uint32_t> data;        ///< Data‑block pointers per block
+    std::vector<std::uint8_t>  meta;        ///< 1 if the block holds meta‑data
+    std::vector<FsckBlock>     blocks;      ///< Pointer blocks still to read
+    std::vector<FsckRef>       badPtrs;     ///< Pointers to clear
+    std::vector<FsckRef>       badInodes;   ///< Inodes with fields out of range
+    std::vector<FsckRef>       damaged;     ///< Directories whose tree must be rebuilt
+    std::vector<FsckEntry>     entries;     ///< Names in subdirectories
+    int                        inodes  = 0; ///< Allocated inodes seen
+    int                        dups    = 0; ///< Meta‑data blocks claimed twice
+    bool                       ioError = false;
+};
+
+inline bool fsckInRange(std::int32_t blk) { return blk >= static_cast<std::int32_t>(DATA_BLOCK) && blk < static_cast<std::int32_t>(TOTAL_BLOCKS); }
+
+/// NUL‑terminated, non‑empty and short enough for a directory entry.
+inline bool fsckNameOk(const char* name)
+{
+    const void* nul = std::memchr(name, 0, MAX_FILE_NAME_LEN + 1);
+    return nul && nul != name;
+}
+
+/// True if a file inode's size is one SFS could have produced.
+inline bool fsckSizeOk(const Inode& ino)
+{
+    return ino.type != INODE_FILE || (ino.size >= 0 && ino.size <= static_cast<std::int32_t>(MAX_FILE_BLOCKS * BLOCK_SIZE));
+}
+
+/// Splits [0, items) into up to FSCK_MAX_THREADS shares of at least
+/// FSCK_GRAIN items and runs fn(part, begin, end) for each, the first on
+/// the calling thread.  Returns the number of threads used.
+template <class Fn>
+unsigned fsckParallel(std::size_t items, std::vector<FsckScan>& parts, Fn fn)
+{
+    const std::size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t n  = std::clamp<std::size_t>((items + FSCK_GRAIN - 1) / FSCK_GRAIN, 1,
+                                                   std::min<std::size_t>(hw, FSCK_MAX_THREADS));
+    parts.assign(n, FsckScan{});
+    std::vector<std::thread> pool;
+    for (std::size_t w = 1; w < n; ++w)
+        pool.emplace_back(fn, std::ref(parts[w]), items * w / n, items * (w + 1) / n);
+    fn(parts[0], std::size_t{0}, items / n);
+    for (auto& t : pool) t.join();
+    return static_cast<unsigned>(n);
+}
+
+/// Reads the pointer blocks jobs[begin, end) (sorted by address) in runs of
+/// up to FSCK_READ_RUN blocks, bridging gaps of up to FSCK_READ_GAP, and
+/// calls fn(job, block) for each.
+template <class Fn>
+void fsckStream(disk* dev, const std::vector<FsckBlock>& jobs, std::size_t begin, std::size_t end,
+                FsckScan& part, Fn fn)
+{
+    std::vector<char> buf(std::size_t(FSCK_READ_RUN) * BLOCK_SIZE);
+    for (std::size_t i = begin; i < end; ) {
+        const int first = jobs[i].block;
+        std::size_t j = i + 1;
+        while (j < end && jobs[j].block - jobs[j - 1].block <= FSCK_READ_GAP + 1 && jobs[j].block - first < FSCK_READ_RUN) ++j;
+        const int len = jobs[j - 1].block - first + 1;
+        if (disk_read_blocks(dev, first, len, buf.data()) != len) {
+            part.ioError = true;
+            return;
+        }
+        for (; i < j; ++i) fn(jobs[i], buf.data() + std::size_t(jobs[i].block - first) * BLOCK_SIZE);
+    }
+}
+
+/// Stage 1 for inodes [begin, end) of the concatenated tables.
+inline void fsckInodes(const std::vector<FsckTable>& tables, FsckScan& part, std::size_t begin, std::size_t end)
+{
+    for (std::size_t k = begin; k < end; ++k) {
+        const FsckRef ref {static_cast<std::int32_t>(k / MAX_INODES), static_cast<std::int32_t>(k % MAX_INODES), 0};
+        const Inode& ino = (*tables[ref.table].inodes)[ref.inode];
+        if (ino.free == 1) continue;
+        ++part.inodes;
+        if (ino.free != 0 || (ino.type != INODE_FILE && ino.type != INODE_DIR) || !fsckSizeOk(ino))
+            part.badInodes.push_back(ref);
+        if (ino.type == INODE_DIR) {
+            if (ino.direct[0] >= 0 && fsckInRange(ino.direct[0]))
+                part.blocks.push_back({ino.direct[0], {ref.table, ref.inode, FSCK_SLOT_TREE}, 0});
+            else if (ino.direct[0] != -1)
+                part.badPtrs.push_back(ref);
+            continue;
+        }
+        if (ino.indirect >= 0 && fsckInRange(ino.indirect))
+            part.blocks.push_back({ino.indirect, {ref.table, ref.inode, FSCK_SLOT_INDIRECT}, 0});
+        else if (ino.indirect != -1)
+            part.badPtrs.push_back({ref.table, ref.inode, FSCK_SLOT_INDIRECT});
+    }
+}
+
+/// Stage 2 for one B+tree node: collects names and the next level.
+inline void fsckNode(const FsckBlock& job, const char* raw, FsckScan& part)
+{
+    BTreeNode n;
+    std::memcpy(&n, raw, sizeof(n));
+    const FsckRef dir {job.owner.table, job.owner.inode, 0};
+    if (n.leaf > 1 || n.count > BTREE_ORDER || job.depth >= FSCK_MAX_DEPTH) {
+        part.damaged.push_back(dir);
+        return;
+    }
+    if (!n.leaf) {
+        for (int i = 0; i <= n.count; ++i) {
+            if (fsckInRange(n.vals[i])) part.blocks.push_back({n.vals[i], job.owner, job.depth + 1});
+            else part.damaged.push_back(dir);
+        }
+        return;
+    }
+    for (int i = 0; i < n.count; ++i) {
+        if (!fsckNameOk(n.keys[i].data()) || (i && std::strcmp(n.keys[i - 1].data(), n.keys[i].data()) >= 0)) {
+            part.damaged.push_back(dir);   // unreadable or out of order – lookups would miss it
+            continue;
+        }
+        part.entries.push_back({dir, n.vals[i], n.keys[i]});
+    }
+}
+
+/// Checks one data‑block pointer against the meta‑data map and counts it.
+inline void fsckData(std::int32_t p, const FsckRef& ref, const std::vector<std::uint8_t>& meta, FsckScan& part)
+{
+    if (p == -1) return;
+    const std::int32_t blk = physOf(p);
+    if (!fsckInRange(blk) || meta[blk]) part.badPtrs.push_back(ref);
+    else ++part.data[blk];
+}
+
+/// Claims *job* as meta‑data unless another owner already did.
+inline bool fsckClaim(const FsckBlock& job, FsckScan& scan)
+{
+    if (!scan.meta[job.block]) {
+        scan.meta[job.block] = 1;
+        return true;
+    }
+    ++scan.dups;
+    if (job.owner.slot == FSCK_SLOT_TREE) scan.damaged.push_back({job.owner.table, job.owner.inode, 0});
+    else scan.badPtrs.push_back(job.owner);
+    return false;
+}
+
+inline void fsckMerge(FsckScan& into, std::vector<FsckScan>& parts, std::vector<FsckBlock>& next)
+{
+    next.clear();
+    for (FsckScan& p : parts) {
+        next.insert(next.end(), p.blocks.begin(), p.blocks.end());
+        into.badPtrs.insert(into.badPtrs.end(), p.badPtrs.begin(), p.badPtrs.end());
+        into.badInodes.insert(into.badInodes.end(), p.badInodes.begin(), p.badInodes.end());
+        into.damaged.insert(into.damaged.end(), p.damaged.begin(), p.damaged.end());
+        into.entries.insert(into.entries.end(), p.entries.begin(), p.entries.end());
+        into.inodes  += p.inodes;
+        into.ioError |= p.ioError;
+        if (!p.data.empty())
+            for (std::size_t b = 0; b < TOTAL_BLOCKS; ++b) into.data[b] += p.data[b];
+    }
+    std::sort(next.begin(), next.end(), [](const FsckBlock& a, const FsckBlock& b) {
+        return std::tie(a.block, a.owner) < std::tie(b.block, b.owner);
+    });
+}
+
+/// One full scan of *tables*.  Returns the number of threads used.
+inline unsigned fsckScan(const std::vector<FsckTable>& tables, FsckScan& scan)
+{
+    disk* const dev = mnt().dev;
+    scan = {};
+    scan.data.assign(TOTAL_BLOCKS, 0);
+    scan.meta.assign(TOTAL_BLOCKS, 0);
+    std::fill_n(scan.meta.begin(), DATA_BLOCK, 1);
+    const SuperBlock& sb = mnt().super;
+    for (std::uint32_t k = INODE_TABLE_BLOCKS; k < std::min<std::uint32_t>(sb.inodeTableBlocks, MAX_INODE_BLOCKS); ++k)
+        if (fsckInRange(sb.inodeBlocks[k])) scan.meta[sb.inodeBlocks[k]] = 1;
+    for (const FsckTable& t : tables)
+        if (t.start >= 0) std::fill_n(scan.meta.begin() + t.start, t.span, 1);
+
+    std::vector<FsckScan>  parts;
+    std::vector<FsckBlock> level;
+    unsigned threads = fsckParallel(tables.size() * MAX_INODES, parts,
+        [&](FsckScan& part, std::size_t b, std::size_t e) { fsckInodes(tables, part, b, e); });
+    fsckMerge(scan, parts, level);
+
+    // Indirect blocks are claimed before any tree node, so a node that
+    // collides with one is the one that goes.
+    std::vector<FsckBlock> indirects;
+    for (const FsckBlock& job : level)
+        if (job.owner.slot == FSCK_SLOT_INDIRECT && fsckClaim(job, scan)) indirects.push_back(job);
+    level.erase(std::remove_if(level.begin(), level.end(),
+                               [](const FsckBlock& j) { return j.owner.slot != FSCK_SLOT_TREE; }), level.end());
+
+    while (!level.empty()) {
+        std::vector<FsckBlock> nodes;
+        for (const FsckBlock& job : level)
+            if (fsckClaim(job, scan)) nodes.push_back(job);
+        threads = std::max(threads, fsckParallel(nodes.size(), parts,
+            [&](FsckScan& part, std::size_t b, std::size_t e) {
+                fsckStream(dev, nodes, b, e, part, [&](const FsckBlock& job, const char* raw) { fsckNode(job, raw, part); });
+            }));
+        fsckMerge(scan, parts, level);
+    }
+
+    // Stage 3: direct pointers by inode range, then the indirect blocks.
+    const std::size_t inodeItems = tables.size() * MAX_INODES;
+    threads = std::max(threads, fsckParallel(inodeItems + indirects.size(), parts,
+        [&](FsckScan& part, std::size_t b, std::size_t e) {
+            part.data.assign(TOTAL_BLOCKS, 0);
+            for (std::size_t k = b; k < std::min(e, inodeItems); ++k) {
+                const FsckRef ref {static_cast<std::int32_t>(k / MAX_INODES), static_cast<std::int32_t>(k % MAX_INODES), 0};
+                const Inode& ino = (*tables[ref.table].inodes)[ref.inode];
+                if (ino.free == 1) continue;
+                for (std::int32_t s = ino.type == INODE_DIR ? 1 : 0; s < 12; ++s) {
+                    if (ino.type == INODE_DIR && ino.direct[s] != -1) part.badPtrs.push_back({ref.table, ref.inode, s});
+                    else if (ino.type != INODE_DIR) fsckData(ino.direct[s], {ref.table, ref.inode, s}, scan.meta, part);
+                }
+                if (ino.type == INODE_DIR && ino.indirect != -1) part.badPtrs.push_back({ref.table, ref.inode, FSCK_SLOT_INDIRECT});
+            }
+            if (e > inodeItems)
+                fsckStream(dev, indirects, std::max(b, inodeItems) - inodeItems, e - inodeItems, part,
+                           [&](const FsckBlock& job, const char* raw) {
+                               IndirectBlock ib;
+                               std::memcpy(&ib, raw, sizeof(ib));
+                               for (std::int32_t i = 0; i < static_cast<std::int32_t>(ib.pointers.size()); ++i)
+                                   fsckData(ib.pointers[i], {job.owner.table, job.owner.inode, FSCK_SLOT_INDIRECT + 1 + i},
+                                            scan.meta, part);
+                           });
+        }));
+    fsckMerge(scan, parts, level);
+
+    auto unique = [](std::vector<FsckRef>& v) {
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    };
+    unique(scan.badPtrs);
+    unique(scan.badInodes);
+    unique(scan.damaged);
+    return threads;
+}
+
+/// Counts a problem and, when *fix* is set, a repair.
+inline void fsckNote(sfs_fsck_report& r, int& field, bool fix)
+{
+    ++field;
+    ++r.problems;
+    if (fix) ++r.repaired;
+}
+
+/// Super‑block and snapshot slots; loads the snapshot tables into *tables*.
+/// False if this is no SFS image at all.
+inline bool fsckSuper(std::vector<FsckTable>& tables, bool repair, sfs_fsck_report& r)
+{
+    SuperBlock& sb = mnt().super;
+    if (sb.magic != MAGIC_NUMBER || sb.blockSize != BLOCK_SIZE || sb.fsSize != TOTAL_BLOCKS) {
+        fsckNote(r, r.bad_super, false);
+        std::cerr << "[SFS] Not an SFS image (bad super‑block).\n";
+        return false;
+    }
+    if (sb.rootInode != ROOT_INODE) {
+        fsckNote(r, r.bad_super, repair);
+        if (repair) sb.rootInode = ROOT_INODE;
+    }
+
+    // The inode table: blocks 1‑19, then distinct blocks of the data area.
+    // A bad entry past the fixed part cuts the table short there; the
+    // inodes it held turn up as lost names, their blocks as leaks.
+    std::vector<std::uint8_t> taken(TOTAL_BLOCKS, 0);
+    const std::uint32_t count = std::clamp<std::uint32_t>(sb.inodeTableBlocks, INODE_TABLE_BLOCKS, MAX_INODE_BLOCKS);
+    if (count != sb.inodeTableBlocks) {
+        fsckNote(r, r.bad_super, repair);
+        if (repair) sb.inodeTableBlocks = count;
+    }
+    for (std::uint32_t k = 0; k < MAX_INODE_BLOCKS; ++k) {
+        std::int32_t& blk = sb.inodeBlocks[k];
+        if (k < INODE_TABLE_BLOCKS) {
+            if (blk == static_cast<std::int32_t>(1 + k)) continue;
+            fsckNote(r, r.bad_super, repair);
+            if (repair) blk = static_cast<std::int32_t>(1 + k);
+        } else if (k < sb.inodeTableBlocks && fsckInRange(blk) && !taken[blk]) {
+            taken[blk] = 1;
+        } else if (k < sb.inodeTableBlocks) {
+            fsckNote(r, r.bad_super, repair);
+            if (!repair) continue;
+            for (std::size_t i = k * INODES_PER_BLOCK; i < MAX_INODES; ++i) (*mnt().inodeTable)[i] = {};
+            std::fill(sb.inodeBlocks.begin() + k, sb.inodeBlocks.end(), 0);
+            sb.inodeTableBlocks = k;
+            break;
+        } else if (blk) {
+            fsckNote(r, r.bad_super, repair);
+            if (repair) blk = 0;
+        }
+    }
+
+    tables.resize(1);
+    tables[0].inodes = mnt().inodeTable;
+    for (std::int32_t& start : sb.snapshots) {
+        if (!start) continue;
+        SnapshotHeader h;
+        bool ok = fsckInRange(start);
+        if (ok) readRegion(start, &h, sizeof(h));
+        const int span = 1 + static_cast<int>(h.inodeBlocks);
+        ok = ok && h.magic == SNAPSHOT_MAGIC && fsckNameOk(h.name.data()) &&
+             h.inodeBlocks >= INODE_TABLE_BLOCKS && h.inodeBlocks <= MAX_INODE_BLOCKS &&
+             start + span <= static_cast<int>(TOTAL_BLOCKS) &&
+             std::none_of(taken.begin() + start, taken.begin() + start + span, [](std::uint8_t t) { return t; });
+        if (!ok) {
+            fsckNote(r, r.bad_super, repair);
+            if (repair) start = 0;   // its blocks turn up as leaks
+            continue;
+        }
+        std::fill_n(taken.begin() + start, span, 1);
+        FsckTable t;
+        t.start     = start;
+        t.span      = span;
+        t.ownInodes = std::make_unique<InodeTable>();
+        diskRead(start + 1, span - 1, t.ownInodes->blocks.data());
+        t.inodes = t.ownInodes.get();
+        tables.push_back(std::move(t));
+    }
+    return true;
+}
+
+/// Marks every block the scan found in use as allocated, so that repairs
+/// that allocate cannot hand one out again.
+inline void fsckReserve(const FsckScan& scan, sfs_fsck_report& r)
+{
+    bool changed = false;
+    for (std::size_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        if (!(scan.meta[b] || scan.data[b]) || !mnt().bitmap.used[b]) continue;
+        fsckNote(r, r.lost_blocks, true);
+        mnt().bitmap.used[b] = 0;
+        changed = true;
+    }
+    if (changed) rebuildFreeExtents();
+}
+
+/// Applies (or, without *repair*, only counts) the structural fixes of one
+/// scan.  Returns the number of changes made.
+inline int fsckStructure(std::vector<FsckTable>& tables, const FsckScan& scan, bool repair, sfs_fsck_report& r)
+{
+    const int before = r.repaired;
+    r.dup_blocks += scan.dups;
+    if (repair) fsckReserve(scan, r);
+    const int reserved = r.repaired - before;
+
+    // The root is always an allocated directory; its tree is checked below.
+    for (FsckTable& t : tables) {
+        Inode& root = (*t.inodes)[ROOT_INODE];
+        if (root.free == 0 && root.type == INODE_DIR) continue;
+        fsckNote(r, r.bad_inodes, repair);
+        if (repair) root.free = 0, root.type = INODE_DIR, t.dirty = true;
+    }
+
+    for (const FsckRef& ref : scan.badInodes) {
+        fsckNote(r, r.bad_inodes, repair);
+        if (!repair) continue;
+        Inode& ino = (*tables[ref.table].inodes)[ref.inode];
+        ino.free = 0;
+        if (ino.type != INODE_DIR) ino.type = INODE_FILE;
+        if (!fsckSizeOk(ino)) ino.size = 0;   // the data stays reachable up to the next write
+        tables[ref.table].dirty = true;
+    }
+
+    // Bad pointers; entries of an indirect block are grouped per block.
+    for (std::size_t i = 0; i < scan.badPtrs.size(); ) {
+        const FsckRef& ref = scan.badPtrs[i];
+        Inode& ino = (*tables[ref.table].inodes)[ref.inode];
+        if (ref.slot <= FSCK_SLOT_INDIRECT) {
+            fsckNote(r, r.bad_pointers, repair);
+            if (repair) {
+                (ref.slot == FSCK_SLOT_INDIRECT ? ino.indirect : ino.direct[ref.slot]) = -1;
+                tables[ref.table].dirty = true;
+            }
+            ++i;
+            continue;
+        }
+        IndirectBlock ib;
+        if (repair && ino.indirect >= 0) diskRead(ino.indirect, 1, &ib);
+        for (; i < scan.badPtrs.size() && scan.badPtrs[i].table == ref.table && scan.badPtrs[i].inode == ref.inode; ++i) {
+            fsckNote(r, r.bad_pointers, repair);
+            ib.pointers[scan.badPtrs[i].slot - FSCK_SLOT_INDIRECT - 1] = -1;
+        }
+        if (repair && ino.indirect >= 0) diskWrite(ino.indirect, 1, &ib);
+    }
+
+    // Directories: walk from the root, accepting each inode under its first
+    // name only.  Everything else is dropped, and subdirectories that lose
+    // names or have damaged nodes get their B+tree rebuilt.
+    std::map<std::pair<std::int32_t, std::int32_t>, std::vector<const FsckEntry*>> byDir;
+    for (const FsckEntry& e : scan.entries) byDir[{e.owner.table, e.owner.inode}].push_back(&e);
+
+    for (std::size_t ti = 0; ti < tables.size(); ++ti) {
+        FsckTable& t = tables[ti];
+        const auto tIdx = static_cast<std::int32_t>(ti);
+        std::vector<std::uint8_t> named(MAX_INODES, 0);
+        named[ROOT_INODE] = 1;
+        auto accept = [&](const char* name, std::int32_t inode) {
+            if (!fsckNameOk(name) || inode <= ROOT_INODE || inode >= static_cast<std::int32_t>(MAX_INODES) ||
+                (*t.inodes)[inode].free || named[inode]) return false;
+            named[inode] = 1;
+            return true;
+        };
+
+        std::vector<std::int32_t> queue {ROOT_INODE};
+
+        for (std::size_t q = 0; q < queue.size(); ++q) {
+            const std::int32_t dir = queue[q];
+            Inode& d = (*t.inodes)[dir];
+            std::vector<const FsckEntry*> kept;
+            std::set<std::string_view> names;
+            const auto it = byDir.find({tIdx, dir});
+            if (it != byDir.end()) {
+                for (const FsckEntry* e : it->second) {
+                    if (names.count(e->name.data()) || !accept(e->name.data(), e->inode)) {
+                        fsckNote(r, r.bad_entries, repair);
+                        continue;
+                    }
+                    names.insert(e->name.data());
+                    kept.push_back(e);
+                    if ((*t.inodes)[e->inode].type == INODE_DIR) queue.push_back(e->inode);
+                }
+            }
+            const bool damaged = std::binary_search(scan.damaged.begin(), scan.damaged.end(), FsckRef{tIdx, dir, 0});
+            if (damaged) fsckNote(r, r.bad_entries, repair);
+            const bool rebuild = damaged || names.size() != (it == byDir.end() ? 0 : it->second.size());
+            if (!rebuild && d.size != static_cast<std::int32_t>(kept.size())) fsckNote(r, r.bad_inodes, repair);
+            if (!repair || (!rebuild && d.size == static_cast<std::int32_t>(kept.size()))) continue;
+            if (rebuild) {   // the old nodes turn up as leaks
+                std::int32_t root = -1;
+                std::int32_t count = 0;
+                for (const FsckEntry* e : kept)
+                    if (btreeInsert(root, e->name.data(), e->inode) > 0) ++count;
+                    else named[e->inode] = 0;   // no room – reattached as an orphan
+                d.direct[0] = root;
+                d.size      = count;
+            } else {
+                d.size = static_cast<std::int32_t>(kept.size());
+            }
+            t.dirty = true;
+        }
+
+        // Orphans go back into the live root as "#<inode>"; a snapshot's are
+        // dropped, since nothing could name them any more.
+        for (std::int32_t i = ROOT_INODE + 1; i < static_cast<std::int32_t>(MAX_INODES); ++i) {
+            Inode& ino = (*t.inodes)[i];
+            if (ino.free || named[i]) continue;
+            fsckNote(r, r.orphans, repair);
+            if (!repair) continue;
+            char name[MAX_FILE_NAME_LEN + 1];
+            std::snprintf(name, sizeof(name), "#%d", static_cast<int>(i));
+            if (t.start >= 0 || lookupIn(ROOT_INODE, name) >= 0 || !linkEntry(ROOT_INODE, name, i)) ino = {};
+            t.dirty = true;
+        }
+    }
+    return r.repaired - before - reserved;
+}
+
+/// Bitmap, reference counts and fingerprints against the final scan.
+inline void fsckAccounting(const FsckScan& scan, bool repair, sfs_fsck_report& r)
+{
+    for (std::size_t b = 0; b < TOTAL_BLOCKS; ++b) {
+        const bool inUse = scan.meta[b] || scan.data[b];
+        if (inUse) ++r.blocks;
+        if (inUse && mnt().bitmap.used[b]) {
+            fsckNote(r, r.lost_blocks, repair);
+            if (repair) mnt().bitmap.used[b] = 0;
+        } else if (!inUse && !mnt().bitmap.used[b]) {
+            fsckNote(r, r.leaked_blocks, repair);
+            if (repair) mnt().bitmap.used[b] = 1;
+        }
+        // Two files on one block with a count of 1 are repaired by making
+        // the block shared: both keep their data, and the next write to it
+        // through either file copies it.
+        const std::uint32_t want    = std::min<std::uint32_t>(scan.data[b], UINT16_MAX);
+        const bool          badRefs = want ? refsOf(static_cast<int>(b)) != want
+                                           : mnt().refs.refs[b] > (inUse ? 1 : 0);
+        const bool badHash = !want && mnt().fprints.hash[b];
+        if (badRefs || badHash) {
+            fsckNote(r, r.bad_refcounts, repair);
+            if (repair) {
+                mnt().refs.refs[b] = want > 1 ? static_cast<std::uint16_t>(want) : 0;
+                if (badHash) mnt().fprints.hash[b] = 0;
+            }
+        }
+    }
+}
+
+/// Checks the current mount and, with *repair*, fixes what it can.
+/// Returns 0 if the file system is consistent, 1 if every problem found
+/// was repaired, and −1 otherwise.
+inline int fsckRun(bool repair, sfs_fsck_report& r)
+{
+    r = {};
+    if (repair) {
+        if (!writable()) return -1;
+        if (std::any_of(mnt().snapshotPins.begin(), mnt().snapshotPins.end(), [](const auto& p) { return p > 0; }) ||
+            std::any_of(mnt().fdTable->fds.begin(), mnt().fdTable->fds.end(), [](const FdEntry& f) { return !f.free; })) {
+            std::cerr << "[SFS] Close all files and snapshot mounts before repairing.\n";
+            return -1;
+        }
+    }
+    if (mnt().cache.sync() < 0) return -1;   // the scanners read the image directly
+
+    std::vector<FsckTable> tables;
+    if (!fsckSuper(tables, repair, r)) return -1;
+
+    FsckScan scan;
+    r.threads = static_cast<int>(fsckScan(tables, scan));
+    for (int pass = 1; !scan.ioError; ++pass) {
+        const bool fix = repair && pass < FSCK_PASSES;
+        if (!fsckStructure(tables, scan, fix, r) || !fix) break;
+        r.threads  = std::max(r.threads, static_cast<int>(fsckScan(tables, scan)));
+    }
+    if (scan.ioError) {
+        std::cerr << "[SFS] Read error while checking the image.\n";
+        return -1;
+    }
+    r.inodes = scan.inodes;
+    fsckAccounting(scan, repair, r);
+
+    if (repair && r.repaired) {
+        writeRegion(0, &mnt().super, sizeof(mnt().super));
+        for (FsckTable& t : tables) {
+            if (!t.dirty || t.start < 0) continue;
+            diskWrite(t.start + 1, t.span - 1, t.inodes->blocks.data());
+        }
+        persistInodeTable();
+        persistBitmap();
+        writeRegion(REFCOUNT_BLOCK, &mnt().refs, sizeof(mnt().refs));
+        writeRegion(FPRINT_BLOCK, &mnt().fprints, sizeof(mnt().fprints));
+        rebuildDedupIndex();
+        rebuildFreeExtents();
+        mnt().dentryCache.clear();
+        if (mnt().cache.sync() < 0) return -1;
+    }
+    if (!r.problems) return 0;
+    return r.repaired == r.problems ? 1 : -1;
+}
+
+/// Mount‑time check: reports, never repairs.
+inline void fsckOnMount()
+{
+    sfs_fsck_report r;
+    if (fsckRun(false, r) < 0 && r.problems)
+        std::cerr << "[SFS] " << r.problems << " inconsistencies found; run sfs_fsck to repair them.\n";
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Defragmentation.  A fragmented file is copied into one free run of
+//  blocks (data first, then its indirect block) and its pointers are
+//  switched with a single inode‑table write; only then are the old blocks
+//  freed.  The new run is allocated on disk before the copy, so a crash
+//  half‑way leaks blocks (sfs_fsck reclaims them) but never loses data.
+//  With writeback on, the switch is synced before the old blocks are
+//  freed, since a later write could otherwise reuse them on the image
+//  ahead of the switch.
+//  Files with shared blocks stay where they are, since the other owners
+//  point at the same blocks.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Copies the pointer of every file block of *ino* up to its last mapped
+/// one into *ptrs* and returns that count.
+inline int filePointers(const Inode& ino, std::array<std::int32_t, MAX_FILE_BLOCKS>& ptrs)
+{
+    ptrs.fill(-1);
+    std::copy(ino.direct.begin(), ino.direct.end(), ptrs.begin());
+    if (ino.indirect >= 0) {
+        IndirectBlock ib;
+        diskRead(ino.indirect, 1, &ib);
+        std::copy(ib.pointers.begin(), ib.pointers.end(), ptrs.begin() + 12);
+    }
+    int n = MAX_FILE_BLOCKS;
+    while (n > 0 && ptrs[n - 1] == -1) --n;
+    return n;
+}
+
+/// Runs of physically consecutive blocks the mapped blocks are stored in.
+/// Holes cost no I/O, so they do not split a run.
+inline int extentCount(const std::array<std::int32_t, MAX_FILE_BLOCKS>& ptrs, int n)
+{
+    int runs = 0, prev = -2;
+    for (int l = 0; l < n; ++l) {
+        if (ptrs[l] == -1) continue;
+        if (physOf(ptrs[l]) != prev + 1) ++runs;
+        prev = physOf(ptrs[l]);
+    }
+    return runs;
+}
+
+/// Moves file *idx* into one contiguous run.  Returns the blocks moved,
+/// 0 if the file is left alone, −1 on an I/O error.
+inline int defragFile(int idx)
+{
+    Inode& ino = (*mnt().inodeTable)[idx];
+    std::array<std::int32_t, MAX_FILE_BLOCKS> ptrs;
+    const int n = filePointers(ino, ptrs);
+    if (extentCount(ptrs, n) <= 1) return 0;
+
+    int mapped = 0;
+    for (int l = 0; l < n; ++l) {
+        if (ptrs[l] == -1) continue;
+        if (refsOf(physOf(ptrs[l])) > 1) return 0;
+        ++mapped;
+    }
+    const int need  = mapped + (n > 12 ? 1 : 0);
+    const int start = allocateContiguousBlocks(need);
+    if (start < 0) return 0;                     // no free run long enough
+    persistBitmap();                             // old and new run are both allocated on disk
+
+    // Copy the written blocks run by run; unwritten ones only move their
+    // reservation, holes stay holes.
+    std::vector<char> buf(std::size_t(mapped) * BLOCK_SIZE);
+    std::array<std::int32_t, MAX_FILE_BLOCKS> moved = ptrs;
+    bool ok = true;
+    for (int l = 0, k = 0; l < n && ok; ) {
+        const std::int32_t p = ptrs[l];
+        if (p == -1) { ++l; continue; }
+        if (isUnwritten(p)) { moved[l++] = markUnwritten(start + k++); continue; }
+        int len = 1;
+        while (l + len < n && ptrs[l + len] == p + len) ++len;
+        ok = diskRead(p, len, buf.data() + std::size_t(k) * BLOCK_SIZE) == len;
+        for (int i = 0; i < len; ++i) moved[l + i] = start + k + i;
+        l += len;
+        k += len;
+    }
+    IndirectBlock ib;
+    std::copy(moved.begin() + 12, moved.end(), ib.pointers.begin());
+    ok = ok && diskWrite(start, mapped, buf.data()) == mapped;
+    ok = ok && (n <= 12 || diskWrite(start + mapped, 1, &ib) == 1);
+    if (!ok) {
+        for (int i = 0; i < need; ++i) releaseBlock(start + i);
+        persistBitmap();
+        return -1;
+    }
+
+    // The switch: one inode‑table write.
+    const std::int32_t oldIndirect = ino.indirect;
+    std::copy(moved.begin(), moved.begin() + 12, ino.direct.begin());
+    ino.indirect = n > 12 ? start + mapped : -1;
+    persistInodeTable();
+    if (mnt().cache.writeback() && mnt().cache.sync() != 0) return -1;   // old blocks stay allocated
+
+    for (int l = 0; l < n; ++l) {
+        if (ptrs[l] == -1) continue;
+        const std::uint64_t hash = mnt().fprints.hash[physOf(ptrs[l])];
+        releaseBlock(physOf(ptrs[l]));
+        if (hash) dedupInsert(physOf(moved[l]), hash);   // the content moved with it
+    }
+    if (oldIndirect >= 0) releaseBlock(oldIndirect);
+    persistBitmap();
+    return need;
+}
+
+/// One defrag batch: visits files round‑robin from the mount's cursor and
+/// relocates fragmented ones until about *maxBlocks* blocks were moved.
+/// Returns the blocks moved; 0 means a whole sweep found nothing to do.
+inline int defragStep(int maxBlocks)
+{
+    if (!writable()) return -1;
+    int moved = 0;
+    const int count = static_cast<int>(inodeCount());
+    for (int seen = 0; seen < count && moved < maxBlocks; ++seen) {
+        const int idx = mnt().defragCursor % count;
+        mnt().defragCursor = (idx + 1) % count;
+        const Inode& ino = (*mnt().inodeTable)[idx];
+        if (idx == ROOT_INODE || ino.free || ino.type != INODE_FILE) continue;
+        const int n = defragFile(idx);
+        if (n < 0) return moved ? moved : -1;
+        if (n) {
+            moved += n;
+            ++mnt().defragFiles;
+            mnt().defragBlocks += n;
+        }
+    }
+    return moved;
+}
+
+/// Background defragmenter: one batch per mount‑lock hold, then a pause
+/// that keeps the copy rate at *rate* blocks per second (0 = unthrottled).
+inline void defragMain(Mount& m, int rate)
+{
+    auto stopping = [&] {
+        std::lock_guard<std::mutex> lk(m.defragMu);
+        return m.defragStop;
+    };
+    for (;;) {
+        int moved;
+        {
+            IoTicket ticket(m.qos, SFS_IO_BACKGROUND, DEFRAG_BATCH_BLOCKS * BLOCK_SIZE, stopping);
+            if (ticket.cancelled()) break;
+            MountScope scope(m);
+            if (stopping()) break;
+            moved = defragStep(DEFRAG_BATCH_BLOCKS);
+        }
+        if (moved <= 0) break;
+        const auto pause = std::chrono::milliseconds(rate > 0 ? moved * 1000LL / rate : DEFRAG_MIN_PAUSE_MS);
+        std::unique_lock<std::mutex> lk(m.defragMu);
+        if (m.defragCv.wait_for(lk, pause, [&] { return m.defragStop; })) break;
+    }
+    m.defragBusy = false;
+}
+
+/// Stops and joins the background defragmenter.  Must not be called with
+/// the mount lock held, since the defragmenter takes it for every batch.
+inline void defragStop(Mount& m)
+{
+    {
+        std::lock_guard<std::mutex> lk(m.defragMu);
+        m.defragStop = true;
+    }
+    m.defragCv.notify_all();
+    m.qos.wake();
+    if (m.defragThread.joinable()) m.defragThread.join();
+}
+
+/// Starts the background defragmenter on the current mount.
+inline int defragStart(int rate)
+{
+    Mount& m = mnt();
+    if (!writable() || rate < 0) return -1;
+    if (m.defragBusy) {
+        std::cerr << "[SFS] The defragmenter is already running.\n";
+        return -1;
+    }
+    if (m.defragThread.joinable()) m.defragThread.join();   // finished on its own
+    m.defragStop = false;
+    m.defragBusy = true;
+    m.defragThread = std::thread(defragMain, std::ref(m), rate);
+    return 0;
+}
+
+inline int fragmentation(sfs_frag_report* out)
+{
+    if (!out) return -1;
+    *out = {};
+    std::array<std::int32_t, MAX_FILE_BLOCKS> ptrs;
+    for (std::size_t i = ROOT_INODE + 1; i < inodeCount(); ++i) {
+        const Inode& ino = (*mnt().inodeTable)[i];
+        if (ino.free || ino.type != INODE_FILE) continue;
+        const int n    = filePointers(ino, ptrs);
+        const int runs = extentCount(ptrs, n);
+        if (!runs) continue;
+        ++out->files;
+        out->extents += runs;
+        out->blocks  += static_cast<int>(std::count_if(ptrs.begin(), ptrs.begin() + n, [](std::int32_t p) { return p != -1; }));
+        if (runs > 1) ++out->fragmented;
+    }
+    out->free_runs    = static_cast<int>(mnt().freeByOffset.size());
+    out->largest_free = mnt().freeBySize.empty() ? 0 : mnt().freeBySize.rbegin()->first;
+    out->running      = mnt().defragBusy;
+    out->moved_files  = mnt().defragFiles;
+    out->moved_blocks = mnt().defragBlocks;
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Log cleaner.  The log only appends into long free runs, so the data area
+//  is cleaned one LOG_SEGMENT_BLOCKS segment at a time: the live blocks of
+//  a segment are appended at the log head and the next checkpoint frees the
+//  whole segment.  Segments are picked by the cost‑benefit policy of
+//  Rosenblum and Ousterhout's LFS – free space gained times the age of the
+//  data, over the cost of reading and rewriting the live part – so cold,
+//  mostly empty segments go first and hot ones are left to empty by
+//  themselves.  Segments holding blocks that are shared or that belong to
+//  no file (directory nodes, snapshot tables) are left alone.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// First block and length of segment *seg*.
+inline std::pair<int, int> logSegmentRange(int seg)
+{
+    const int start = static_cast<int>(DATA_BLOCK) + seg * LOG_SEGMENT_BLOCKS;
+    return {start, std::min(LOG_SEGMENT_BLOCKS, static_cast<int>(TOTAL_BLOCKS) - start)};
+}
+
+/// Blocks of segment *seg* in use.
+inline int logLiveBlocks(int seg)
+{
+    const auto [start, len] = logSegmentRange(seg);
+    int live = 0;
+    for (int b = start; b < start + len; ++b) live += !mnt().bitmap.used[b];
+    return live;
+}
+
+/// Moves the live blocks of segment *seg* to the log head.  Returns the
+/// blocks moved, 0 if the segment has to stay, −1 if the disk filled up
+/// (what was moved so far stays moved).  Must run right after a checkpoint.
+inline int logCleanSegment(int seg)
+{
+    Mount& m = mnt();
+    const auto [start, len] = logSegmentRange(seg);
+    auto inSeg = [&, start = start, len = len](int blk) { return blk >= start && blk < start + len; };
+
+    // Every live block must be owned by exactly one file.
+    std::array<std::int32_t, MAX_FILE_BLOCKS> ptrs;
+    int owned = 0;
+    for (std::size_t i = ROOT_INODE + 1; i < inodeCount(); ++i) {
+        const Inode& ino = (*m.inodeTable)[i];
+        if (ino.free || ino.type != INODE_FILE) continue;
+        const int n = filePointers(ino, ptrs);
+        for (int l = 0; l < n; ++l) {
+            const int b = physOf(ptrs[l]);
+            if (!inSeg(b)) continue;
+            if (refsOf(b) > 1) return 0;
+            ++owned;
+        }
+        owned += inSeg(ino.indirect);
+    }
+    if (owned != logLiveBlocks(seg)) return 0;
+
+    // Keep the log out of the segment while it is being emptied.
+    std::vector<std::pair<int, int>> holes;
+    auto it = m.freeByOffset.upper_bound(start);
+    if (it != m.freeByOffset.begin()) --it;
+    for (; it != m.freeByOffset.end() && it->first < start + len; ++it) {
+        const int from = std::max(it->first, start), to = std::min(it->first + it->second, start + len);
+        if (from < to) holes.emplace_back(from, to - from);
+    }
+    for (const auto& [from, n] : holes) extentTake(from, n);
+
+    int  moved = 0;
+    bool full  = false;
+    PooledBlock buf;
+    for (std::size_t i = ROOT_INODE + 1; i < inodeCount() && !full; ++i) {
+        Inode& ino = (*m.inodeTable)[i];
+        if (ino.free || ino.type != INODE_FILE) continue;
+        const int n = filePointers(ino, ptrs);
+        bool ibDirty = false;
+        for (int l = 0; l < n; ++l) {
+            const int b = physOf(ptrs[l]);
+            if (!inSeg(b)) continue;
+            const int nb = logAllocate();
+            if (nb < 0) { full = true; break; }
+            if (!isUnwritten(ptrs[l])) {             // a reservation moves without I/O
+                diskRead(b, 1, buf.data());
+                diskWrite(nb, 1, buf.data());
+            }
+            const std::uint64_t hash = m.fprints.hash[b];
+            if (hash) {
+                dedupForget(b);                       // the content moves with the block
+                dedupInsert(nb, hash);
+            }
+            ptrs[l] = isUnwritten(ptrs[l]) ? markUnwritten(nb) : nb;
+            logRelease(b);
+            ibDirty |= l >= 12;
+            ++moved;
+        }
+        std::copy(ptrs.begin(), ptrs.begin() + 12, ino.direct.begin());
+        if (ino.indirect < 0) continue;
+        if (ibDirty || inSeg(ino.indirect)) {
+            int nb = m.logFresh.test(ino.indirect) ? ino.indirect : logAllocate();
+            if (nb < 0) {
+                full = true;
+                nb   = ino.indirect;                  // a full disk leaves it in place
+            }
+            IndirectBlock ib;
+            std::copy(ptrs.begin() + 12, ptrs.end(), ib.pointers.begin());
+            diskWrite(nb, 1, &ib);
+            if (nb != ino.indirect) {
+                moved += inSeg(ino.indirect);
+                logRelease(ino.indirect);
+                ino.indirect = nb;
+            }
+        }
+    }
+
+    for (const auto& [from, n] : holes) extentInsert(from, n);
+    logCheckpoint();
+    return full ? -1 : moved;
+}
+
+/// Cleans the segment with the best cost‑benefit score that can be
+/// cleaned.  Returns the blocks moved, 0 if no segment qualified.
+inline int logCleanStep()
+{
+    Mount& m = mnt();
+    if (!writable() || !(m.super.features & FEATURE_LOG)) return -1;
+    logCheckpoint();                                  // the bitmap shows exactly the live blocks
+
+    const std::uint64_t now = Tracer::now();
+    std::array<std::pair<double, int>, LOG_SEGMENTS> order;
+    int candidates = 0;
+    for (int seg = 0; seg < LOG_SEGMENTS; ++seg) {
+        const int    len  = logSegmentRange(seg).second;
+        const int    live = logLiveBlocks(seg);
+        if (live == 0 || live == len || seg == logSegment(m.logHead)) continue;
+        const double u    = double(live) / len;
+        const double age  = double(now - m.logStamp[seg]) + 1.0;
+        order[candidates++] = {(1.0 - u) * age / (1.0 + u), seg};
+    }
+    std::sort(order.begin(), order.begin() + candidates, std::greater<>());
+    for (int i = 0; i < candidates; ++i) {
+        const int moved = logCleanSegment(order[i].second);
+        if (moved == 0) continue;
+        if (moved > 0) {
+            ++m.logCleaned;
+            m.logMoved += moved;
+        }
+        return moved;
+    }
+    return 0;
+}
+
+/// Segments without a single live block.
+inline int logCleanSegments()
+{
+    int clean = 0;
+    for (int seg = 0; seg < LOG_SEGMENTS; ++seg) clean += logLiveBlocks(seg) == 0;
+    return clean;
+}
+
+/// Background checkpointer and cleaner of a log‑mode mount: wakes every
+/// LOG_CHECKPOINT_MS, checkpoints what writers left pending and cleans one
+/// segment while fewer than LOG_CLEAN_RESERVE segments are free.
+inline void logMain(Mount& m)
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(m.logMu);
+            if (m.logCv.wait_for(lk, std::chrono::milliseconds(LOG_CHECKPOINT_MS), [&] { return m.logStop; })) break;
+        }
+        IoTicket ticket(m.qos, SFS_IO_BACKGROUND, LOG_SEGMENT_BLOCKS * BLOCK_SIZE, [&] {
+            std::lock_guard<std::mutex> lk(m.logMu);
+            return m.logStop;
+        });
+        if (ticket.cancelled()) break;
+        MountScope scope(m);
+        if (m.logDirty) logCheckpoint();
+        if (logCleanSegments() < LOG_CLEAN_RESERVE) logCleanStep();
+    }
+}
+
+/// Stops and joins the log thread.  Must not be called with the mount lock
+/// held, since the thread takes it on every round.
+inline void logStop(Mount& m)
+{
+    {
+        std::lock_guard<std::mutex> lk(m.logMu);
+        m.logStop = true;
+    }
+    m.logCv.notify_all();
+    m.qos.wake();
+    if (m.logThread.joinable()) m.logThread.join();
+}
+
+/// Starts the log thread of a handle mount in log mode.
+inline void logStart(Mount& m)
+{
+    if (m.logThread.joinable() || m.readOnly || !(m.super.features & FEATURE_LOG)) return;
+    m.logStop   = false;
+    m.logThread = std::thread(logMain, std::ref(m));
+}
+
+/// Turns log mode on or off for later writes; turning it off checkpoints.
+inline int setLogMode(bool enable)
+{
+    Mount& m = mnt();
+    if (!writable()) return -1;
+    if (m.logDirty) logCheckpoint();
+    if (enable) m.super.features |=  FEATURE_LOG;
+    else        m.super.features &= ~FEATURE_LOG;
+    writeRegion(0, &m.super, sizeof(m.super));
+    return 0;
+}
+
+inline int logStatus(sfs_log_report* out)
+{
+    if (!out) return -1;
+    Mount& m = mnt();
+    *out = {};
+    out->enabled          = (m.super.features & FEATURE_LOG) != 0;
+    out->head             = m.logHead;
+    out->pending          = static_cast<int>(m.logPending.size());
+    out->segments         = LOG_SEGMENTS;
+    out->clean_segments   = logCleanSegments();
+    out->checkpoints      = m.logCheckpoints;
+    out->cleaned_segments = m.logCleaned;
+    out->cleaned_blocks   = m.logMoved;
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Image inspection (sfs_inspect).  Reads a read‑only mapping of an image
+//  file and never touches a mount, so it works on images nobody has
+//  mounted.  Every pointer is range‑checked: a damaged image gives odd
+//  numbers, not a crash.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// A file as stored in the image.
+struct InspectFile {
+    std::string  path;
+    std::int32_t inode     = 0;
+    std::int32_t size      = 0;
+    int          blocks    = 0;   ///< mapped blocks, reserved ones included
+    int          unwritten = 0;   ///< reserved by sfs_fallocate, never written
+    int          holes     = 0;   ///< unmapped blocks before the last mapped one
+    int          shared    = 0;   ///< blocks with more than one owner
+    int          extents   = 0;   ///< runs of consecutive blocks (see extentCount)
+};
+
+/// A directory and its B+tree.
+struct InspectDir {
+    std::string  path;
+    std::int32_t inode    = 0;
+    int          entries  = 0;
+    int          capacity = 0;    ///< entries the leaves could hold
+    int          nodes    = 0;
+    int          depth    = 0;
+};
+
+struct InspectReport {
+    SuperBlock   super;
+    int          usedBlocks = 0, freeBlocks = 0, freeRuns = 0, largestFree = 0;
+    std::array<int, INSPECT_BUCKETS> runsBySize {}, blocksBySize {};
+    int          usedInodes = 0, files = 0, dirs = 0;
+    std::vector<InspectFile> fileList;
+    std::vector<InspectDir>  dirList;
+    std::vector<SnapshotHeader> snapshots;
+};
+
+/// Walks the mapped image *img*.  The copies keep the on‑disk structures
+/// aligned whatever the mapping.
+class Inspector {
+public:
+    explicit Inspector(const char* img) : img_(img), seen_(MAX_INODES, 0), claimed_(TOTAL_BLOCKS, 0)
+    {
+        copy(0, &r_.super, sizeof(r_.super));
+        const std::uint32_t tableBlocks = std::min<std::uint32_t>(r_.super.inodeTableBlocks, MAX_INODE_BLOCKS);
+        for (std::uint32_t k = 0; k < tableBlocks; ++k)
+            if (inRange(r_.super.inodeBlocks[k])) copy(r_.super.inodeBlocks[k], &inodes_->blocks[k], BLOCK_SIZE);
+        copy(20, bitmap_.used.data(), sizeof(bitmap_.used));
+        copy(REFCOUNT_BLOCK, refs_.refs.data(), sizeof(refs_.refs));
+    }
+
+    InspectReport run()
+    {
+        freeSpace();
+        for (std::size_t i = 0; i < MAX_INODES; ++i) {
+            const Inode& ino = (*inodes_)[i];
+            if (ino.free) continue;
+            ++r_.usedInodes;
+            ++(ino.type == INODE_DIR ? r_.dirs : r_.files);
+        }
+        seen_[ROOT_INODE] = 1;
+        subDir("/", ROOT_INODE);
+        for (std::int32_t start : r_.super.snapshots) {
+            if (start <= 0 || start >= static_cast<std::int32_t>(TOTAL_BLOCKS)) continue;
+            SnapshotHeader h;
+            copy(start, &h, sizeof(h));
+            h.name.back() = '\0';
+            if (h.magic == SNAPSHOT_MAGIC) r_.snapshots.push_back(h);
+        }
+        return std::move(r_);
+    }
+
+private:
+    static bool inRange(std::int32_t b) { return b >= 0 && b < static_cast<std::int32_t>(TOTAL_BLOCKS); }
+
+    void copy(std::int32_t blk, void* dst, std::size_t bytes) const
+    { std::memcpy(dst, img_ + std::size_t(blk) * BLOCK_SIZE, bytes); }
+
+    void freeSpace()
+    {
+        for (std::size_t b = 0; b < TOTAL_BLOCKS; ) {
+            if (!bitmap_.used[b]) { ++r_.usedBlocks; ++b; continue; }
+            std::size_t e = b;
+            while (e < TOTAL_BLOCKS && bitmap_.used[e]) ++e;
+            const int len    = static_cast<int>(e - b);
+            int       bucket = 0;
+            while ((2 << bucket) <= len && bucket + 1 < INSPECT_BUCKETS) ++bucket;
+            ++r_.runsBySize[bucket];
+            r_.blocksBySize[bucket] += len;
+            ++r_.freeRuns;
+            r_.freeBlocks += len;
+            r_.largestFree = std::max(r_.largestFree, len);
+            b = e;
+        }
+    }
+
+    void entry(const std::string& path, std::int32_t ino)
+    {
+        if (ino < 0 || ino >= static_cast<std::int32_t>(MAX_INODES) || (*inodes_)[ino].free || seen_[ino]) return;
+        seen_[ino] = 1;
+        if ((*inodes_)[ino].type == INODE_DIR) subDir(path, ino);
+        else                                file(path, ino);
+    }
+
+    void file(const std::string& path, std::int32_t idx)
+    {
+        const Inode& ino = (*inodes_)[idx];
+        std::array<std::int32_t, MAX_FILE_BLOCKS> ptrs;
+        ptrs.fill(-1);
+        std::copy(ino.direct.begin(), ino.direct.end(), ptrs.begin());
+        if (inRange(ino.indirect)) copy(ino.indirect, ptrs.data() + 12, BLOCK_SIZE);
+        for (std::int32_t& p : ptrs)
+            if (p != -1 && !inRange(physOf(p))) p = -1;   // out of range: not followed
+        int n = MAX_FILE_BLOCKS;
+        while (n > 0 && ptrs[n - 1] == -1) --n;
+
+        InspectFile f;
+        f.path    = path;
+        f.inode   = idx;
+        f.size    = ino.size;
+        f.extents = extentCount(ptrs, n);
+        for (int l = 0; l < n; ++l) {
+            if (ptrs[l] == -1) { ++f.holes; continue; }
+            ++f.blocks;
+            if (isUnwritten(ptrs[l])) ++f.unwritten;
+            if (refs_.refs[physOf(ptrs[l])] > 1) ++f.shared;
+        }
+        r_.fileList.push_back(std::move(f));
+    }
+
+    void subDir(const std::string& path, std::int32_t ino)
+    {
+        InspectDir d;
+        d.path  = path;
+        d.inode = ino;
+        std::vector<std::pair<std::string, std::int32_t>> children;
+        node((*inodes_)[ino].direct[0], 1, d, children);
+        r_.dirList.push_back(d);
+        const std::string prefix = ino == ROOT_INODE ? "" : path;
+        for (const auto& [name, child] : children) entry(prefix + "/" + name, child);
+    }
+
+    void node(std::int32_t blk, int depth, InspectDir& d, std::vector<std::pair<std::string, std::int32_t>>& children)
+    {
+        if (!inRange(blk) || claimed_[blk] || depth > FSCK_MAX_DEPTH) return;
+        claimed_[blk] = 1;
+        BTreeNode n;
+        copy(blk, &n, sizeof(n));
+        const int count = std::min<int>(n.count, BTREE_ORDER);
+        ++d.nodes;
+        d.depth = std::max(d.depth, depth);
+        if (!n.leaf) {
+            for (int i = 0; i <= count; ++i) node(n.vals[i], depth + 1, d, children);
+            return;
+        }
+        d.capacity += static_cast<int>(BTREE_ORDER);
+        d.entries  += count;
+        for (int i = 0; i < count; ++i) {
+            n.keys[i].back() = '\0';
+            children.emplace_back(n.keys[i].data(), n.vals[i]);
+        }
+    }
+
+    const char*                 img_;
+    InspectReport               r_;
+    std::unique_ptr<InodeTable> inodes_ = std::make_unique<InodeTable>();
+    Bitmap                      bitmap_;
+    RefCounts                   refs_;
+    std::vector<std::uint8_t>   seen_, claimed_;
+};
+
+/// Inodes in the table the super‑block lists.
+inline std::size_t inspectInodes(const InspectReport& r)
+{
+    return std::min<std::size_t>(r.super.inodeTableBlocks, MAX_INODE_BLOCKS) * INODES_PER_BLOCK;
+}
+
+/// Writes *s* as a JSON string.
+inline void jsonString(std::FILE* out, const std::string& s)
+{
+    std::fputc('"', out);
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') std::fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f) std::fprintf(out, "\\u%04x", c);
+        else std::fputc(c, out);
+    }
+    std::fputc('"', out);
+}
+
+inline void inspectJson(std::FILE* out, const char* image, const InspectReport& r)
+{
+    std::fprintf(out, "{\n  \"image\": ");
+    jsonString(out, image);
+    std::fprintf(out, ",\n  \"block_size\": %u,\n", r.super.blockSize);
+    std::fprintf(out, "  \"blocks\": {\"total\": %u, \"metadata\": %u, \"used\": %d, \"free\": %d},\n",
+                 TOTAL_BLOCKS, DATA_BLOCK, r.usedBlocks, r.freeBlocks);
+    std::fprintf(out, "  \"free_space\": {\"runs\": %d, \"largest_run\": %d, \"histogram\": [", r.freeRuns, r.largestFree);
+    for (int i = 0; i < INSPECT_BUCKETS; ++i)
+        std::fprintf(out, "%s\n    {\"min\": %d, \"max\": %d, \"runs\": %d, \"blocks\": %d}", i ? "," : "",
+                     1 << i, (2 << i) - 1, r.runsBySize[i], r.blocksBySize[i]);
+    std::fprintf(out, "\n  ]},\n");
+    std::fprintf(out, "  \"inodes\": {\"total\": %zu, \"used\": %d, \"files\": %d, \"directories\": %d, \"unreachable\": %d},\n",
+                 inspectInodes(r), r.usedInodes, r.files, r.dirs,
+                 r.usedInodes - static_cast<int>(r.fileList.size() + r.dirList.size()));
+
+    int fragmented = 0, extents = 0;
+    for (const InspectFile& f : r.fileList) {
+        extents += f.extents;
+        if (f.extents > 1) ++fragmented;
+    }
+    std::fprintf(out, "  \"fragmentation\": {\"files\": %zu, \"fragmented\": %d, \"extents\": %d},\n",
+                 r.fileList.size(), fragmented, extents);
+
+    std::fprintf(out, "  \"directories\": [");
+    for (std::size_t i = 0; i < r.dirList.size(); ++i) {
+        const InspectDir& d = r.dirList[i];
+        std::fprintf(out, "%s\n    {\"path\": ", i ? "," : "");
+        jsonString(out, d.path);
+        std::fprintf(out, ", \"inode\": %d, \"entries\": %d, \"capacity\": %d, \"nodes\": %d, \"depth\": %d}",
+                     d.inode, d.entries, d.capacity, d.nodes, d.depth);
+    }
+    std::fprintf(out, "\n  ],\n  \"files\": [");
+    for (std::size_t i = 0; i < r.fileList.size(); ++i) {
+        const InspectFile& f = r.fileList[i];
+        std::fprintf(out, "%s\n    {\"path\": ", i ? "," : "");
+        jsonString(out, f.path);
+        std::fprintf(out, ", \"inode\": %d, \"size\": %d, \"blocks\": %d, \"extents\": %d, \"fragments\": %d, "
+                          "\"holes\": %d, \"unwritten\": %d, \"shared\": %d}",
+                     f.inode, f.size, f.blocks, f.extents, std::max(f.extents - 1, 0), f.holes, f.unwritten, f.shared);
+    }
+    std::fprintf(out, "\n  ],\n  \"snapshots\": [");
+    for (std::size_t i = 0; i < r.snapshots.size(); ++i) {
+        std::fprintf(out, "%s\n    {\"name\": ", i ? "," : "");
+        jsonString(out, r.snapshots[i].name.data());
+        std::fprintf(out, ", \"created\": %lld}", static_cast<long long>(r.snapshots[i].created));
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+inline void inspectText(std::FILE* out, const char* image, const InspectReport& r)
+{
+    std::fprintf(out, "%s: %u blocks of %u bytes, %u of them metadata\n", image, TOTAL_BLOCKS, r.super.blockSize, DATA_BLOCK);
+    std::fprintf(out, "blocks:  %d used, %d free (%.1f%% used)\n", r.usedBlocks, r.freeBlocks,
+                 100.0 * r.usedBlocks / TOTAL_BLOCKS);
+    std::fprintf(out, "inodes:  %d of %zu used: %d files, %d directories, %d unreachable\n",
+                 r.usedInodes, inspectInodes(r), r.files, r.dirs,
+                 r.usedInodes - static_cast<int>(r.fileList.size() + r.dirList.size()));
+    std::fprintf(out, "free space: %d runs, largest %d blocks\n", r.freeRuns, r.largestFree);
+    for (int i = 0; i < INSPECT_BUCKETS; ++i)
+        if (r.runsBySize[i])
+            std::fprintf(out, "  %5d-%-5d blocks: %4d runs, %5d blocks\n", 1 << i, (2 << i) - 1,
+                         r.runsBySize[i], r.blocksBySize[i]);
+
+    std::fprintf(out, "directories:\n");
+    for (const InspectDir& d : r.dirList)
+        std::fprintf(out, "  %-32s %4d of %4d entries, %3d nodes, depth %d\n",
+                     d.path.c_str(), d.entries, d.capacity, d.nodes, d.depth);
+    std::fprintf(out, "  %-32s %8s %6s %7s %5s %9s %6s\n", "file", "size", "blocks", "extents", "holes", "unwritten", "shared");
+    int fragmented = 0;
+    for (const InspectFile& f : r.fileList) {
+        if (f.extents > 1) ++fragmented;
+        std::fprintf(out, "  %-32s %8d %6d %7d %5d %9d %6d\n", f.path.c_str(), f.size, f.blocks, f.extents,
+                     f.holes, f.unwritten, f.shared);
+    }
+    std::fprintf(out, "%zu files, %d fragmented\n", r.fileList.size(), fragmented);
+    for (const SnapshotHeader& h : r.snapshots)
+        std::fprintf(out, "snapshot %s, created %lld\n", h.name.data(), static_cast<long long>(h.created));
+}
+
+/// Maps *image* read‑only and writes the report.  The mapping is dropped
+/// before returning; nothing in the image is written.
+inline int inspectImage(const char* image, bool json, std::FILE* out)
+{
+    const int fd = ::open(image, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "[SFS] Cannot open image " << image << ".\n";
+        return -1;
+    }
+    struct stat st;
+    constexpr std::size_t bytes = std::size_t(TOTAL_BLOCKS) * BLOCK_SIZE;
+    void* map = (::fstat(fd, &st) == 0 && std::size_t(st.st_size) >= bytes)
+              ? ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        std::cerr << "[SFS] Cannot map image " << image << " (too small?).\n";
+        return -1;
+    }
+    ::madvise(map, bytes, MADV_SEQUENTIAL);
+    const char* img = static_cast<const char*>(map);
+
+    SuperBlock sb;
+    std::memcpy(&sb, img, sizeof(sb));
+    int rc = -1;
+    if (sb.magic != MAGIC_NUMBER || sb.blockSize != BLOCK_SIZE || sb.fsSize != TOTAL_BLOCKS) {
+        std::cerr << "[SFS] " << image << " is not an SFS image (bad super‑block).\n";
+    } else {
+        const InspectReport r = Inspector(img).run();
+        if (json) inspectJson(out, image, r);
+        else      inspectText(out, image, r);
+        rc = std::ferror(out) ? -1 : 0;
+    }
+    ::munmap(map, bytes);
+    return rc;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Tracing of API calls (see Tracer).
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Runs API call *call* and, while the current mount is being traced,
+/// records it with its result and duration.
+template <class Fn>
+inline int traced(TraceOp op, std::int32_t fd, std::int32_t offset, std::int32_t length, Fn&& call,
+                  std::string_view path = {}, std::string_view path2 = {}, std::uint8_t arg = 0)
+{
+    Tracer& t = mnt().trace;
+    if (!t.active()) return call();
+    const std::uint64_t begin = Tracer::now();
+    const int rc = call();
+    t.record(op, fd, offset, length, rc, begin, Tracer::now(), path, path2, arg);
+    return rc;
+}
+
+/// Position of descriptor *fd* before a read or write (−1 if not open).
+inline std::int32_t tracePos(int fd)
+{
+    const auto& fds = mnt().fdTable->fds;
+    return fd >= 0 && static_cast<std::size_t>(fd) < fds.size() && !fds[fd].free ? fds[fd].rwPtr : -1;
+}
+
+inline std::string_view traceName(const char* p) { return p ? std::string_view(p) : std::string_view(); }
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Read views (sfs_read_view).
+//─────────────────────────────────────────────────────────────────────────────
+
+/// What a hole or unwritten block of a view points at.
+alignas(IO_BUFFER_ALIGN) inline constexpr char ZERO_BLOCK[BLOCK_SIZE] {};
+
+/// A released view from the mount's pool, or a new one.
+inline std::unique_ptr<ReadView> takeView()
+{
+    auto& pool = mnt().viewPool;
+    if (pool.empty()) return std::make_unique<ReadView>();
+    std::unique_ptr<ReadView> rv = std::move(pool.back());
+    pool.pop_back();
+    return rv;
+}
+
+} // namespace detail
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Public API implementation – functions must keep their C linkage so that
+//  assignment‑supplied test cases link.  All logic is merely moved into the
+//  *sfs* namespace for clarity.
+//─────────────────────────────────────────────────────────────────────────────
+
+extern "C" {
+
+void mksfs(int fresh)
+{
+    using namespace detail;
+
+    if (mnt().logDirty) logCheckpoint();   // the previous image's last log‑mode writes
+    mnt().cache.sync();   // whatever the previous mksfs left dirty
+    clearRuntimeState();  // (re)initialise in‑memory tables
+
+    if (fresh) {
+        std::remove(DISK_NAME);  // start from a blank image every time
+        init_fresh_disk(const_cast<char*>(DISK_NAME), BLOCK_SIZE, TOTAL_BLOCKS);
+    } else {
+        init_disk(const_cast<char*>(DISK_NAME), BLOCK_SIZE, TOTAL_BLOCKS);
+    }
+    mnt().dev = legacy_disk();
+    mnt().cache.attach(mnt().dev);
+    if (!formatOrLoad(fresh)) {
+        clearRuntimeState();
+        mnt().readOnly = true;   // an empty file system that never writes over the image
+        return;
+    }
+    mnt().readOnly = false;
+    if (!fresh) fsckOnMount();
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  File‑creation & open (returns logical FD)
+//─────────────────────────────────────────────────────────────────────────
+
+static int openFile(const char* filename)
+{
+    using namespace detail;
+
+    PathString path(&mnt().metaPool);
+    int         parent = -1;
+    const char* leaf   = nullptr;
+    if (!locate(filename, path, parent, leaf))
+        return -1;  // component too long or parent missing – reject per original spec
+
+    int inodeIdx = resolvePrefix(path, path.size());
+
+    //────────────────────────────
+    //  Case A – new file.
+    //────────────────────────────
+    if (inodeIdx < 0) {
+        if (!writable()) return -1;
+        const int freeInode = firstFreeInode();
+        const int freeFd    = firstFreeFd();
+        if (freeInode < 0 || freeFd < 0) {
+            std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
+            return -1;
+        }
+
+        // 1.  Directory entry ←→ inode mapping.
+        if (!linkEntry(parent, leaf, freeInode)) {
+            std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
+            return -1;
+        }
+
+        // 2.  Inode initialisation (empty file = size 0).
+        auto& ino             = (*mnt().inodeTable)[freeInode];
+        ino.free              = 0;
+        ino.type              = INODE_FILE;
+        ino.size              = 0;
+        // all block pointers are already −1 from the constructor
+
+        // 3.  FD initialisation (cursor = 0).
+        auto& fd              = mnt().fdTable->fds[freeFd];
+        fd.free               = 0;
+        fd.inode              = freeInode;
+        fd.rwPtr              = 0;
+
+        // 4.  Flush updated tables to disk (minimal durability).
+        persistInodeTable();
+
+        return freeFd;
+    }
+
+    //────────────────────────────
+    //  Case B – file exists.
+    //────────────────────────────
+    if (isDir(inodeIdx))
+        return -1;      // directories are only reachable through sfs_readdir
+
+    int fdIdx = fdOfInode(inodeIdx);
+    if (fdIdx >= 0)
+        return fdIdx;   // already open → return same logical FD
+
+    // Otherwise allocate a new FD entry.
+    fdIdx = firstFreeFd();
+    if (fdIdx < 0) {
+        std::cerr << "[SFS] Per‑process FD table exhausted.\n";
+        return -1;
+    }
+    auto& fd = mnt().fdTable->fds[fdIdx];
+    fd.free  = 0;
+    fd.inode = inodeIdx;
+    fd.rwPtr = (*mnt().inodeTable)[inodeIdx].size;  // append mode like original
+    return fdIdx;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Close FD
+//─────────────────────────────────────────────────────────────────────────
+
+static int closeFile(int fd)
+{
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& e = mnt().fdTable->fds[fd];
+    if (e.free) return -1;   // not open
+    detail::releasePrealloc(e);
+    e = {};                  // default‑construct → marks as free
+    mnt().qos.forget(fd);
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Seek – sets read/write cursor (absolute offset, no bounds checking)
+//─────────────────────────────────────────────────────────────────────────
+
+static int seekFile(int fd, int loc)
+{
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& e = mnt().fdTable->fds[fd];
+    if (e.free || loc < 0) return -1;   // reads and writes index blocks from the position
+    e.rwPtr = loc;
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Write – overwrites and/or extends the file at the FD cursor.  Missing
+//          blocks are placed right after the file's previous block when
+//          possible (see allocateForFile) and whole‑block runs that land
+//          contiguously go out in one write_blocks call.  Blocks shared with
+//          another owner are copied before being modified; with dedup on,
+//          every block goes through the fingerprint index instead.  A
+//          cursor past the end leaves the blocks in between unmapped.
+//─────────────────────────────────────────────────────────────────────────
+
+static int writeFile(int fd, const char* buf, int length)
+{
+    using namespace detail;
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& fde = mnt().fdTable->fds[fd];
+    if (fde.free || !writable()) return -1;
+    if (length <= 0) return 0;
+
+    auto& ino = (*mnt().inodeTable)[fde.inode];
+    if (fde.rwPtr < 0) {
+        std::cerr << "[SFS] Write cursor is before the start of the file.\n";
+        return -1;
+    }
+
+    const int first = fde.rwPtr / static_cast<int>(BLOCK_SIZE);
+    const int last  = (fde.rwPtr + length - 1) / static_cast<int>(BLOCK_SIZE);
+    if (last >= static_cast<int>(MAX_FILE_BLOCKS)) {
+        std::cerr << "[SFS] File would exceed the single‑indirect limit.\n";
+        return -1;
+    }
+    const bool dedup  = mnt().super.features & FEATURE_DEDUP;
+    const bool logged = mnt().super.features & FEATURE_LOG;
+
+    // The indirect block is loaded once per call and written back once.
+    IndirectBlock ib;
+    bool ibDirty = false;
+    if (last >= 12 && ino.indirect >= 0) diskRead(ino.indirect, 1, &ib);
+    auto slotOf = [&](int l) -> std::int32_t& { return l < 12 ? ino.direct[l] : ib.pointers[l - 12]; };
+
+    PooledBlock scratch;
+    bool bitmapDirty = false;
+    int  prevPhys    = (first > 0) ? physOf(slotOf(first - 1)) : -1;
+    int  written     = 0;
+
+    // Pending run of whole blocks bound for consecutive physical blocks.
+    int         runStart = -1, runLen = 0;
+    const char* runSrc   = nullptr;
+    auto flushRun = [&] {
+        if (runLen) diskWrite(runStart, runLen, const_cast<char*>(runSrc));
+        runLen = 0;
+    };
+
+    for (int l = first; l <= last; ++l) {
+        if (l >= 12 && ino.indirect < 0) {      // also when a sparse write skips past block 12
+            const int blk = logged ? logAllocate() : allocateForFile(fde, 1, prevPhys >= 0 ? prevPhys + 1 : -1);
+            if (blk < 0) break;  // ENOSPC
+            ino.indirect = blk;
+            ib           = {};
+            ibDirty      = bitmapDirty = true;
+            prevPhys     = blk;
+        }
+
+        const int   off   = (l == first) ? fde.rwPtr % static_cast<int>(BLOCK_SIZE) : 0;
+        const int   bytes = std::min<int>(BLOCK_SIZE - off, length - written);
+        const bool  whole = (bytes == static_cast<int>(BLOCK_SIZE));
+        const char* src   = buf + written;
+        const bool  fresh = isUnwritten(slotOf(l));         // reserved, reads as zeros
+        const int   old   = physOf(slotOf(l));
+        const int   goal  = prevPhys >= 0 ? prevPhys + 1 : -1;
+        const bool  inPlace = rewritable(old, logged) || (fresh && refsOf(old) == 1);
+        auto allocate = [&] { return logged ? logAllocate() : allocateForFile(fde, last - l + 1, goal); };
+        auto release  = [&](int blk) { if (logged) logRelease(blk); else releaseBlock(blk); };
+
+        // Partial blocks are merged with what the file already holds there.
+        const char* data = src;
+        if (!whole || dedup) {
+            if (!whole) {
+                if (old >= 0 && !fresh && l * static_cast<int>(BLOCK_SIZE) < ino.size) diskRead(old, 1, scratch.data());
+                else scratch.fill(0);
+            }
+            std::memcpy(scratch.data() + off, src, bytes);
+            data = scratch.data();
+        }
+
+        int target = -1;
+        if (dedup) {
+            const std::uint64_t hash = fingerprint(data);
+            target = dedupLookup(data, hash);           // retained on our behalf
+            if (target < 0) {
+                if (inPlace) {
+                    dedupForget(old);                   // rewritten in place
+                    target = old;
+                } else if ((target = allocate()) < 0) {
+                    break;                              // ENOSPC
+                }
+                diskWrite(target, 1, const_cast<char*>(data));
+                dedupInsert(target, hash);
+                if (old >= 0 && old != target) release(old);
+            } else if (old >= 0) {
+                release(old);                           // no‑op overall if target == old
+            }
+            bitmapDirty = true;
+        } else {
+            if (inPlace) {
+                target = old;
+                if (mnt().fprints.hash[old]) dedupForget(old);
+            } else {
+                target = allocate();
+                if (target < 0) break;                  // ENOSPC
+                if (old >= 0) release(old);             // copy‑on‑write of a shared block, or the log
+                bitmapDirty = true;
+            }
+            if (!whole) {
+                flushRun();
+                diskWrite(target, 1, scratch.data());
+            } else if (runLen && runStart + runLen == target) {
+                ++runLen;
+            } else {
+                flushRun();
+                runStart = target;
+                runLen   = 1;
+                runSrc   = src;
+            }
+        }
+
+        if (l >= 12 && slotOf(l) != target) ibDirty = true;
+        slotOf(l) = target;
+        prevPhys  = target;
+        written  += bytes;
+    }
+    flushRun();
+
+    // Update inode + FD, then flush meta‑data to disk.  In log mode a
+    // changed indirect block moves to the log as well, and the tables wait
+    // for the next checkpoint.
+    if (ibDirty && logged && !mnt().logFresh.test(ino.indirect)) {
+        const int blk = logAllocate();
+        if (blk >= 0) {               // a full disk leaves it in place
+            logRelease(ino.indirect);
+            ino.indirect = blk;
+        }
+    }
+    if (ibDirty) diskWrite(ino.indirect, 1, &ib);
+    fde.rwPtr += written;
+    if (fde.rwPtr > ino.size) ino.size = fde.rwPtr;
+    if (logged) {
+        logDefer();
+    } else {
+        persistInodeTable();
+        if (bitmapDirty) persistBitmap();
+    }
+
+    return written > 0 ? written : -1;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Read – naïve version (reads up to *length* or EOF, whichever is smaller).
+//  Holes and fallocated blocks read as zeros without any disk I/O.
+//─────────────────────────────────────────────────────────────────────────
+
+static int readFile(int fd, char* buf, int length)
+{
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& fde = mnt().fdTable->fds[fd];
+    if (fde.free) return -1;
+
+    auto& ino = (*mnt().inodeTable)[fde.inode];
+    if (fde.rwPtr >= ino.size) return 0;               // EOF
+
+    const int readable = std::min(length, ino.size - fde.rwPtr);
+    const int startBlk = fde.rwPtr / static_cast<int>(BLOCK_SIZE);
+    const int offset   = fde.rwPtr % static_cast<int>(BLOCK_SIZE);
+    const int endBlk   = (fde.rwPtr + readable - 1) / static_cast<int>(BLOCK_SIZE);
+
+    // Copy block‑by‑block via a pooled scratch buffer; the indirect block is
+    // loaded at most once.  A streaming reader's blocks enter the cache cold.
+    mnt().coldReads = fde.advice == SFS_FADV_SEQUENTIAL;
+    PooledBlock scratch;
+    PooledBlock indirect;
+    bool        ibLoaded = false;
+    int bytesRead = 0;
+    for (int blkIdx = startBlk; blkIdx <= endBlk; ++blkIdx) {
+        if (blkIdx >= 12 && !ibLoaded) {
+            if (ino.indirect >= 0) diskRead(ino.indirect, 1, indirect.data());
+            else                   *indirect.as<IndirectBlock>() = IndirectBlock();   // all holes
+            ibLoaded = true;
+        }
+        int physBlk = (blkIdx < 12) ? ino.direct[blkIdx]
+                                    : indirect.as<IndirectBlock>()->pointers[blkIdx - 12];
+
+        int blkOffset = (blkIdx == startBlk) ? offset : 0;
+        int blkEnd    = (blkIdx == endBlk) ? (fde.rwPtr + readable) % static_cast<int>(BLOCK_SIZE) : BLOCK_SIZE;
+        if (blkEnd == 0) blkEnd = BLOCK_SIZE;  // exact multiple
+
+        if (physBlk < 0) {                                  // hole or fallocated – no I/O
+            std::memset(buf + bytesRead, 0, blkEnd - blkOffset);
+        } else {
+            diskRead(physBlk, 1, scratch.data());
+            std::memcpy(buf + bytesRead, scratch.data() + blkOffset, blkEnd - blkOffset);
+        }
+        bytesRead += blkEnd - blkOffset;
+    }
+    mnt().coldReads = false;
+
+    detail::readAhead(fde, ino, startBlk, endBlk);
+    fde.rwPtr += bytesRead;
+    return bytesRead;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Zero‑copy read – readFile() without the copy into the caller's buffer.
+//  The view's spans point straight into cache frames, pinned until
+//  sfs_release_view, and at ZERO_BLOCK for holes; adjacent frames merge
+//  into one span.  A block the cache cannot lend (cache off, pin budget
+//  spent) is copied once into a buffer the view owns.  Reads at the
+//  cursor and advances it, like fread.
+//─────────────────────────────────────────────────────────────────────────
+
+static int readView(int fd, int length, sfs_view* view)
+{
+    using namespace detail;
+
+    if (!view) return -1;
+    *view = {};
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size() || length < 0)
+        return -1;
+    auto& fde = mnt().fdTable->fds[fd];
+    if (fde.free || mnt().closing) return -1;
+
+    auto& ino = (*mnt().inodeTable)[fde.inode];
+    if (length == 0 || fde.rwPtr >= ino.size) return 0;   // EOF
+
+    const int readable = std::min(length, ino.size - fde.rwPtr);
+    const int startBlk = fde.rwPtr / static_cast<int>(BLOCK_SIZE);
+    const int offset   = fde.rwPtr % static_cast<int>(BLOCK_SIZE);
+    const int endBlk   = (fde.rwPtr + readable - 1) / static_cast<int>(BLOCK_SIZE);
+
+    // Map the range first, then pin all its blocks under one cache lock.
+    const int blocks = endBlk - startBlk + 1;
+    auto      rv     = takeView();
+    rv->mount = &mnt();
+    std::array<std::int32_t, MAX_FILE_BLOCKS> phys;
+    PooledBlock indirect;
+    for (int blkIdx = startBlk; blkIdx <= endBlk; ++blkIdx) {
+        if (blkIdx == std::max(startBlk, 12)) {
+            if (ino.indirect >= 0) diskRead(ino.indirect, 1, indirect.data());
+            else                   *indirect.as<IndirectBlock>() = IndirectBlock();   // all holes
+        }
+        phys[blkIdx - startBlk] = (blkIdx < 12) ? ino.direct[blkIdx]
+                                                : indirect.as<IndirectBlock>()->pointers[blkIdx - 12];
+    }
+    mnt().coldReads = fde.advice == SFS_FADV_SEQUENTIAL;
+    rv->pins.resize(blocks);
+    const int pinned = mnt().cache.pin(phys.data(), blocks, rv->pins.data(), mnt().coldReads);
+
+    rv->spans.reserve(blocks);
+    int bytesRead = 0;
+    for (int i = 0; i < blocks; ++i) {
+        int blkOffset = (i == 0) ? offset : 0;
+        int blkEnd    = (i == blocks - 1) ? (fde.rwPtr + readable) % static_cast<int>(BLOCK_SIZE) : BLOCK_SIZE;
+        if (blkEnd == 0) blkEnd = BLOCK_SIZE;  // exact multiple
+        const int len = blkEnd - blkOffset;
+
+        const char* data = ZERO_BLOCK + blkOffset;          // hole or fallocated – no I/O
+        if (i < pinned && rv->pins[i]) {
+            data = rv->pins[i] + blkOffset;
+        } else if (phys[i] >= 0) {
+            if (rv->copyBytes < readable) {
+                rv->copy.reset(new char[readable]);
+                rv->copyBytes = readable;
+            }
+            PooledBlock scratch;
+            diskRead(phys[i], 1, scratch.data());
+            std::memcpy(rv->copy.get() + bytesRead, scratch.data() + blkOffset, len);
+            data = rv->copy.get() + bytesRead;
+        }
+        if (!rv->spans.empty() && rv->spans.back().data + rv->spans.back().len == data)
+            rv->spans.back().len += len;
+        else
+            rv->spans.push_back({data, len});
+        bytesRead += len;
+    }
+    mnt().coldReads = false;
+
+    detail::readAhead(fde, ino, startBlk, endBlk);
+    fde.rwPtr += bytesRead;
+    view->spans = rv->spans.data();
+    view->count = static_cast<int>(rv->spans.size());
+    view->bytes = bytesRead;
+    view->priv  = rv.release();
+    ++mnt().readViews;
+    return bytesRead;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Preallocation – reserves every unmapped block of [offset, offset + len)
+//  as one contiguous run (placed after the file's preceding block when
+//  possible) and records the blocks as unwritten in the inode, so reads
+//  return zeros without touching the disk.  Extends the file size like
+//  fallocate(2) without FALLOC_FL_KEEP_SIZE.
+//─────────────────────────────────────────────────────────────────────────
+
+static int allocateFile(int fd, int offset, int len)
+{
+    using namespace detail;
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& fde = mnt().fdTable->fds[fd];
+    if (fde.free || offset < 0 || len <= 0 || !writable()) return -1;
+
+    auto& ino = (*mnt().inodeTable)[fde.inode];
+    const int first = offset / static_cast<int>(BLOCK_SIZE);
+    const int last  = (offset + len - 1) / static_cast<int>(BLOCK_SIZE);
+    if (last >= static_cast<int>(MAX_FILE_BLOCKS)) return -1;  // EFBIG
+
+    IndirectBlock ib;
+    if (last >= 12 && ino.indirect >= 0) diskRead(ino.indirect, 1, &ib);
+    auto slotOf = [&](int l) -> std::int32_t& { return l < 12 ? ino.direct[l] : ib.pointers[l - 12]; };
+
+    int missing = 0;
+    for (int l = first; l <= last; ++l)
+        if (slotOf(l) == -1) ++missing;
+
+    // The FD's append window sits right after the file, so hand it back and
+    // let the run start there.
+    releasePrealloc(fde);
+    const int goal   = (first > 0 && physOf(slotOf(first - 1)) >= 0) ? physOf(slotOf(first - 1)) + 1 : -1;
+    const int needIb = (last >= 12 && ino.indirect < 0) ? 1 : 0;
+    int run = missing ? allocateContiguousBlocks(missing, goal) : 0;
+    if (run < 0) {
+        std::cerr << "[SFS] No contiguous run for fallocate.\n";
+        return -1;  // ENOSPC
+    }
+    if (needIb) {
+        const int blk = allocateContiguousBlocks(1, run + missing);
+        if (blk < 0) {
+            for (int i = 0; i < missing; ++i) releaseBlock(run + i);
+            return -1;
+        }
+        ino.indirect = blk;
+        ib = {};
+    }
+
+    for (int l = first; l <= last; ++l)
+        if (slotOf(l) == -1) slotOf(l) = markUnwritten(run++);
+
+    if (offset + len > ino.size) ino.size = offset + len;
+    if (last >= 12) diskWrite(ino.indirect, 1, &ib);
+    persistInodeTable();
+    persistBitmap();
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Truncate – sets the file size.  Growing only moves the size, so the new
+//  range is a hole.  Shrinking first zeroes the rest of the new last block
+//  through the write path (bytes past the size are always zero, so a later
+//  extension reads zeros there), then frees every block past it in address
+//  order with one indirect‑block, inode‑table and bitmap write in total.
+//─────────────────────────────────────────────────────────────────────────
+
+static int truncateFile(int fd, int size)
+{
+    using namespace detail;
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size())
+        return -1;
+    auto& fde = mnt().fdTable->fds[fd];
+    if (fde.free || size < 0 || !writable()) return -1;
+    if (size > static_cast<int>(MAX_FILE_BLOCKS * BLOCK_SIZE)) {
+        std::cerr << "[SFS] File would exceed the single‑indirect limit.\n";
+        return -1;
+    }
+
+    auto& ino = (*mnt().inodeTable)[fde.inode];
+    if (size >= ino.size) {
+        ino.size = size;
+        persistInodeTable();
+        return 0;
+    }
+
+    const int keep = (size + static_cast<int>(BLOCK_SIZE) - 1) / static_cast<int>(BLOCK_SIZE);
+    IndirectBlock ib;
+    if (ino.indirect >= 0) diskRead(ino.indirect, 1, &ib);
+    auto slotOf = [&](int l) -> std::int32_t& { return l < 12 ? ino.direct[l] : ib.pointers[l - 12]; };
+
+    const int tail = std::min(ino.size, keep * static_cast<int>(BLOCK_SIZE)) - size;
+    if (size % static_cast<int>(BLOCK_SIZE) && slotOf(keep - 1) >= 0 && tail > 0) {
+        PooledBlock zeros;
+        zeros.fill(0);
+        const int pos = fde.rwPtr;
+        fde.rwPtr = size;
+        const int n = writeFile(fd, zeros.data(), tail);
+        fde.rwPtr = pos;
+        if (n != tail) return -1;
+        if (ino.indirect >= 0) diskRead(ino.indirect, 1, &ib);   // the write may have moved blocks
+    }
+
+    // Collect the blocks past the new end, then free them in one sorted pass.
+    const bool logged = mnt().super.features & FEATURE_LOG;
+    std::array<std::int32_t, MAX_FILE_BLOCKS + 1> dead;
+    std::size_t count = 0;
+    const int   end   = ino.indirect >= 0 ? static_cast<int>(MAX_FILE_BLOCKS) : 12;
+    for (int l = keep; l < end; ++l) {
+        if (slotOf(l) == -1) continue;
+        dead[count++] = physOf(slotOf(l));
+        slotOf(l) = -1;
+    }
+    const bool dropIb = ino.indirect >= 0 && keep <= 12;
+    if (dropIb) {
+        dead[count++] = ino.indirect;
+        ino.indirect  = -1;
+    } else if (ino.indirect >= 0 && count) {
+        if (logged && !mnt().logFresh.test(ino.indirect)) {
+            const int blk = logAllocate();
+            if (blk >= 0) {
+                dead[count++] = ino.indirect;
+                ino.indirect  = blk;
+            }
+        }
+        diskWrite(ino.indirect, 1, &ib);
+    }
+    std::sort(dead.begin(), dead.begin() + count);
+
+    releasePrealloc(fde);
+    ino.size = size;
+    if (logged) {
+        // The last checkpoint may still refer to them – free with the next.
+        for (std::size_t i = 0; i < count; ++i) logRelease(dead[i]);
+        mnt().logDirty = true;
+        persistInodeTable();
+    } else {
+        persistInodeTable();
+        for (std::size_t i = 0; i < count; ++i) releaseBlock(dead[i]);
+        persistBitmap();
+    }
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Remove (unlink) – frees direct, indirect and fallocated blocks
+//─────────────────────────────────────────────────────────────────────────
+
+static int removeFile(const char* filename)
+{
+    using namespace detail;
+
+    PathString path(&mnt().metaPool);
+    int         parent = -1;
+    const char* leaf   = nullptr;
+    if (!writable() || !locate(filename, path, parent, leaf)) return -1;
+
+    const int inodeIdx = resolvePrefix(path, path.size());
+    if (inodeIdx < 0) return -1;  // ENOENT
+    if (isDir(inodeIdx)) return -1;  // use sfs_rmdir
+
+    // Reject if file is still open.
+    if (fdOfInode(inodeIdx) >= 0) {
+        std::cerr << "[SFS] Cannot unlink – file still open.\n";
+        return -1;
+    }
+
+    auto& ino = (*mnt().inodeTable)[inodeIdx];
+
+    // Shared blocks only lose a reference; the last owner clears the bit.
+    // Every slot is visited because fallocated blocks may lie past EOF.
+    for (const std::int32_t p : ino.direct)
+        releaseBlock(physOf(p));
+    if (ino.indirect >= 0) {
+        IndirectBlock ib;  diskRead(ino.indirect, 1, &ib);
+        for (const std::int32_t p : ib.pointers)
+            releaseBlock(physOf(p));
+        releaseBlock(ino.indirect);      // free the indirect block itself
+    }
+
+    ino = {}; // reset to default (free = 1)
+
+    // Remove from directory.
+    unlinkEntry(parent, leaf);
+    forgetDentries(path);
+
+    // Persist meta‑data.
+    persistInodeTable();
+    persistBitmap();
+
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Clone (reflink) – a new file that shares every data block of *src*.
+//  Only the inode, the directory entry, an indirect block and the reference
+//  counts are written; the first write to a shared block copies it.
+//─────────────────────────────────────────────────────────────────────────
+
+static int cloneFile(const char* src, const char* dst)
+{
+    using namespace detail;
+
+    PathString srcPath(&mnt().metaPool);
+    PathString dstPath(&mnt().metaPool);
+    int         srcParent = -1, dstParent = -1;
+    const char* srcLeaf   = nullptr;
+    const char* dstLeaf   = nullptr;
+    if (!writable() || !locate(src, srcPath, srcParent, srcLeaf) || !locate(dst, dstPath, dstParent, dstLeaf))
+        return -1;
+
+    const int srcInode = resolvePrefix(srcPath, srcPath.size());
+    if (srcInode < 0 || isDir(srcInode)) return -1;  // ENOENT / EISDIR
+    if (resolvePrefix(dstPath, dstPath.size()) >= 0) {
+        std::cerr << "[SFS] Clone target " << dst << " already exists.\n";
+        return -1;
+    }
+
+    const Inode& from     = (*mnt().inodeTable)[srcInode];
+    const int    freeNode = firstFreeInode();
+    if (freeNode < 0) {
+        std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
+        return -1;
+    }
+    if (!shareable(*mnt().inodeTable, srcInode, srcInode + 1)) {
+        std::cerr << "[SFS] Too many owners of a block of " << src << ".\n";
+        return -1;
+    }
+    if (!linkEntry(dstParent, dstLeaf, freeNode)) {
+        std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
+        return -1;
+    }
+    if (from.indirect >= 0 && freeBlockCount() < 1) {   // the entry may have taken the last block
+        unlinkEntry(dstParent, dstLeaf);
+        persistInodeTable();
+        persistBitmap();
+        std::cerr << "[SFS] Disk full – cannot clone " << src << ".\n";
+        return -1;
+    }
+
+    Inode& ino = (*mnt().inodeTable)[freeNode];
+    ino        = from;
+    shareFileBlocks(ino);
+
+    writeRegion(REFCOUNT_BLOCK, &mnt().refs, sizeof(mnt().refs));
+    persistInodeTable();
+    if (ino.indirect >= 0) persistBitmap();
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Sequential directory listing – returns next filename or −1 when done.
+//─────────────────────────────────────────────────────────────────────────
+
+static int nextFileName(char* out)
+{
+    auto&     cursor = mnt().listCursor;   // last name returned, "" to start
+    const int root   = (*mnt().inodeTable)[ROOT_INODE].direct[0];
+    int       inode  = -1;
+    if (detail::btreeNext(root, cursor.data(), out, inode)) {
+        std::strcpy(cursor.data(), out);
+        return 0;
+    }
+    cursor[0] = '\0';   // rewind for next full listing
+    return -1;          // end of directory
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Convenience wrapper that returns the byte‑size of *filename* or −1.
+//─────────────────────────────────────────────────────────────────────────
+
+static int fileSize(const char* filename)
+{
+    PathString path(&mnt().metaPool);
+    if (!detail::normalizePath(filename, path)) return -1;
+    const int ino = detail::resolvePrefix(path, path.size());
+    return (ino < 0) ? -1 : (*mnt().inodeTable)[ino].size;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Directories – mkdir / rmdir / readdir.  Paths are '/'‑separated and
+//  relative to the root; every component obeys the file‑name length limit.
+//─────────────────────────────────────────────────────────────────────────
+
+static int makeDir(const char* dirname)
+{
+    using namespace detail;
+
+    PathString path(&mnt().metaPool);
+    int         parent = -1;
+    const char* leaf   = nullptr;
+    if (!writable() || !locate(dirname, path, parent, leaf)) return -1;
+    if (resolvePrefix(path, path.size()) >= 0) return -1;   // EEXIST
+
+    const int freeInode = firstFreeInode();
+    if (freeInode < 0) {
+        std::cerr << "[SFS] Out of meta‑data structures (inode/dir/fd).\n";
+        return -1;
+    }
+    if (!linkEntry(parent, leaf, freeInode)) return -1;
+
+    // The B+tree root is allocated lazily by the first insertion.
+    auto& ino = (*mnt().inodeTable)[freeInode];
+    ino.free  = 0;
+    ino.type  = INODE_DIR;
+    ino.size  = 0;
+
+    persistInodeTable();
+    return 0;
+}
+
+static int removeDir(const char* dirname)
+{
+    using namespace detail;
+
+    PathString path(&mnt().metaPool);
+    int         parent = -1;
+    const char* leaf   = nullptr;
+    if (!writable() || !locate(dirname, path, parent, leaf)) return -1;
+
+    const int inodeIdx = resolvePrefix(path, path.size());
+    if (inodeIdx <= ROOT_INODE || !isDir(inodeIdx)) return -1;   // ENOENT / ENOTDIR
+    auto& ino = (*mnt().inodeTable)[inodeIdx];
+    if (ino.size != 0) return -1;                                  // ENOTEMPTY
+
+    ino = {};   // an empty directory has no tree
+    unlinkEntry(parent, leaf);
+    forgetDentries(path);
+
+    persistInodeTable();
+    persistBitmap();
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Ordered listing of one directory.  *name* is the caller‑owned cursor:
+//  pass "" to start, and each call replaces it with the next entry.
+//  Returns 0 while entries remain and −1 at the end.
+//─────────────────────────────────────────────────────────────────────────
+
+static int readDir(const char* dirname, char* name)
+{
+    using namespace detail;
+
+    PathString path(&mnt().metaPool);
+    if (!normalizePath(dirname, path)) return -1;
+    const int dir = resolvePrefix(path, path.size());
+    if (dir < 0 || !isDir(dir)) return -1;
+
+    int inode = -1;
+    return btreeNext((*mnt().inodeTable)[dir].direct[0], name, name, inode) ? 0 : -1;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Batched listing with stat.  Fills up to *max* {name, inode, size}
+//  records per call straight from the directory blocks and the in‑memory
+//  inode table – no per‑entry lookups.  The cursor is owned by the caller
+//  (zero it to start).  Returns the number of records, 0 at the end, −1 on
+//  error.
+//─────────────────────────────────────────────────────────────────────────
+
+static int readDirPlus(const char* dirname, sfs_dir_cursor* cursor, sfs_dirent_plus* out, int max)
+{
+    using namespace detail;
+
+    if (!cursor || !out || max <= 0) return -1;
+    PathString path(&mnt().metaPool);
+    if (!normalizePath(dirname, path)) return -1;
+    const int dir = resolvePrefix(path, path.size());
+    if (dir < 0 || !isDir(dir)) return -1;
+
+    cursor->last[MAX_FILE_NAME_LEN] = '\0';
+    const int filled = btreeCollect((*mnt().inodeTable)[dir].direct[0], cursor->last, out, max, 0);
+    if (filled > 0) std::strcpy(cursor->last, out[filled - 1].name);
+    return filled;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Dedup toggle – applies to subsequent writes.  The flag lives in the
+//  super‑block so it survives a remount; existing blocks keep whatever
+//  fingerprint they were written with.
+//─────────────────────────────────────────────────────────────────────────
+
+static int setDedup(int enable)
+{
+    if (!detail::writable()) return -1;
+    if (enable) mnt().super.features |=  FEATURE_DEDUP;
+    else        mnt().super.features &= ~FEATURE_DEDUP;
+    detail::writeRegion(0, &mnt().super, sizeof(mnt().super));
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Block cache size – a runtime setting, not persisted.  The cache is
+//  write‑through, so resizing only throws away clean copies.
+//─────────────────────────────────────────────────────────────────────────
+
+static int setCacheBlocks(int blocks)
+{
+    if (blocks < 0) {
+        std::cerr << "[SFS] Invalid cache size " << blocks << ".\n";
+        return -1;
+    }
+    if (mnt().cache.sync() != 0) return -1;
+    mnt().cacheBlocks = static_cast<std::uint32_t>(blocks);
+    mnt().cache.resize(mnt().cacheBlocks);
+    return 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Discard – freed blocks are punched out of the mount's image once the
+//  metadata that frees them is written (see flushDiscards).  Background
+//  mode leaves the punching to the disk's worker thread.
+//─────────────────────────────────────────────────────────────────────────
+
+static int setDiscard(int background)
+{
+    if (!detail::writable()) return -1;
+    return disk_enable_discard(mnt().dev, background != 0);
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Writeback – with it on, short block writes land in the cache and a
+//  flusher thread writes them to the image in sorted, coalesced batches.
+//  sfs_sync / sfs_fsync force that out; turning writeback off does too.
+//─────────────────────────────────────────────────────────────────────────
+
+static int setWriteback(int enable)
+{
+    const int rc = mnt().cache.setWriteback(enable != 0);
+    if (rc == 0 && !enable) detail::flushDiscards(true);   // everything is on the image now
+    return rc;
+}
+
+static int syncAll()
+{
+    detail::flushBlockMeta();
+    if (mnt().logDirty) detail::logCheckpoint();
+    if (mnt().cache.sync() != 0) return -1;
+    detail::flushDiscards(true);
+    return disk_checkpoint(mnt().dev) < 0 ? -1 : 0;   // a RAM disk: on to its image file
+}
+
+/// Writes back the file's data and indirect blocks and all the fixed
+/// metadata (super‑block, inode table, root directory, bitmap, block
+/// tables).  Other directories' blocks are not included.
+static int syncFile(int fd)
+{
+    using namespace detail;
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size() || mnt().fdTable->fds[fd].free)
+        return -1;
+    flushBlockMeta();
+    if (mnt().logDirty) logCheckpoint();
+    const Inode& ino = (*mnt().inodeTable)[mnt().fdTable->fds[fd].inode];
+
+    std::array<std::int32_t, MAX_FILE_BLOCKS + 1> blocks;
+    std::size_t count = 0;
+    for (std::int32_t p : ino.direct)
+        if (physOf(p) >= 0) blocks[count++] = physOf(p);
+    if (ino.indirect >= 0) {
+        IndirectBlock ib;
+        diskRead(ino.indirect, 1, &ib);
+        blocks[count++] = ino.indirect;
+        for (std::int32_t p : ib.pointers)
+            if (physOf(p) >= 0) blocks[count++] = physOf(p);
+    }
+    std::sort(blocks.begin(), blocks.begin() + count);
+    if (mnt().cache.sync(blocks.data(), count, static_cast<int>(FPRINT_BLOCK + FPRINT_BLOCKS)) != 0) return -1;
+    return disk_checkpoint(mnt().dev) < 0 ? -1 : 0;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Access‑pattern hints (posix_fadvise) for [offset, offset + len) of an
+//  open file; len 0 means "to the end of the file".
+//    NORMAL / SEQUENTIAL / RANDOM – set the descriptor's read policy:
+//      sequential readers get a long read‑ahead and enter the cache cold,
+//      random ones get no read‑ahead, normal ones a short one once they
+//      read sequentially.
+//    WILLNEED – reads the range into the cache in the background.
+//    DONTNEED – writes back and drops the range's cached blocks.
+//─────────────────────────────────────────────────────────────────────────
+
+static int adviseFile(int fd, int offset, int len, int advice)
+{
+    using namespace detail;
+
+    if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size() || mnt().fdTable->fds[fd].free ||
+        offset < 0 || len < 0)
+        return -1;
+    auto&        fde = mnt().fdTable->fds[fd];
+    const Inode& ino = (*mnt().inodeTable)[fde.inode];
+
+    const int fileBlocks = (ino.size + static_cast<int>(BLOCK_SIZE) - 1) / static_cast<int>(BLOCK_SIZE);
+    const int from       = offset / static_cast<int>(BLOCK_SIZE);
+    const int to         = len == 0 ? fileBlocks
+                                    : std::min<int>(fileBlocks, static_cast<int>((static_cast<long long>(offset) + len + BLOCK_SIZE - 1) / BLOCK_SIZE));
+
+    switch (advice) {
+    case SFS_FADV_NORMAL:
+    case SFS_FADV_SEQUENTIAL:
+    case SFS_FADV_RANDOM:
+        fde.advice = static_cast<std::uint8_t>(advice);
+        fde.raLast = -1;
+        fde.raNext = 0;
+        return 0;
+    case SFS_FADV_WILLNEED:
+        forEachRun(ino, from, to, [&](int start, int n) { mnt().cache.prefetch(start, n, false); });
+        return 0;
+    case SFS_FADV_DONTNEED: {
+        std::array<std::int32_t, MAX_FILE_BLOCKS> blocks;
+        std::size_t count = 0;
+        forEachRun(ino, from, to, [&](int start, int n) {
+            for (int i = 0; i < n; ++i) blocks[count++] = start + i;
+        });
+        std::sort(blocks.begin(), blocks.begin() + count);
+        return mnt().cache.evict(blocks.data(), count);
+    }
+    default:
+        std::cerr << "[SFS] Unknown fadvise advice " << advice << ".\n";
+        return -1;
     }
+}
 
-    ino = {}; // reset to default (free = 1)
+//─────────────────────────────────────────────────────────────────────────
+//  Consistency check (see detail::fsckRun).  Mounting runs the same scan
+//  without repairs and only reports.
+//─────────────────────────────────────────────────────────────────────────
 
-    // Remove from directory.
-    const int dirIdx = dirSlotOf(filename);
-    if (dirIdx >= 0) g_rootDir->entries[dirIdx] = {};
+int sfs_fsck(int repair, sfs_fsck_report* report)
+{
+    sfs_fsck_report local;
+    if (mnt().logDirty) detail::logCheckpoint();   // the check reads the image
+    return detail::fsckRun(repair != 0, report ? *report : local);
+}
 
-    // Persist meta‑data.
-    write_blocks(1, 12, g_inodeTable.get());
-    write_blocks(13, 7, g_rootDir.get());
-    write_blocks(20, 3, &g_bitmap);
+//─────────────────────────────────────────────────────────────────────────
+//  Defragmentation (see detail::defragFile).  sfs_defrag_step runs one
+//  batch in the caller's thread; the background defragmenter needs a
+//  mount handle, since it takes the mount lock between batches.
+//─────────────────────────────────────────────────────────────────────────
 
-    return 0;
+int sfs_file_extents(const char* filename)
+{
+    PathString path(&mnt().metaPool);
+    if (!detail::normalizePath(filename, path)) return -1;
+    const int ino = detail::resolvePrefix(path, path.size());
+    if (ino < 0 || (*mnt().inodeTable)[ino].type != INODE_FILE) return -1;
+    std::array<std::int32_t, MAX_FILE_BLOCKS> ptrs;
+    return detail::extentCount(ptrs, detail::filePointers((*mnt().inodeTable)[ino], ptrs));
 }
 
+int sfs_fragmentation(sfs_frag_report* report)
+{ return detail::fragmentation(report); }
+
 //─────────────────────────────────────────────────────────────────────────
-//  Sequential directory listing – returns next filename or −1 when done.
+//  Log‑structured mode (see detail::logAllocate and detail::logCleanStep).
+//  Without a mount handle there is no background thread: checkpoints come
+//  from the writes themselves and sfs_sync, cleaning from sfs_log_clean.
+//─────────────────────────────────────────────────────────────────────────
+
+int sfs_log_status(sfs_log_report* report)
+{ return detail::logStatus(report); }
+
+static int logClean(int segments)
+{
+    if (segments <= 0) return -1;
+    int moved = 0;
+    for (int i = 0; i < segments; ++i) {
+        const int n = detail::logCleanStep();
+        if (n < 0) return moved ? moved : -1;
+        if (n == 0) break;
+        moved += n;
+    }
+    return moved;
+}
+
+//─────────────────────────────────────────────────────────────────────────
+//  Image inspection (see detail::Inspector).  Takes an image path rather
+//  than a mount, and maps the file instead of mounting it.
+//─────────────────────────────────────────────────────────────────────────
+
+int sfs_inspect(const char* image, int json, FILE* out)
+{
+    if (!image) return -1;
+    return detail::inspectImage(image, json != 0, out ? out : stdout);
+}
+
 //─────────────────────────────────────────────────────────────────────────
+//  Traced entry points.  Each runs the function above it was split from
+//  and, while sfs_trace_start is in effect, records the call.  Replaying
+//  needs the descriptor an open returned and the position a read or write
+//  started at, so those go into the record too.
+//─────────────────────────────────────────────────────────────────────────
+
+int sfs_fopen(const char* filename)
+{ return detail::traced(TRACE_FOPEN, -1, 0, 0, [&] { return openFile(filename); }, detail::traceName(filename)); }
+
+int sfs_fclose(int fd)
+{ return detail::traced(TRACE_FCLOSE, fd, 0, 0, [&] { return closeFile(fd); }); }
+
+int sfs_fseek(int fd, int loc)
+{ return detail::traced(TRACE_FSEEK, fd, loc, 0, [&] { return seekFile(fd, loc); }); }
+
+int sfs_fwrite(int fd, const char* buf, int length)
+{ return detail::traced(TRACE_FWRITE, fd, detail::tracePos(fd), length, [&] { return writeFile(fd, buf, length); }); }
+
+int sfs_fread(int fd, char* buf, int length)
+{ return detail::traced(TRACE_FREAD, fd, detail::tracePos(fd), length, [&] { return readFile(fd, buf, length); }); }
+
+int sfs_fallocate(int fd, int offset, int len)
+{ return detail::traced(TRACE_FALLOCATE, fd, offset, len, [&] { return allocateFile(fd, offset, len); }); }
+
+int sfs_ftruncate(int fd, int size)
+{ return detail::traced(TRACE_FTRUNCATE, fd, size, 0, [&] { return truncateFile(fd, size); }); }
+
+// Traced as a read – it replays as one.
+int sfs_read_view(int fd, int length, sfs_view* view)
+{ return detail::traced(TRACE_FREAD, fd, detail::tracePos(fd), length, [&] { return readView(fd, length, view); }); }
+
+// Takes the lock of the view's mount, which may not be the current one.
+int sfs_release_view(sfs_view* view)
+{
+    if (!view) return -1;
+    if (auto* rv = static_cast<ReadView*>(view->priv)) {
+        MountScope scope(*rv->mount);
+        mnt().cache.unpin(rv->pins.data(), rv->pins.size());
+        rv->spans.clear();
+        rv->pins.clear();
+        --mnt().readViews;
+        mnt().viewPool.emplace_back(rv);
+    }
+    *view = {};
+    return 0;
+}
+
+int sfs_remove(const char* filename)
+{ return detail::traced(TRACE_REMOVE, -1, 0, 0, [&] { return removeFile(filename); }, detail::traceName(filename)); }
+
+int sfs_clone(const char* src, const char* dst)
+{
+    return detail::traced(TRACE_CLONE, -1, 0, 0, [&] { return cloneFile(src, dst); },
+                          detail::traceName(src), detail::traceName(dst));
+}
 
 int sfs_getnextfilename(char* out)
+{ return detail::traced(TRACE_GETNEXTFILENAME, -1, 0, 0, [&] { return nextFileName(out); }); }
+
+int sfs_getfilesize(const char* filename)
+{ return detail::traced(TRACE_GETFILESIZE, -1, 0, 0, [&] { return fileSize(filename); }, detail::traceName(filename)); }
+
+int sfs_mkdir(const char* dirname)
+{ return detail::traced(TRACE_MKDIR, -1, 0, 0, [&] { return makeDir(dirname); }, detail::traceName(dirname)); }
+
+int sfs_rmdir(const char* dirname)
+{ return detail::traced(TRACE_RMDIR, -1, 0, 0, [&] { return removeDir(dirname); }, detail::traceName(dirname)); }
+
+int sfs_readdir(const char* dirname, char* name)
 {
-    for (; g_rootDir->cursor < g_rootDir->entries.size(); ++g_rootDir->cursor) {
-        const auto& e = g_rootDir->entries[g_rootDir->cursor];
-        if (!e.free) {
-            std::strcpy(out, e.filename.data());
-            ++g_rootDir->cursor;
-            return 0;
+    std::array<char, MAX_FILE_NAME_LEN + 1> from {};   // the cursor goes in, the next name comes out
+    if (name) std::strncpy(from.data(), name, MAX_FILE_NAME_LEN);
+    return detail::traced(TRACE_READDIR, -1, 0, 0, [&] { return readDir(dirname, name); },
+                          detail::traceName(dirname), from.data());
+}
+
+int sfs_readdir_plus(const char* dirname, sfs_dir_cursor* cursor, sfs_dirent_plus* out, int max)
+{
+    // The cursor goes in as the position and the name after it.
+    const int slot = cursor ? cursor->slot : 0;
+    std::array<char, MAX_FILE_NAME_LEN + 1> last {};
+    if (cursor) std::memcpy(last.data(), cursor->last, MAX_FILE_NAME_LEN);
+    return detail::traced(TRACE_READDIR_PLUS, -1, slot, cursor && out ? max : 0,
+                          [&] { return readDirPlus(dirname, cursor, out, max); },
+                          detail::traceName(dirname), last.data());
+}
+
+int sfs_sync(void)
+{ return detail::traced(TRACE_SYNC, -1, 0, 0, [&] { return syncAll(); }); }
+
+int sfs_fsync(int fd)
+{ return detail::traced(TRACE_FSYNC, fd, 0, 0, [&] { return syncFile(fd); }); }
+
+int sfs_fadvise(int fd, int offset, int len, int advice)
+{
+    return detail::traced(TRACE_FADVISE, fd, offset, len, [&] { return adviseFile(fd, offset, len, advice); },
+                          {}, {}, static_cast<std::uint8_t>(std::clamp(advice, 0, 255)));
+}
+
+void sfs_set_dedup(int enable)
+{ detail::traced(TRACE_SET_DEDUP, -1, 0, enable, [&] { return setDedup(enable); }); }
+
+int sfs_set_cache_blocks(int blocks)
+{ return detail::traced(TRACE_SET_CACHE_BLOCKS, -1, 0, blocks, [&] { return setCacheBlocks(blocks); }); }
+
+int sfs_set_writeback(int enable)
+{ return detail::traced(TRACE_SET_WRITEBACK, -1, 0, enable, [&] { return setWriteback(enable); }); }
+
+int sfs_set_discard(int background)
+{ return detail::traced(TRACE_SET_DISCARD, -1, 0, background, [&] { return setDiscard(background); }); }
+
+int sfs_set_log_mode(int enable)
+{ return detail::traced(TRACE_SET_LOG_MODE, -1, 0, enable, [&] { return detail::setLogMode(enable != 0); }); }
+
+int sfs_defrag_step(int max_blocks)
+{
+    return detail::traced(TRACE_DEFRAG_STEP, -1, 0, max_blocks,
+                          [&] { return max_blocks > 0 ? detail::defragStep(max_blocks) : -1; });
+}
+
+int sfs_log_clean(int segments)
+{ return detail::traced(TRACE_LOG_CLEAN, -1, 0, segments, [&] { return logClean(segments); }); }
+
+// Snapshots – point‑in‑time, copy‑on‑write (see detail::snapshotCreate).
+// Listing works like sfs_readdir with the snapshot name as the cursor.
+
+int sfs_snapshot_create(const char* name)
+{ return detail::traced(TRACE_SNAPSHOT_CREATE, -1, 0, 0, [&] { return detail::snapshotCreate(name); }, detail::traceName(name)); }
+
+int sfs_snapshot_delete(const char* name)
+{ return detail::traced(TRACE_SNAPSHOT_DELETE, -1, 0, 0, [&] { return detail::snapshotDelete(name); }, detail::traceName(name)); }
+
+int sfs_snapshot_list(char* name)
+{
+    std::array<char, MAX_FILE_NAME_LEN + 1> from {};
+    if (name) std::strncpy(from.data(), name, MAX_FILE_NAME_LEN);
+    return detail::traced(TRACE_SNAPSHOT_LIST, -1, 0, 0, [&] { return detail::snapshotNext(name); }, from.data());
+}
+
+int sfs_trace_start(const char* path)
+{
+    if (!path || !mnt().dev || mnt().origin) return -1;   // a snapshot mount shares its origin's disk
+    TraceHeader h;
+    h.cacheBlocks = mnt().cacheBlocks;
+    h.flags       = (mnt().cache.writeback() ? TRACE_WRITEBACK : 0) |
+                    (mnt().super.features & FEATURE_DEDUP ? TRACE_DEDUP : 0) |
+                    (mnt().super.features & FEATURE_LOG ? TRACE_LOG : 0);
+    if (mnt().trace.start(path, h) != 0) return -1;
+    disk_set_trace(mnt().dev, &Tracer::diskHook, &mnt().trace);
+    return 0;
+}
+
+int sfs_trace_stop(void)
+{
+    if (mnt().dev && !mnt().origin) disk_set_trace(mnt().dev, nullptr, nullptr);
+    return mnt().trace.stop();
+}
+
+} // extern "C"
+
+} // namespace sfs
+
+/// Opaque handle behind the mount‑based C API.
+struct sfs_mount {
+    sfs::Mount mount;
+};
+
+namespace sfs {
+namespace detail {
+
+/// Creates a mount on the disk returned by *openDev* and formats or loads it.
+template <class OpenFn>
+inline sfs_mount* openMount(bool fresh, OpenFn&& openDev)
+{
+    auto* h = new (std::nothrow) sfs_mount;
+    if (!h) return nullptr;
+
+    bool ok;
+    {
+        MountScope scope(h->mount);
+        clearRuntimeState();
+        h->mount.dev = openDev();
+        ok = h->mount.dev != nullptr;
+        h->mount.cache.attach(h->mount.dev);
+        if (ok && !formatOrLoad(fresh)) {
+            h->mount.cache.attach(nullptr);
+            disk_close(h->mount.dev);
+            h->mount.dev = nullptr;
+            ok = false;
+        }
+        if (ok && !fresh) fsckOnMount();
+    }
+    if (!ok) {
+        delete h;
+        return nullptr;
+    }
+    logStart(h->mount);   // an image left in log mode
+    return h;
+}
+
+/// Runs *fn* with *h* locked and installed as the thread's current mount.
+template <class Fn>
+inline int onMount(sfs_mount* h, Fn&& fn)
+{
+    if (!h) return -1;
+    IoTicket   ticket(h->mount.qos, SFS_IO_DEFAULT, 0);
+    MountScope scope(h->mount);
+    return fn();
+}
+
+/// onMount() for a call on descriptor *fd* that moves *bytes*: admitted in
+/// the descriptor's I/O class and charged for the transfer.
+template <class Fn>
+inline int onMountIo(sfs_mount* h, int fd, int bytes, Fn&& fn)
+{
+    if (!h) return -1;
+    IoTicket   ticket(h->mount.qos, h->mount.qos.enabled() ? h->mount.qos.classOf(fd) : SFS_IO_DEFAULT,
+                      std::max(bytes, 0));
+    MountScope scope(h->mount);
+    return fn();
+}
+
+/// Opens snapshot *name* of *live* as a read‑only mount that reads through
+/// live's disk handle.  The snapshot stays pinned until the mount closes.
+inline sfs_mount* openSnapshot(Mount& live, const char* name)
+{
+    int            slot = -1, start = -1;
+    SuperBlock     super;
+    SnapshotHeader header;
+    {
+        MountScope scope(live);
+        if (live.closing) return nullptr;
+        slot = name && live.dev ? snapshotSlotOf(name) : -1;
+        if (slot < 0) {
+            std::cerr << "[SFS] No such snapshot.\n";
+            return nullptr;
+        }
+        start = live.super.snapshots[slot];
+        super = live.super;
+        readRegion(start, &header, sizeof(header));
+        if (header.inodeBlocks < INODE_TABLE_BLOCKS || header.inodeBlocks > MAX_INODE_BLOCKS ||
+            start + 1 + header.inodeBlocks > TOTAL_BLOCKS) {
+            std::cerr << "[SFS] Snapshot header is damaged; run sfs_fsck.\n";
+            return nullptr;
+        }
+        ++live.snapshotPins[slot];
+    }
+
+    auto* h = new (std::nothrow) sfs_mount;
+    if (!h) {
+        --live.snapshotPins[slot];
+        return nullptr;
+    }
+    MountScope scope(h->mount);
+    Mount& m = h->mount;
+    clearRuntimeState();
+    m.dev        = live.dev;
+    m.readOnly   = true;
+    m.origin     = &live;
+    m.originSlot = slot;
+    m.super      = super;
+    m.super.inodeTableBlocks = header.inodeBlocks;   // the list itself is never used read‑only
+    m.cache.attach(m.dev);
+    diskRead(start + 1, static_cast<int>(header.inodeBlocks), m.inodeTable->blocks.data());
+    return h;
+}
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Replay (sfs_replay).  Runs the API calls of a trace against a freshly
+//  formatted image on a mount of its own, set up with the traced mount's
+//  cache size, writeback, dedup and log settings, in trace order, either back to
+//  back or at the recorded pace.  Recorded descriptors are mapped to the
+//  ones the replay's opens return.  Written data is a fixed pseudo‑random
+//  pattern, since traces do not keep it.  The trace's disk records are only
+//  counted, for comparison with the I/O the replay itself causes.
+//─────────────────────────────────────────────────────────────────────────────
+
+/// Reads one record and its paths; false at the end of the trace.
+inline bool readTraceRecord(std::FILE* in, TraceRecord& r, std::string& path, std::string& path2)
+{
+    if (std::fread(&r, sizeof(r), 1, in) != 1) return false;
+    path.resize(r.pathLen);
+    if (r.pathLen && std::fread(path.data(), 1, r.pathLen, in) != r.pathLen) return false;
+    const std::size_t nul = path.find('\0');
+    path2.clear();
+    if (nul != std::string::npos) {
+        path2 = path.substr(nul + 1);
+        path.resize(nul);
+    }
+    return true;
+}
+
+/// Image transfers caused by the replay (a disk_trace_fn context).
+struct ReplayDiskCount {
+    std::atomic<int> reads {0}, writes {0};
+
+    static void hook(void* ctx, int write, int, int, int, long long, long long)
+    {
+        auto* c = static_cast<ReplayDiskCount*>(ctx);
+        ++(write ? c->writes : c->reads);
+    }
+};
+
+inline double percentileUs(const std::vector<std::uint32_t>& sorted, double p)
+{
+    return sorted.empty() ? 0.0 : sorted[static_cast<std::size_t>(p * (sorted.size() - 1))] / 1000.0;
+}
+
+inline double meanUs(const std::vector<std::uint32_t>& v)
+{
+    double sum = 0;
+    for (std::uint32_t x : v) sum += x;
+    return v.empty() ? 0.0 : sum / v.size() / 1000.0;
+}
+
+inline int replayTrace(const char* tracePath, const char* image, bool timed, sfs_replay_report& rep)
+{
+    rep = {};
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> in(std::fopen(tracePath, "rb"), &std::fclose);
+    TraceHeader h;
+    if (!in || std::fread(&h, sizeof(h), 1, in.get()) != 1) {
+        std::cerr << "[SFS] Cannot read trace " << tracePath << ".\n";
+        return -1;
+    }
+    if (h.magic != TRACE_MAGIC || h.version != TRACE_VERSION || h.blockSize != BLOCK_SIZE ||
+        h.totalBlocks != TOTAL_BLOCKS) {
+        std::cerr << "[SFS] " << tracePath << " is not a trace of this file system layout.\n";
+        return -1;
+    }
+    sfs_mount* m = sfs_mount_open(image, 1);
+    if (!m) return -1;
+    sfs_set_cache_blocks_m(m, static_cast<int>(h.cacheBlocks));
+    sfs_set_writeback_m(m, (h.flags & TRACE_WRITEBACK) != 0);
+    sfs_set_dedup_m(m, (h.flags & TRACE_DEDUP) != 0);
+    if (h.flags & TRACE_LOG) sfs_set_log_mode_m(m, 1);
+    ReplayDiskCount disk;
+    disk_set_trace(m->mount.dev, &ReplayDiskCount::hook, &disk);
+
+    std::array<int, MAX_OPEN_FILES> fds;             // recorded descriptor → replay descriptor
+    fds.fill(-1);
+    auto fdOf = [&](std::int32_t fd) { return fd >= 0 && fd < static_cast<std::int32_t>(MAX_OPEN_FILES) ? fds[fd] : -1; };
+    constexpr std::int32_t MAX_IO = MAX_FILE_BLOCKS * BLOCK_SIZE;
+    std::vector<char> data(MAX_IO);
+    std::uint64_t x = 0x9E3779B97F4A7C15ull;         // xorshift64 pattern
+    for (char& c : data) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        c = static_cast<char>(x);
+    }
+
+    std::vector<sfs_dirent_plus> plus(MAX_INODES);   // sfs_readdir_plus output
+    std::vector<std::uint32_t> lat, recorded;
+    TraceRecord   r;
+    std::string   path, path2;
+    std::uint64_t first = 0;
+    const std::uint64_t t0 = Tracer::now();
+    while (readTraceRecord(in.get(), r, path, path2)) {
+        if (r.op == TRACE_DISK_READ || r.op == TRACE_DISK_WRITE) {
+            ++(r.op == TRACE_DISK_READ ? rep.trace_disk_reads : rep.trace_disk_writes);
+            continue;
+        }
+        if (lat.empty()) first = r.start;
+        if (timed && r.start > first) {
+            const std::uint64_t due = t0 + (r.start - first), now = Tracer::now();
+            if (due > now) std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        const std::int32_t len = std::clamp<std::int32_t>(r.length, 0, MAX_IO);
+        std::array<char, MAX_FILE_NAME_LEN + 1> name {};
+        const std::uint64_t begin = Tracer::now();
+        int rc = -1;
+        switch (r.op) {
+        case TRACE_FOPEN:
+            rc = sfs_fopen_m(m, path.c_str());
+            if (rc >= 0 && r.result >= 0 && r.result < static_cast<std::int32_t>(MAX_OPEN_FILES)) fds[r.result] = rc;
+            break;
+        case TRACE_FCLOSE:
+            rc = sfs_fclose_m(m, fdOf(r.fd));
+            if (fdOf(r.fd) >= 0) fds[r.fd] = -1;
+            break;
+        case TRACE_FSEEK:           rc = sfs_fseek_m(m, fdOf(r.fd), r.offset); break;
+        case TRACE_FWRITE:          rc = sfs_fwrite_m(m, fdOf(r.fd), data.data(), len); break;
+        case TRACE_FREAD:           rc = sfs_fread_m(m, fdOf(r.fd), data.data(), len); break;
+        case TRACE_FALLOCATE:       rc = sfs_fallocate_m(m, fdOf(r.fd), r.offset, r.length); break;
+        case TRACE_FTRUNCATE:       rc = sfs_ftruncate_m(m, fdOf(r.fd), r.offset); break;
+        case TRACE_REMOVE:          rc = sfs_remove_m(m, path.c_str()); break;
+        case TRACE_CLONE:           rc = sfs_clone_m(m, path.c_str(), path2.c_str()); break;
+        case TRACE_GETFILESIZE:     rc = sfs_getfilesize_m(m, path.c_str()); break;
+        case TRACE_GETNEXTFILENAME: rc = sfs_getnextfilename_m(m, name.data()); break;
+        case TRACE_MKDIR:           rc = sfs_mkdir_m(m, path.c_str()); break;
+        case TRACE_RMDIR:           rc = sfs_rmdir_m(m, path.c_str()); break;
+        case TRACE_READDIR:
+            std::strncpy(name.data(), path2.c_str(), MAX_FILE_NAME_LEN);
+            rc = sfs_readdir_m(m, path.c_str(), name.data());
+            break;
+        case TRACE_SYNC:            rc = sfs_sync_m(m); break;
+        case TRACE_FSYNC:           rc = sfs_fsync_m(m, fdOf(r.fd)); break;
+        case TRACE_FADVISE:         rc = sfs_fadvise_m(m, fdOf(r.fd), r.offset, r.length, r.arg); break;
+        case TRACE_READDIR_PLUS: {
+            sfs_dir_cursor cursor {};
+            cursor.slot = r.offset;
+            std::strncpy(cursor.last, path2.c_str(), MAX_FILE_NAME_LEN);
+            rc = sfs_readdir_plus_m(m, path.c_str(), &cursor, plus.data(),
+                                    std::min<std::int32_t>(r.length, static_cast<std::int32_t>(plus.size())));
+            break;
+        }
+        case TRACE_SNAPSHOT_CREATE: rc = sfs_snapshot_create_m(m, path.c_str()); break;
+        case TRACE_SNAPSHOT_DELETE: rc = sfs_snapshot_delete_m(m, path.c_str()); break;
+        case TRACE_SNAPSHOT_LIST:
+            std::strncpy(name.data(), path.c_str(), MAX_FILE_NAME_LEN);
+            rc = sfs_snapshot_list_m(m, name.data());
+            break;
+        case TRACE_DEFRAG_STEP:     rc = sfs_defrag_step_m(m, r.length); break;
+        case TRACE_LOG_CLEAN:       rc = sfs_log_clean_m(m, r.length); break;
+        case TRACE_SET_DEDUP:       rc = sfs_set_dedup_m(m, r.length); break;
+        case TRACE_SET_CACHE_BLOCKS: rc = sfs_set_cache_blocks_m(m, r.length); break;
+        case TRACE_SET_WRITEBACK:   rc = sfs_set_writeback_m(m, r.length); break;
+        case TRACE_SET_DISCARD:     rc = sfs_set_discard_m(m, r.length); break;
+        case TRACE_SET_LOG_MODE:    rc = sfs_set_log_mode_m(m, r.length); break;
+        default:
+            std::cerr << "[SFS] Unknown record in trace " << tracePath << "; replay stopped.\n";
+            sfs_mount_close(m);
+            return -1;
+        }
+        lat.push_back(static_cast<std::uint32_t>(std::min<std::uint64_t>(Tracer::now() - begin, UINT32_MAX)));
+        recorded.push_back(r.duration);
+        if (r.op == TRACE_FREAD && rc > 0)  rep.bytes_read    += rc;
+        if (r.op == TRACE_FWRITE && rc > 0) rep.bytes_written += rc;
+        if ((rc < 0) != (r.result < 0)) ++rep.mismatches;
+        rep.trace_seconds = (r.start + r.duration - first) / 1e9;
+    }
+    rep.seconds = (Tracer::now() - t0) / 1e9;
+    const int closed = sfs_mount_close(m);   // counts the final writeback too
+
+    rep.ops = static_cast<int>(lat.size());
+    std::sort(lat.begin(), lat.end());
+    std::sort(recorded.begin(), recorded.end());
+    rep.mean_us       = meanUs(lat);
+    rep.p50_us        = percentileUs(lat, 0.50);
+    rep.p99_us        = percentileUs(lat, 0.99);
+    rep.max_us        = lat.empty() ? 0.0 : lat.back() / 1000.0;
+    rep.trace_mean_us = meanUs(recorded);
+    rep.trace_p99_us  = percentileUs(recorded, 0.99);
+    rep.disk_reads    = disk.reads;
+    rep.disk_writes   = disk.writes;
+    return closed;
+}
+
+} // namespace detail
+
+//─────────────────────────────────────────────────────────────────────────────
+//  Handle‑based API – the same operations on an explicit mount.  Each call
+//  takes the mount's lock for its duration, so one mount may be shared
+//  between threads while separate mounts proceed fully in parallel.
+//─────────────────────────────────────────────────────────────────────────────
+
+extern "C" {
+
+sfs_mount* sfs_mount_open(const char* image, int fresh)
+{
+    using namespace detail;
+
+    if (!image) return nullptr;
+    sfs_mount* h = openMount(fresh, [&] {
+        char* name = const_cast<char*>(image);
+        if (fresh) std::remove(image);
+        return fresh ? open_fresh_disk(name, BLOCK_SIZE, TOTAL_BLOCKS)
+                     : open_disk(name, BLOCK_SIZE, TOTAL_BLOCKS);
+    });
+    if (!h) std::cerr << "[SFS] Cannot open image " << image << ".\n";
+    return h;
+}
+
+sfs_mount* sfs_mount_open_striped(const char* const* images, int count, int stripe_blocks, int fresh)
+{
+    using namespace detail;
+
+    if (!images || count < 1 || stripe_blocks < 1) return nullptr;
+    sfs_mount* h = openMount(fresh, [&] {
+        return open_striped_disk(const_cast<char**>(images), count, stripe_blocks, fresh,
+                                 BLOCK_SIZE, TOTAL_BLOCKS);
+    });
+    if (!h) std::cerr << "[SFS] Cannot open striped set of " << count << " images.\n";
+    return h;
+}
+
+sfs_mount* sfs_mount_open_direct(const char* image, int fresh)
+{
+    using namespace detail;
+
+    if (!image) return nullptr;
+    sfs_mount* h = openMount(fresh, [&] {
+        return open_direct_disk(const_cast<char*>(image), fresh, BLOCK_SIZE, TOTAL_BLOCKS);
+    });
+    if (!h) std::cerr << "[SFS] Cannot open image " << image << " for direct I/O.\n";
+    return h;
+}
+
+/// Periodic checkpointer of a RAM mount: every *sec* seconds, syncs the
+/// mount under its lock.  The disk's own checkpoint thread would copy
+/// blocks out in the middle of an operation, leaving an image file that
+/// no state of the file system ever matched.
+static void checkpointMain(Mount& m, int sec)
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lk(m.ckptMu);
+            if (m.ckptCv.wait_for(lk, std::chrono::seconds(sec), [&] { return m.ckptStop; })) break;
         }
+        IoTicket ticket(m.qos, SFS_IO_BACKGROUND, 0, [&] {
+            std::lock_guard<std::mutex> lk(m.ckptMu);
+            return m.ckptStop;
+        });
+        if (ticket.cancelled()) break;
+        MountScope scope(m);
+        syncAll();
+    }
+}
+
+/// Stops and joins the checkpointer.  Must not be called with the mount
+/// lock held.
+static void checkpointStop(Mount& m)
+{
+    {
+        std::lock_guard<std::mutex> lk(m.ckptMu);
+        m.ckptStop = true;
+    }
+    m.ckptCv.notify_all();
+    m.qos.wake();
+    if (m.ckptThread.joinable()) m.ckptThread.join();
+}
+
+sfs_mount* sfs_mount_open_ram(const char* image, int fresh, int checkpoint_sec)
+{
+    using namespace detail;
+
+    fresh = fresh || !image;   // a scratch disk starts empty
+    sfs_mount* h = openMount(fresh, [&] {
+        return open_ram_disk(const_cast<char*>(image), fresh, 0, BLOCK_SIZE, TOTAL_BLOCKS);
+    });
+    if (!h) {
+        std::cerr << "[SFS] Cannot open a RAM disk" << (image ? " on image " : "") << (image ? image : "") << ".\n";
+        return nullptr;
     }
-    g_rootDir->cursor = 0;   // rewind for next full listing
-    return -1;               // end of directory
+    sfs_set_cache_blocks_m(h, 0);   // a cached copy of memory would only cost a second memcpy
+    if (image && fresh) sfs_sync_m(h);   // the image holds the empty file system from the start
+    if (image && checkpoint_sec > 0)
+        h->mount.ckptThread = std::thread(checkpointMain, std::ref(h->mount), checkpoint_sec);
+    return h;
+}
+
+int sfs_mount_close(sfs_mount* h)
+{
+    if (!h) return -1;
+    // Refuse before anything is torn down, so a refused close leaves the
+    // mount as it was.  Once committed, no new view or snapshot mount can
+    // appear while the background threads are stopped.
+    const int busy = detail::onMount(h, [&] {
+        for (const auto& pins : mnt().snapshotPins)
+            if (pins > 0) {
+                std::cerr << "[SFS] Close the snapshot mounts of this image first.\n";
+                return -1;
+            }
+        if (mnt().readViews > 0) {
+            std::cerr << "[SFS] Release the read views of this mount first.\n";
+            return -1;
+        }
+        mnt().closing = true;
+        return 0;
+    });
+    if (busy != 0) return -1;
+    detail::defragStop(h->mount);
+    detail::logStop(h->mount);
+    checkpointStop(h->mount);
+    const int rc = detail::onMount(h, [&] {
+        for (auto& e : mnt().fdTable->fds)
+            if (!e.free) detail::releasePrealloc(e);
+        if (mnt().logDirty) detail::logCheckpoint();
+        const int flushed = mnt().cache.setWriteback(false);
+        if (flushed == 0) detail::flushDiscards(true);
+        mnt().cache.attach(nullptr);
+        sfs_trace_stop();
+        if (mnt().origin) --mnt().origin->snapshotPins[mnt().originSlot];   // disk belongs to the origin
+        else              disk_close(mnt().dev);
+        mnt().dev = nullptr;
+        return flushed;
+    });
+    delete h;
+    return rc;
 }
 
+int sfs_getnextfilename_m(sfs_mount* h, char* out)
+{ return detail::onMount(h, [&] { return sfs_getnextfilename(out); }); }
+
+int sfs_getfilesize_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_getfilesize(path); }); }
+
+int sfs_fopen_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_fopen(path); }); }
+
+int sfs_fclose_m(sfs_mount* h, int fd)
+{ return detail::onMount(h, [&] { return sfs_fclose(fd); }); }
+
+int sfs_fwrite_m(sfs_mount* h, int fd, const char* buf, int length)
+{ return detail::onMountIo(h, fd, length, [&] { return sfs_fwrite(fd, buf, length); }); }
+
+int sfs_fread_m(sfs_mount* h, int fd, char* buf, int length)
+{ return detail::onMountIo(h, fd, length, [&] { return sfs_fread(fd, buf, length); }); }
+
+int sfs_fseek_m(sfs_mount* h, int fd, int loc)
+{ return detail::onMount(h, [&] { return sfs_fseek(fd, loc); }); }
+
+int sfs_fallocate_m(sfs_mount* h, int fd, int offset, int len)
+{ return detail::onMountIo(h, fd, 0, [&] { return sfs_fallocate(fd, offset, len); }); }
+
+int sfs_ftruncate_m(sfs_mount* h, int fd, int size)
+{ return detail::onMountIo(h, fd, 0, [&] { return sfs_ftruncate(fd, size); }); }
+
+int sfs_read_view_m(sfs_mount* h, int fd, int length, sfs_view* view)
+{ return detail::onMountIo(h, fd, length, [&] { return sfs_read_view(fd, length, view); }); }
+
+int sfs_remove_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_remove(path); }); }
+
+int sfs_clone_m(sfs_mount* h, const char* src, const char* dst)
+{ return detail::onMount(h, [&] { return sfs_clone(src, dst); }); }
+
+int sfs_set_dedup_m(sfs_mount* h, int enable)
+{ return detail::onMount(h, [&] { sfs_set_dedup(enable); return 0; }); }
+
+int sfs_set_cache_blocks_m(sfs_mount* h, int blocks)
+{ return detail::onMount(h, [&] { return sfs_set_cache_blocks(blocks); }); }
+
+int sfs_set_writeback_m(sfs_mount* h, int enable)
+{ return detail::onMount(h, [&] { return sfs_set_writeback(enable); }); }
+
+int sfs_set_discard_m(sfs_mount* h, int background)
+{ return detail::onMount(h, [&] { return sfs_set_discard(background); }); }
+
+int sfs_sync_m(sfs_mount* h)
+{ return detail::onMount(h, [&] { return sfs_sync(); }); }
+
+int sfs_fsync_m(sfs_mount* h, int fd)
+{ return detail::onMount(h, [&] { return sfs_fsync(fd); }); }
+
+int sfs_fadvise_m(sfs_mount* h, int fd, int offset, int len, int advice)
+{ return detail::onMount(h, [&] { return sfs_fadvise(fd, offset, len, advice); }); }
+
+int sfs_fsck_m(sfs_mount* h, int repair, sfs_fsck_report* report)
+{ return detail::onMount(h, [&] { return sfs_fsck(repair, report); }); }
+
+int sfs_file_extents_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_file_extents(path); }); }
+
+int sfs_fragmentation_m(sfs_mount* h, sfs_frag_report* report)
+{ return detail::onMount(h, [&] { return sfs_fragmentation(report); }); }
+
+int sfs_defrag_step_m(sfs_mount* h, int max_blocks)
+{ return detail::onMount(h, [&] { return sfs_defrag_step(max_blocks); }); }
+
+int sfs_defrag_start_m(sfs_mount* h, int blocks_per_sec)
+{ return detail::onMount(h, [&] { return detail::defragStart(blocks_per_sec); }); }
+
+int sfs_defrag_stop_m(sfs_mount* h)
+{
+    if (!h) return -1;
+    detail::defragStop(h->mount);
+    return 0;
+}
+
+int sfs_set_log_mode_m(sfs_mount* h, int enable)
+{
+    if (!h) return -1;
+    if (!enable) detail::logStop(h->mount);
+    const int rc = detail::onMount(h, [&] { return sfs_set_log_mode(enable); });
+    if (rc == 0 && enable) detail::logStart(h->mount);
+    return rc;
+}
+
+int sfs_log_status_m(sfs_mount* h, sfs_log_report* report)
+{ return detail::onMount(h, [&] { return sfs_log_status(report); }); }
+
+int sfs_log_clean_m(sfs_mount* h, int segments)
+{ return detail::onMount(h, [&] { return sfs_log_clean(segments); }); }
+
 //─────────────────────────────────────────────────────────────────────────
-//  Convenience wrapper that returns the byte‑size of *filename* or −1.
+//  I/O classes (see IoScheduler).  Only handle mounts have them: the
+//  scheduler admits calls to the mount lock, which the legacy API lacks.
 //─────────────────────────────────────────────────────────────────────────
 
-int sfs_getfilesize(const char* filename)
+int sfs_io_class_set_m(sfs_mount* h, int cls, const sfs_io_class* cfg)
+{
+    if (!h || !cfg || cls < 0 || cls >= SFS_IO_CLASSES) return -1;
+    if (cfg->weight < 1 || cfg->iops < 0 || cfg->bytes_per_sec < 0) {
+        std::cerr << "[SFS] Invalid I/O class settings.\n";
+        return -1;
+    }
+    h->mount.qos.configure(cls, *cfg);
+    return 0;
+}
+
+int sfs_io_class_get_m(sfs_mount* h, int cls, sfs_io_class* cfg)
+{
+    if (!h || !cfg || cls < 0 || cls >= SFS_IO_CLASSES) return -1;
+    *cfg = h->mount.qos.config(cls);
+    return 0;
+}
+
+int sfs_io_assign_m(sfs_mount* h, int fd, int cls)
+{
+    if (!h || cls < 0 || cls >= SFS_IO_CLASSES) return -1;
+    return detail::onMount(h, [&] {
+        if (fd < 0 || static_cast<std::size_t>(fd) >= mnt().fdTable->fds.size() || mnt().fdTable->fds[fd].free)
+            return -1;
+        mnt().qos.assign(fd, cls);
+        return 0;
+    });
+}
+
+int sfs_io_stats_m(sfs_mount* h, int cls, sfs_io_stats* out)
+{
+    if (!h || !out || cls < 0 || cls >= SFS_IO_CLASSES) return -1;
+    *out = h->mount.qos.stats(cls);
+    return 0;
+}
+
+int sfs_snapshot_create_m(sfs_mount* h, const char* name)
+{ return detail::onMount(h, [&] { return sfs_snapshot_create(name); }); }
+
+int sfs_snapshot_delete_m(sfs_mount* h, const char* name)
+{ return detail::onMount(h, [&] { return sfs_snapshot_delete(name); }); }
+
+int sfs_snapshot_list_m(sfs_mount* h, char* name)
+{ return detail::onMount(h, [&] { return sfs_snapshot_list(name); }); }
+
+sfs_mount* sfs_snapshot_open_m(sfs_mount* h, const char* name)
+{ return h ? detail::openSnapshot(h->mount, name) : nullptr; }
+
+sfs_mount* sfs_snapshot_open(const char* name)
+{ return detail::openSnapshot(mnt(), name); }
+
+int sfs_trace_start_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_trace_start(path); }); }
+
+int sfs_trace_stop_m(sfs_mount* h)
+{ return detail::onMount(h, [&] { return sfs_trace_stop(); }); }
+
+int sfs_replay(const char* trace, const char* image, int timed, sfs_replay_report* report)
 {
-    const int ino = detail::inodeOf(filename);
-    return (ino < 0) ? -1 : (*g_inodeTable)[ino].size;
+    sfs_replay_report local;
+    if (!trace || !image) return -1;
+    return detail::replayTrace(trace, image, timed != 0, report ? *report : local);
 }
 
+int sfs_mkdir_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_mkdir(path); }); }
+
+int sfs_rmdir_m(sfs_mount* h, const char* path)
+{ return detail::onMount(h, [&] { return sfs_rmdir(path); }); }
+
+int sfs_readdir_m(sfs_mount* h, const char* path, char* name)
+{ return detail::onMount(h, [&] { return sfs_readdir(path, name); }); }
+
+int sfs_readdir_plus_m(sfs_mount* h, const char* path, sfs_dir_cursor* cursor, sfs_dirent_plus* out, int max)
+{ return detail::onMount(h, [&] { return sfs_readdir_plus(path, cursor, out, max); }); }
+
 } // extern "C"
 
 } // namespace sfs
@@ -1,6 +1,8 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <stdio.h>
+
 // You can add more into this file.
 
 void mksfs(int);
@@ -19,6 +21,346 @@ int sfs_fread(int, char*, int);
 
 int sfs_fseek(int, int);
 
+int sfs_fallocate(int, int, int);
+
+// Sets the size of an open file.  Blocks past the new end are freed;
+// growing leaves a hole that reads as zeros and takes no space.
+int sfs_ftruncate(int, int);
+
+// Zero-copy read: like sfs_fread, but the view is filled with spans that
+// point straight at the cached blocks (holes at a shared zero block)
+// instead of copying them out.  The blocks stay pinned, unchanged by
+// later writes, until sfs_release_view; release every view before the
+// mount is closed.  Returns the bytes in the view, 0 at the end of the
+// file, -1 on error.
+typedef struct sfs_span {
+    const char *data;
+    int         len;
+} sfs_span;
+
+typedef struct sfs_view {
+    const sfs_span *spans;
+    int             count;   // spans
+    int             bytes;   // sum of their lengths
+    void           *priv;    // owned by the library
+} sfs_view;
+
+int sfs_read_view(int, int, sfs_view*);
+
+int sfs_release_view(sfs_view*);
+
 int sfs_remove(char*);
 
+// Creates dst as a copy of the file src that shares its data blocks; a
+// block is copied on its first write through either name.
+int sfs_clone(const char*, const char*);
+
+void sfs_set_dedup(int);
+
+// Resizes the block cache (in blocks, 0 disables it); drops its contents.
+int sfs_set_cache_blocks(int);
+
+// Turns on (1) or off (0) delayed writeback through the block cache; a
+// flusher thread then writes dirty blocks back.  Turning it off flushes.
+int sfs_set_writeback(int);
+
+// Punches blocks out of the image once they are freed, giving the space
+// back to the host; with background set a worker thread does the punching.
+int sfs_set_discard(int);
+
+// Write back all dirty blocks, or those of one open file plus the fixed
+// metadata.
+int sfs_sync(void);
+
+int sfs_fsync(int);
+
+// Access-pattern hints for sfs_fadvise(fd, offset, len, advice), as in
+// posix_fadvise; len 0 means up to the end of the file.
+#define SFS_FADV_NORMAL     0
+#define SFS_FADV_RANDOM     1   // no read-ahead
+#define SFS_FADV_SEQUENTIAL 2   // long read-ahead, cached blocks evicted first
+#define SFS_FADV_WILLNEED   3   // read the range in the background
+#define SFS_FADV_DONTNEED   4   // drop the range from the cache
+
+int sfs_fadvise(int, int, int, int);
+
+// Copy-on-write snapshots of the whole file system, named like files.
+// sfs_snapshot_list iterates like sfs_readdir: start with an empty name.
+int sfs_snapshot_create(const char*);
+
+int sfs_snapshot_delete(const char*);
+
+int sfs_snapshot_list(char*);
+
+// Result of sfs_fsck.  A problem may be counted under more than one
+// heading when one fault causes another (a cleared pointer leaks a block).
+typedef struct sfs_fsck_report {
+    int inodes;         // allocated inodes checked, snapshots included
+    int blocks;         // blocks in use
+    int threads;        // scanner threads used
+    int bad_super;      // super-block fields and snapshot slots
+    int bad_inodes;     // inode fields out of range, wrong directory sizes
+    int bad_pointers;   // block pointers out of range or into meta-data
+    int dup_blocks;     // meta-data blocks claimed twice (the later claim
+                        // is also a bad pointer or damaged directory)
+    int bad_entries;    // directory entries and B+tree nodes dropped
+    int orphans;        // allocated inodes no directory reaches
+    int lost_blocks;    // in use but free in the bitmap
+    int leaked_blocks;  // allocated in the bitmap but unreachable
+    int bad_refcounts;  // reference counts and fingerprints that disagree
+    int problems;       // all of the above
+    int repaired;       // of which fixed
+} sfs_fsck_report;
+
+// Checks the file system; with repair set, also fixes what it can (all
+// files and snapshot mounts must be closed).  Returns 0 if it is
+// consistent, 1 if every problem was repaired and -1 otherwise.
+int sfs_fsck(int, sfs_fsck_report*);
+
+// Fragmentation summary, see sfs_fragmentation.
+typedef struct sfs_frag_report {
+    int files;          // files with at least one mapped block
+    int fragmented;     // of which stored in more than one run
+    int extents;        // runs of consecutive blocks over all files
+    int blocks;         // mapped file blocks
+    int free_runs;      // runs of free blocks
+    int largest_free;   // blocks in the longest free run
+    int running;        // 1 while the background defragmenter is active
+    int moved_files;    // files the defragmenter relocated since mounting
+    int moved_blocks;   // blocks it copied
+} sfs_frag_report;
+
+// Number of contiguous runs a file's blocks are stored in (0 if empty).
+int sfs_file_extents(const char*);
+
+int sfs_fragmentation(sfs_frag_report*);
+
+// Moves fragmented files into contiguous runs until about max_blocks
+// blocks were copied.  Returns the blocks moved, 0 once nothing is left
+// to do.  Files sharing blocks with a clone or snapshot are not moved.
+int sfs_defrag_step(int);
+
+// Turns the log-structured write mode on (1) or off (0); the setting is
+// stored in the image.  In log mode file data is appended sequentially
+// instead of overwritten, and the inode table and bitmap are written by a
+// checkpoint about once a second and on sfs_sync, sfs_fsync and unmount.
+// A crash loses at most the writes since the last checkpoint.
+int sfs_set_log_mode(int);
+
+// Log-mode summary, see sfs_log_status.
+typedef struct sfs_log_report {
+    int enabled;           // 1 in log mode
+    int head;              // block the next append goes to
+    int pending;           // superseded blocks the next checkpoint frees
+    int segments;          // cleaner segments in the data area
+    int clean_segments;    // of which without a live block
+    int checkpoints;       // checkpoints written since mounting
+    int cleaned_segments;  // segments the cleaner emptied
+    int cleaned_blocks;    // live blocks it moved to do so
+} sfs_log_report;
+
+int sfs_log_status(sfs_log_report*);
+
+// Empties up to n segments, best cost-benefit score first, by moving their
+// live blocks to the log head.  Returns the blocks moved, or -1 if not in
+// log mode or the disk filled up.
+int sfs_log_clean(int);
+
+// Writes a report on an image file to out (stdout if NULL): block and
+// inode usage, free runs by length, directory fill and the extents of
+// every file; as JSON if json is set.  The image is mapped read-only, not
+// mounted, so a mounted image is seen as last written.  Returns 0 or -1.
+int sfs_inspect(const char* image, int json, FILE* out);
+
+// Records every file and directory call on the file system, and every
+// transfer to and from its image, to a binary trace file until
+// sfs_trace_stop.  Data is not recorded, only positions and lengths.
+int sfs_trace_start(const char*);
+
+int sfs_trace_stop(void);
+
+// Result of sfs_replay.  Latencies are per API call.
+typedef struct sfs_replay_report {
+    int       ops;              // API calls replayed
+    int       mismatches;       // calls that failed where the original succeeded, or vice versa
+    long long bytes_read;
+    long long bytes_written;
+    double    seconds;          // wall time of the replay
+    double    trace_seconds;    // span of the same calls in the trace
+    double    mean_us, p50_us, p99_us, max_us;
+    double    trace_mean_us, trace_p99_us;   // as recorded
+    int       disk_reads, disk_writes;       // image transfers during the replay
+    int       trace_disk_reads, trace_disk_writes; // and in the trace
+} sfs_replay_report;
+
+// Replays a trace against a freshly formatted image, back to back or with
+// timed set at the recorded pace.  Returns 0, or -1 if the trace cannot be
+// read or the image cannot be created.
+int sfs_replay(const char* trace, const char* image, int timed, sfs_replay_report* report);
+
+int sfs_mkdir(const char*);
+
+int sfs_rmdir(const char*);
+
+int sfs_readdir(const char*, char*);
+
+// One record of sfs_readdir_plus.
+typedef struct sfs_dirent_plus {
+    char name[21];
+    int  inode;
+    int  size;
+} sfs_dirent_plus;
+
+// Caller-owned listing position; zero-initialise before the first call.
+typedef struct sfs_dir_cursor {
+    int  slot;      // unused, kept for the layout
+    char last[21];  // last name returned
+} sfs_dir_cursor;
+
+int sfs_readdir_plus(const char*, sfs_dir_cursor*, sfs_dirent_plus*, int);
+
+// Handle-based API: each sfs_mount owns its own image file and tables, so
+// several file systems can be used side by side.  Calls on one mount are
+// serialised by its lock; different mounts never contend.  The functions
+// above act on a built-in default mount backed by the legacy disk.
+typedef struct sfs_mount sfs_mount;
+
+sfs_mount* sfs_mount_open(const char* image, int fresh);
+
+// Same, on a RAID-0 set of `count` images striped in units of
+// `stripe_blocks` blocks; each image is served by its own I/O thread.
+sfs_mount* sfs_mount_open_striped(const char* const* images, int count, int stripe_blocks, int fresh);
+
+// Same, with the image opened for O_DIRECT I/O (falls back to buffered
+// I/O where the host file system does not support it).
+sfs_mount* sfs_mount_open_direct(const char* image, int fresh);
+
+// Same, on a RAM disk: the whole device is kept in (huge-page) memory.
+// With an image (may be NULL for a scratch disk) it is loaded on open
+// and written back on close, on sfs_sync/sfs_fsync and, if checkpoint_sec
+// is above 0, that often.  The block cache starts disabled.
+sfs_mount* sfs_mount_open_ram(const char* image, int fresh, int checkpoint_sec);
+
+int sfs_mount_close(sfs_mount*);
+
+int sfs_getnextfilename_m(sfs_mount*, char*);
+
+int sfs_getfilesize_m(sfs_mount*, const char*);
+
+int sfs_fopen_m(sfs_mount*, const char*);
+
+int sfs_fclose_m(sfs_mount*, int);
+
+int sfs_fwrite_m(sfs_mount*, int, const char*, int);
+
+int sfs_fread_m(sfs_mount*, int, char*, int);
+
+int sfs_fseek_m(sfs_mount*, int, int);
+
+int sfs_fallocate_m(sfs_mount*, int, int, int);
+
+int sfs_ftruncate_m(sfs_mount*, int, int);
+
+int sfs_read_view_m(sfs_mount*, int, int, sfs_view*);
+
+int sfs_remove_m(sfs_mount*, const char*);
+
+int sfs_clone_m(sfs_mount*, const char*, const char*);
+
+int sfs_set_dedup_m(sfs_mount*, int);
+
+int sfs_set_cache_blocks_m(sfs_mount*, int);
+
+int sfs_set_writeback_m(sfs_mount*, int);
+
+int sfs_set_discard_m(sfs_mount*, int);
+
+int sfs_sync_m(sfs_mount*);
+
+int sfs_fsync_m(sfs_mount*, int);
+
+int sfs_fadvise_m(sfs_mount*, int, int, int, int);
+
+int sfs_snapshot_create_m(sfs_mount*, const char*);
+
+int sfs_snapshot_delete_m(sfs_mount*, const char*);
+
+int sfs_snapshot_list_m(sfs_mount*, char*);
+
+int sfs_fsck_m(sfs_mount*, int, sfs_fsck_report*);
+
+int sfs_file_extents_m(sfs_mount*, const char*);
+
+int sfs_fragmentation_m(sfs_mount*, sfs_frag_report*);
+
+int sfs_defrag_step_m(sfs_mount*, int);
+
+// Defragments in the background, copying at most blocks_per_sec blocks a
+// second (0 = no limit), until nothing is left or sfs_defrag_stop_m.
+// sfs_mount_close stops it as well.
+int sfs_defrag_start_m(sfs_mount*, int);
+
+int sfs_defrag_stop_m(sfs_mount*);
+
+// On a mount in log mode a background thread checkpoints and keeps a few
+// segments free; it starts with the mode and stops with sfs_mount_close.
+int sfs_set_log_mode_m(sfs_mount*, int);
+
+int sfs_log_status_m(sfs_mount*, sfs_log_report*);
+
+int sfs_log_clean_m(sfs_mount*, int);
+
+// I/O classes of a mount.  Calls on a descriptor run in the descriptor's
+// class, the defragmenter and the log cleaner in SFS_IO_BACKGROUND.  When
+// several classes wait for the mount, the one with the highest priority
+// goes first and classes of equal priority share it by weight.  A class
+// over its limits waits, without blocking the others.
+#define SFS_IO_CLASSES     4
+#define SFS_IO_DEFAULT     0   // descriptors not assigned a class
+#define SFS_IO_BACKGROUND  3   // defaults to a lower priority than the rest
+
+typedef struct sfs_io_class {
+    int priority;          // higher goes first
+    int weight;            // share among classes of equal priority (>= 1)
+    int iops;              // calls per second, 0 = no limit
+    int bytes_per_sec;     // bytes read or written per second, 0 = no limit
+} sfs_io_class;
+
+typedef struct sfs_io_stats {
+    long long ops;         // calls admitted
+    long long bytes;       // bytes they asked to read or write
+    long long throttled;   // calls that had to wait
+    double    wait_ms;     // total time spent waiting
+    double    max_wait_ms; // longest single wait
+} sfs_io_stats;
+
+// Configures class cls; the first call turns the scheduler on.
+int sfs_io_class_set_m(sfs_mount*, int cls, const sfs_io_class*);
+
+int sfs_io_class_get_m(sfs_mount*, int cls, sfs_io_class*);
+
+// Puts an open descriptor in class cls until it is closed.
+int sfs_io_assign_m(sfs_mount*, int fd, int cls);
+
+int sfs_io_stats_m(sfs_mount*, int cls, sfs_io_stats*);
+
+// Mounts a snapshot read-only.  It shares the disk handle of the mount it
+// was opened from, so close it (sfs_mount_close) before that one; while
+// open, the snapshot cannot be deleted.
+sfs_mount* sfs_snapshot_open(const char*);
+
+sfs_mount* sfs_snapshot_open_m(sfs_mount*, const char*);
+
+int sfs_trace_start_m(sfs_mount*, const char*);
+
+int sfs_trace_stop_m(sfs_mount*);
+
+int sfs_mkdir_m(sfs_mount*, const char*);
+
+int sfs_rmdir_m(sfs_mount*, const char*);
+
+int sfs_readdir_m(sfs_mount*, const char*, char*);
+
+int sfs_readdir_plus_m(sfs_mount*, const char*, sfs_dir_cursor*, sfs_dirent_plus*, int);
+
 #endif
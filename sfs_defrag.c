@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_api.h"
+
+/*-------------------------------------------------------------------*/
+/*sfs_defrag: moves fragmented files of an SFS image into contiguous */
+/*runs of blocks.                                                    */
+/*  sfs_defrag [-r blocks_per_sec] [-n] [-d] image                   */
+/*-r limits the copy rate (default: no limit), -n only reports the   */
+/*fragmentation, -d opens the image with O_DIRECT.                   */
+/*-------------------------------------------------------------------*/
+#define POLL_US 100000
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r blocks_per_sec] [-n] [-d] image\n", prog);
+}
+
+static void print_report(const char *when, const sfs_frag_report *r)
+{
+    printf("%s: %d files, %d fragmented, %d extents over %d blocks; "
+           "%d free runs, largest %d blocks\n",
+           when, r->files, r->fragmented, r->extents, r->blocks, r->free_runs, r->largest_free);
+}
+
+int main(int argc, char **argv)
+{
+    int i, rate = 0, dry = 0, direct = 0, rc = 0;
+    const char *image = NULL;
+    sfs_mount *m;
+    sfs_frag_report r;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            rate = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0)
+            dry = 1;
+        else if (strcmp(argv[i], "-d") == 0)
+            direct = 1;
+        else if (argv[i][0] != '-' && !image)
+            image = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!image || rate < 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    m = direct ? sfs_mount_open_direct(image, 0) : sfs_mount_open(image, 0);
+    if (!m)
+    {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], image);
+        return 1;
+    }
+    sfs_fragmentation_m(m, &r);
+    print_report("before", &r);
+
+    if (!dry && r.fragmented)
+    {
+        if (sfs_defrag_start_m(m, rate) != 0)
+            rc = 1;
+        /*The defragmenter stops by itself after a sweep with nothing to move*/
+        while (rc == 0 && sfs_fragmentation_m(m, &r) == 0 && r.running)
+            usleep(POLL_US);
+        sfs_fragmentation_m(m, &r);
+        print_report("after", &r);
+        printf("moved %d files, %d blocks\n", r.moved_files, r.moved_blocks);
+    }
+    if (sfs_mount_close(m) != 0)
+        rc = 1;
+    return rc;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include "sfs_api.h"
+
+/*-------------------------------------------------------------------*/
+/*sfs_fsck: checks an SFS image and, with -y, repairs it.            */
+/*  sfs_fsck [-y] [-d] image                                         */
+/*-d opens the image with O_DIRECT. Exit status as for e2fsck: 0 the */
+/*image is consistent, 1 all problems were fixed, 4 problems are     */
+/*left, 8 the image could not be checked.                            */
+/*-------------------------------------------------------------------*/
+#define FSCK_OK         0
+#define FSCK_CORRECTED  1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR      8
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-y] [-d] image\n", prog);
+}
+
+static void print_line(const char *what, int count)
+{
+    if (count)
+        printf("  %-26s %d\n", what, count);
+}
+
+int main(int argc, char **argv)
+{
+    int i, rc, repair = 0, direct = 0;
+    const char *image = NULL;
+    sfs_mount *m;
+    sfs_fsck_report r;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-y") == 0)
+            repair = 1;
+        else if (strcmp(argv[i], "-d") == 0)
+            direct = 1;
+        else if (argv[i][0] != '-' && !image)
+            image = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (!image)
+    {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+
+    /*Mounting already runs a read-only check; this one may repair*/
+    m = direct ? sfs_mount_open_direct(image, 0) : sfs_mount_open(image, 0);
+    if (!m)
+    {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], image);
+        return FSCK_ERROR;
+    }
+    memset(&r, 0, sizeof(r));
+    rc = sfs_fsck_m(m, repair, &r);
+    if (sfs_mount_close(m) != 0)
+        rc = -1;
+
+    printf("%s: %d inodes, %d blocks in use, %d scanner threads\n", image, r.inodes, r.blocks, r.threads);
+    print_line("bad super-block fields", r.bad_super);
+    print_line("bad inodes", r.bad_inodes);
+    print_line("bad block pointers", r.bad_pointers);
+    print_line("multiply-claimed blocks", r.dup_blocks);
+    print_line("bad directory entries", r.bad_entries);
+    print_line("orphaned inodes", r.orphans);
+    print_line("lost blocks", r.lost_blocks);
+    print_line("leaked blocks", r.leaked_blocks);
+    print_line("bad reference counts", r.bad_refcounts);
+    printf("%d problems, %d repaired\n", r.problems, r.repaired);
+
+    if (rc == 0)
+        return FSCK_OK;
+    if (rc == 1)
+        return FSCK_CORRECTED;
+    return r.problems > r.repaired ? FSCK_UNCORRECTED : FSCK_ERROR;
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <string.h>
+#include "sfs_api.h"
+
+/*-------------------------------------------------------------------*/
+/*sfs_inspect: reports the layout of an SFS image without mounting   */
+/*it.                                                                */
+/*  sfs_inspect [-j] image                                           */
+/*-j prints the report as JSON.                                      */
+/*-------------------------------------------------------------------*/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j] image\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int i, json = 0;
+    const char *image = NULL;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+            json = 1;
+        else if (argv[i][0] != '-' && !image)
+            image = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!image)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    return sfs_inspect(image, json, stdout) == 0 ? 0 : 1;
+}
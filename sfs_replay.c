@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include "sfs_api.h"
+
+/*-------------------------------------------------------------------*/
+/*sfs_replay: replays a trace recorded with sfs_trace_start against  */
+/*a fresh image and reports throughput and latency.                  */
+/*  sfs_replay [-t] trace image                                      */
+/*-t keeps the recorded pace; by default calls run back to back. The */
+/*image is overwritten.                                              */
+/*-------------------------------------------------------------------*/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t] trace image\n", prog);
+}
+
+static double mib_per_sec(long long bytes, double seconds)
+{
+    return seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    int i, timed = 0;
+    const char *trace = NULL, *image = NULL;
+    sfs_replay_report r;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-t") == 0)
+            timed = 1;
+        else if (argv[i][0] != '-' && !trace)
+            trace = argv[i];
+        else if (argv[i][0] != '-' && !image)
+            image = argv[i];
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!trace || !image)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    memset(&r, 0, sizeof(r));
+    if (sfs_replay(trace, image, timed, &r) != 0)
+        return 1;
+
+    printf("%s: %d calls in %.3f s (recorded: %.3f s), %d with a different outcome\n",
+           trace, r.ops, r.seconds, r.trace_seconds, r.mismatches);
+    printf("  read    %lld bytes, %.1f MiB/s\n", r.bytes_read, mib_per_sec(r.bytes_read, r.seconds));
+    printf("  written %lld bytes, %.1f MiB/s\n", r.bytes_written, mib_per_sec(r.bytes_written, r.seconds));
+    printf("  latency mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           r.mean_us, r.p50_us, r.p99_us, r.max_us);
+    printf("  recorded latency mean %.1f us, p99 %.1f us\n", r.trace_mean_us, r.trace_p99_us);
+    printf("  image transfers %d reads, %d writes (recorded: %d reads, %d writes)\n",
+           r.disk_reads, r.disk_writes, r.trace_disk_reads, r.trace_disk_writes);
+    return 0;
+}